@@ -9,36 +9,87 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
 
-/* maximum number of employees that can be stored at once (relevant only
-   to storage using an array) */
-#define MAX_EMPLOYEES 200
-#define MAX_NAME_LENGTH 100
-#define MAX_JOB_LENGTH  100
-/* Employee structure
+/* Employee structure, laid out to fit in a 64-byte cache line
  */
 struct Employee
 {
         /* Employee details */
-        char name[MAX_NAME_LENGTH+1]; /* name string */
+        const char *name;        /* name string, kept in the string pool */
+        unsigned int job;        /* job number, see job_title() */
+        short age;               /* age */
         char sex;                /* sex identifier, either 'M' or 'F' */
-        int age;                 /* age */
-        char job[MAX_JOB_LENGTH+1]; /* job string */
+
+        /* height of the employee in the name index, an AVL tree kept
+           alongside the list so that positions are found in O(log n)
+           rather than by walking the list, and its children there */
+        signed char height;
 
         /* pointers to previous and next employee structures in the linked list
            (for if you use a linked list instead of an array) */
         struct Employee *prev, *next;
+        struct Employee *left, *right;
+
+        /* positions in the age bucket and job posting list, see
+           query_index_add() */
+        unsigned int age_slot, job_slot;
+
+        /* when the employee was added, higher for newer ones; it orders
+           employees with the same name, newest first */
+        uint64_t sequence;
 };
 static struct Employee *employee_list = NULL; /*pointer to the first employee in the list*/
+static struct Employee *employee_index = NULL; /*root of the name index tree*/
+static int database_modified = 0; /*set once an employee has been added or deleted*/
 
 /*Function Prototypes*/
 static int read_line ( FILE *fp, char *line, int max_length );
-static int read_string ( FILE *fp,
-                         char *prefix, char *string, int max_length );
+static int read_long_line ( FILE *fp, char **line, size_t *capacity );
+static const char *pool_string ( const char *text, size_t length );
+static unsigned int intern_job ( const char *text, size_t length );
+static const char *job_title ( unsigned int job );
 static void menu_add_employee(void);
 static void menu_print_database(void);
+static void menu_export_database(void);
+static void menu_query_ages(void);
+static void menu_query_job(void);
+static void menu_search_names(int anywhere);
 static void menu_delete_employee(void);
 static void read_employee_database ( char *file_name );
+static void link_sorted_employees ( struct Employee **records, size_t n );
+static void index_add_employee ( struct Employee *new );
+static void index_remove_employee ( struct Employee *old );
+static void name_table_insert ( struct Employee *employee );
+static void name_table_remove ( struct Employee *employee );
+static struct Employee *name_table_find ( const char *name );
+static void log_record ( const char *prefix, const char *name, size_t name_length,
+                         char sex, unsigned int age, const char *job, size_t job_length );
+static void log_employee ( const char *prefix, const struct Employee *employee );
+static void log_commit(void);
+static size_t search_names_starting ( const char *prefix, int fd );
+static size_t search_names_containing ( const char *text, int fd );
+static void search_index_add ( struct Employee *employee );
+static void search_index_remove ( struct Employee *employee );
+static void report_columns_add ( struct Employee *employee );
+static void report_columns_remove ( struct Employee *employee );
+static void print_report(void);
 
 
 /*******************************************************************************
@@ -90,315 +141,6985 @@ static int read_line ( FILE *fp, char *line, int max_length )
         return -1;
 }
 
+/* read_long_line():
+ *
+ * Like read_line(), but reads the whole line into "*line" however long it
+ * is, growing the buffer of "*capacity" characters with realloc() as
+ * needed. The buffer may start out NULL with a capacity of 0.
+ */
+static int read_long_line ( FILE *fp, char **line, size_t *capacity )
+{
+        size_t i = 0;
+        int ch;
+
+        for(;;)
+        {
+                /* make room for this character and the terminator */
+                if ( i + 2 > *capacity )
+                {
+                        *capacity = *capacity < 64 ? 128 : *capacity * 2;
+                        *line = realloc(*line, *capacity);
+                        if ( *line == NULL )
+                        {
+                                fprintf(stderr, "Out of memory, exiting\n");
+                                exit(EXIT_FAILURE);
+                        }
+                }
+
+                ch = fgetc(fp);
+                if ( ch == EOF )
+                {
+                        (*line)[i] = '\0';
+                        return -1;
+                }
+                if ( ch == '\n' )
+                {
+                        (*line)[i] = '\0';
+                        return 0;
+                }
+                (*line)[i++] = ch;
+        }
+}
+
 /*****************************************************************************
-*                              read_string():                               *
+*                          string storage functions                         *
 *                                                                           *
-* Reads a line from the input file pointer "fp", starting with the "prefix" *
-* string, and filling the string "string" with the remainder of the contents*
-* of the line. If the start of the line does not match the "prefix" string, *
-* the error condition (-1) is returned. Having read the prefix string,      *
-* read_string() calls read_line() to read the remainder of the line into    *
-* "string", up to a maximum length "max_length", and returns the result.    *
+* Names are copied into a string pool, a chain of large chunks that strings *
+* are packed into back to back, so that an employee holds just a pointer to *
+* its name whatever its length. Job titles repeat across many employees and *
+* are interned instead: each distinct title is pooled once and given a      *
+* number, and employees hold that number. Pooled strings live until the     *
+* program exits.                                                            *
 *****************************************************************************/
-static int read_string ( FILE *fp,
-                         char *prefix, char *string, int max_length )
+
+/* size of an ordinary string pool chunk */
+#define STRING_CHUNK_SIZE 65536
+
+struct StringChunk
 {
-        int i;
+        struct StringChunk *next;        /* previously allocated chunk */
+        size_t used, size;               /* bytes filled and available */
+        char text[];
+};
 
-        /* read prefix string */
-        for ( i = 0; i < strlen(prefix); i++ )
-                if ( fgetc(fp) != prefix[i] )
-                        /* file input doesn't match prefix */
-                        return -1;
+static struct StringChunk *string_pool = NULL; /* chunk being filled */
+static size_t string_pool_reserved = 0;        /* bytes in all chunks */
+static size_t string_pool_used = 0;            /* bytes taken by strings */
+
+static const char **job_titles = NULL;   /* job titles, indexed by job number */
+static unsigned int num_jobs = 0, max_jobs = 0;
+static unsigned int *job_table = NULL;   /* hash slots holding job number + 1, 0 if empty */
+static size_t job_table_size = 0;        /* number of slots, a power of two */
+
+#define NO_JOB ((unsigned int) -1)
+
+/* pool_string():
+ *
+ * Returns a copy of the "length" characters at "text", terminated with
+ * '\0', kept in the string pool.
+ */
+static const char *pool_string ( const char *text, size_t length )
+{
+        struct StringChunk *chunk;
+        size_t size;
+        char *copy;
+
+        if ( string_pool == NULL || string_pool->size - string_pool->used < length + 1 ) {
+                /* long strings get a chunk of their own */
+                size = length + 1 > STRING_CHUNK_SIZE / 4 ? length + 1 : STRING_CHUNK_SIZE;
+                chunk = malloc(sizeof(struct StringChunk) + size);
+                if ( chunk == NULL ) {
+                        fprintf(stderr, "Out of memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+                chunk->used = 0;
+                chunk->size = size;
+                string_pool_reserved += size;
+                if ( string_pool != NULL && size != STRING_CHUNK_SIZE ) {
+                        /* keep filling the current chunk afterwards */
+                        chunk->next = string_pool->next;
+                        string_pool->next = chunk;
+                } else {
+                        chunk->next = string_pool;
+                        string_pool = chunk;
+                }
+        } else
+                chunk = string_pool;
 
-        /* read remaining part of line of input into string */
-        return ( read_line ( fp, string, max_length ) );
+        copy = chunk->text + chunk->used;
+        memcpy(copy, text, length);
+        copy[length] = '\0';
+        chunk->used += length + 1;
+        string_pool_used += length + 1;
+        return copy;
 }
 
-/*******************************************************************************************
-*               menu_add_employee():                                                      *
-*                                                                                         *
-* Function that adds new employees to the database in their correct positions and keeps   *
-*  an ordered list.                                                                       *
-*  Creates a new node pointer and allocates memory to it dynamically.                     *
-*  Using the Surname as a sorting parameter it cycles through the list and ensures the    *
-*  new employee is placed in the right position to maintain the ordered list.             *
-*  Checks the input to ensure its valid before adding it to the list.                     *
-*******************************************************************************************/
+/* FNV-1a hash of the "length" characters at "text" */
+static unsigned long text_hash ( const char *text, size_t length )
+{
+        unsigned long hash = 14695981039346656037UL;
 
-static void menu_add_employee(void)
+        while ( length-- > 0 ) {
+                hash ^= (unsigned char) *text++;
+                hash *= 1099511628211UL;
+        }
+        return hash;
+}
+
+/* returns the number of the job title "text", of "length" characters, or
+   NO_JOB if no employee has had it */
+static unsigned int find_job ( const char *text, size_t length )
 {
-        struct Employee *new,*cur,*prev;
-        char agestring[4];                         /*sets up node pointers for new employee and current and previous positions*/
-        new = (struct Employee *) malloc (sizeof(struct Employee)); /*allocates a block of memory for the new employee dynamically*/
-        /*adds in the data*/
-        fprintf(stderr, "Employee Name [Surname, other names]: ");
-        do {
-                read_line(stdin, new->name, MAX_NAME_LENGTH);
-        } while (strcmp(new->name,"")==0||atoi(new->name)!=0);                       /*check for valid name input*/
+        const char *title;
+        size_t i;
 
-/*loop that checks surnames to determine the alphabetic position to place the new employee*/
-        for (cur = employee_list, prev = NULL;
-             cur != NULL && strcmp(new->name, cur->name) > 0;
-             prev = cur, cur = cur->next)
-                ;
-        fprintf(stderr, "Employee Gender [Enter F or M]: ");
-        do {
-                read_line (stdin, &new->sex, 1);
-                if (new->sex == 'f') new->sex = 'F';
-                if (new->sex == 'm') new->sex = 'M';
+        for ( i = text_hash(text, length) & (job_table_size - 1);
+              job_table_size != 0 && job_table[i] != 0;
+              i = (i + 1) & (job_table_size - 1) ) {
+                title = job_titles[job_table[i] - 1];
+                if ( strncmp(title, text, length) == 0 && title[length] == '\0' )
+                        return job_table[i] - 1;
         }
-        while (new->sex != 'F' && new->sex != 'M');             /*check for valid gender input*/
+        return NO_JOB;
+}
 
-        fprintf(stderr, "Employee Age: ");
-        do {
-                read_line(stdin,agestring,3);
-                new->age=atoi(agestring);       /*convert agestring into an integer*/
-                if (new->age <= 0)
-                        fprintf(stderr, "Incorrect age, please try again\n");
-        } while ((new->age <= 0));                              /*check for valid gender input*/
+/* intern_job():
+ *
+ * Returns the number of the job titled by the "length" characters at
+ * "text", adding the title to the dictionary if it is new.
+ */
+static unsigned int intern_job ( const char *text, size_t length )
+{
+        unsigned int *old = job_table, job = find_job(text, length);
+        size_t old_size = job_table_size, i;
 
-        fprintf(stderr, "Employee job: ");
-        do {
-                read_line(stdin, new->job, MAX_JOB_LENGTH);
-        } while (strcmp(new->job,"")==0||atoi(new->job)!=0);                         /*check for valid gender input*/
+        if ( job != NO_JOB )
+                return job;
 
+        /* a new title: make room for it, keeping the table at most half full */
+        if ( num_jobs == max_jobs ) {
+                max_jobs = max_jobs == 0 ? 64 : max_jobs * 2;
+                job_titles = realloc(job_titles, max_jobs * sizeof(const char *));
+                if ( job_titles == NULL ) {
+                        fprintf(stderr, "Out of memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+        if ( (num_jobs + 1) * 2 > job_table_size ) {
+                job_table_size = old_size == 0 ? 128 : old_size * 2;
+                job_table = calloc(job_table_size, sizeof(unsigned int));
+                if ( job_table == NULL ) {
+                        fprintf(stderr, "Out of memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+                for ( i = 0; i < num_jobs; i++ ) {
+                        size_t slot = text_hash(job_titles[i], strlen(job_titles[i]))
+                                      & (job_table_size - 1);
+                        while ( job_table[slot] != 0 )
+                                slot = (slot + 1) & (job_table_size - 1);
+                        job_table[slot] = i + 1;
+                }
+                free(old);
+        }
 
-        new->next = cur;              /*links the new employee to the next employee in the correct position determined by the cur pointer */
-        if (prev == NULL)
-                employee_list = new;  /*checks if there are no employees before the new employees in the list then assigns them the first position*/
-        else
-                prev->next = new;     /*links the new employee to the previous employee in the correct position completing the double link*/
+        job_titles[num_jobs] = pool_string(text, length);
+        for ( i = text_hash(text, length) & (job_table_size - 1); job_table[i] != 0;
+              i = (i + 1) & (job_table_size - 1) )
+                ;
+        job_table[i] = num_jobs + 1;
+        return num_jobs++;
 }
 
+/* returns the title of job number "job" */
+static const char *job_title ( unsigned int job )
+{
+        return job_titles[job];
+}
 
-/********************************************************************
-*         menu_print_database():                                   *
-*                                                                  *
-* Prints the  database of employees to standard output.            *
-*  It uses the pointer to the first employee (employee_list) and   *
-*  initialises it to the cur pointer which then cycles through     *
-* the list printing the details for each employee                  *
-********************************************************************/
-
-static void menu_print_database(void)
+/* release_strings():
+ *
+ * Frees the string pool and the job dictionary.
+ */
+static void release_strings(void)
 {
-        struct Employee *cur = employee_list; /*current node initialised to pointer of the first employee */
-        if (employee_list == NULL) /*displays message if there are no employees in the list*/
-                fprintf(stderr, "No Employee entries");
-        else {
-                do {                      /*loops through the list printing details for each employee*/
-                        printf("Name: %s\n", &cur->name);
-                        printf( "Sex: %c\n", cur->sex);
-                        printf( "Age: %i\n", cur->age);
-                        printf("Job: %s\n\n", &cur->job);
-                        cur = cur->next;
-                } while (cur != NULL);
+        struct StringChunk *chunk;
+
+        while ( string_pool != NULL ) {
+                chunk = string_pool;
+                string_pool = chunk->next;
+                free(chunk);
         }
+        string_pool_reserved = string_pool_used = 0;
+        free(job_titles);
+        free(job_table);
+        job_titles = NULL;
+        job_table = NULL;
+        num_jobs = max_jobs = 0;
+        job_table_size = 0;
 }
-/*********************************************************************************************
-*       menu_delete_employee():                                                             *
-*  Delete new employee from database.                                                       *
-* It creates an array to take input from the user of the employee to be                     *
-* deleted. It first checks if the list has employees and if empty prints                    *
-* an error message. If the list isn't empty, it searches the database for the employee      *
-* and if found, links the previous employee to the next employee and frees that memory.     *
-*********************************************************************************************/
-static void menu_delete_employee(void)
+
+/*****************************************************************************
+*                        employee allocator functions                       *
+*                                                                           *
+* Employee structures are carved out of large slabs rather than malloc'd    *
+* one at a time, so that loading a big database makes a few large           *
+* allocations and neighbouring employees sit next to each other in memory.  *
+* Deleted employees go on a free list, chained through their next pointers, *
+* and are reused before any new slot is taken. Everything is released in    *
+* bulk when the program exits.                                              *
+*****************************************************************************/
+
+/* number of employees in each slab */
+#define EMPLOYEES_PER_SLAB 1024
+
+struct EmployeeSlab
 {
-        struct Employee *cur,*prev;            /*sets up position nodes*/
+        struct EmployeeSlab *next;                       /* previously allocated slab */
+        struct Employee employees[EMPLOYEES_PER_SLAB];
+};
 
-        char name[MAX_NAME_LENGTH+1];          /*sets up an array for taking in the name to be deleted*/
-        if (employee_list == NULL)
-                fprintf(stderr, "Nothing to delete"); /*displays error if no entries in the list */
-        else {
-                fprintf(stderr, "Enter the name you wish to delete:\n");
-                read_line(stdin, name, MAX_NAME_LENGTH);
-                fprintf(stderr, "searching for: %s\n", name);
-                for (cur = employee_list, prev = NULL; /*checks the list for the name to be deleted comparing the name strings for each employee*/
-                     cur != NULL && strcmp(name, cur->name)!=0;
-                     prev = cur, cur= cur->next)
-                        ;
+static struct EmployeeSlab *employee_slabs = NULL; /* most recently allocated slab */
+static size_t num_slabs = 0;
+static size_t slab_used = EMPLOYEES_PER_SLAB; /* slots ever handed out from the newest slab */
+static struct Employee *free_employees = NULL; /* deleted employees awaiting reuse */
+static size_t num_free_employees = 0;
+static size_t num_live_employees = 0;
 
-                if (prev == NULL)                       /*if the employee to be deleted is first in the list, the second position becomes the first*/
-                        employee_list= employee_list->next;
-                else if(cur == NULL) {                  /*if the employee isn't found, display a message and leave the list as it before*/
-                        fprintf(stderr, "Employee: %s not found\n",name);
-                        return;
+/* alloc_employee():
+ *
+ * Returns space for one employee, reusing a deleted one if there is any.
+ */
+static struct Employee *alloc_employee(void)
+{
+        struct EmployeeSlab *slab;
+        struct Employee *employee;
+
+        num_live_employees++;
+        if ( free_employees != NULL ) {
+                employee = free_employees;
+                free_employees = employee->next;
+                num_free_employees--;
+                return employee;
+        }
+
+        if ( slab_used == EMPLOYEES_PER_SLAB ) {
+                slab = malloc(sizeof(struct EmployeeSlab));
+                if ( slab == NULL ) {
+                        fprintf(stderr, "Out of memory, exiting\n");
+                        exit(EXIT_FAILURE);
                 }
-                else
-                        prev->next = cur->next; /*if the employee is in any other position, link previous employee to the next*/
-                free(cur); /*free the current position memory effectively deleting them */
-                fprintf(stderr, "Deleted: %s\n", name);
+                slab->next = employee_slabs;
+                employee_slabs = slab;
+                num_slabs++;
+                slab_used = 0;
         }
+        return &employee_slabs->employees[slab_used++];
 }
 
+/* free_employee():
+ *
+ * Puts a deleted employee on the free list for reuse.
+ */
+static void free_employee ( struct Employee *employee )
+{
+        employee->next = free_employees;
+        free_employees = employee;
+        num_free_employees++;
+        num_live_employees--;
+}
 
-/******************************************************************************************
- *               read_employee_database ( char *file_name )                               *
- * This function reads a specified employee database.                                     *
- * It takes input from the specified command line file when argv is 1. It checks this     *
- * file for valid data, loops through it adding new employees to the database each time   *
- * and then closes the input file.                                                        *
- ****************************************************************************************/
-static void read_employee_database ( char *file_name )
+/* release_employees():
+ *
+ * Frees every slab, and with them every employee, at once.
+ */
+static void release_employees(void)
 {
-        FILE *input;
-        input = fopen(file_name, "r"); /*opens file as read-only*/
-        if (input == NULL) {     /*exits if file cannot be opened to prevent undefined behaviour*/
-                fprintf(stderr, "Could not open file, exiting\n");
-                exit(EXIT_FAILURE);
+        struct EmployeeSlab *slab;
+
+        while ( employee_slabs != NULL ) {
+                slab = employee_slabs;
+                employee_slabs = slab->next;
+                free(slab);
         }
-        char test;
-        char agestring[4];
-        int i;
-        int emp_num = 1;
-        /*prefix's for the data inputs*/
-        char *name = "Name: ";
-        char *sex = "Sex: ";
-        char *age = "Age: ";
-        char *job = "Job: ";
-        do {
+        num_slabs = 0;
+        slab_used = EMPLOYEES_PER_SLAB;
+        free_employees = NULL;
+        num_free_employees = 0;
+        num_live_employees = 0;
+}
 
-                struct Employee *new,*cur,*prev; /*sets up node pointers for new employee and current and previous positions*/
-                new = (struct Employee *) malloc (sizeof(struct Employee)); /*allocates a block of memory for the new employee dynamically*/
+/* menu_print_memory():
+ *
+ * Prints the allocator statistics to standard output. Fragmentation is the
+ * share of the slots handed out so far that are sitting on the free list.
+ */
+static void menu_print_memory(void)
+{
+        size_t handed_out = num_live_employees + num_free_employees;
 
-                if (employee_list != NULL)
-                        ungetc(test, input); /*if not first employee put back read character from test to stream*/
+        printf("Slabs: %zu of %d employees\n", num_slabs, EMPLOYEES_PER_SLAB);
+        printf("Bytes reserved: %zu\n", num_slabs * sizeof(struct EmployeeSlab));
+        printf("Bytes per employee: %zu\n", sizeof(struct Employee));
+        printf("Live employees: %zu\n", num_live_employees);
+        printf("Free list employees: %zu\n", num_free_employees);
+        printf("Unused slots: %zu\n", num_slabs * EMPLOYEES_PER_SLAB - handed_out);
+        printf("Fragmentation: %.1f%%\n",
+               handed_out == 0 ? 0.0 : 100.0 * num_free_employees / handed_out);
+        printf("String pool bytes reserved: %zu\n", string_pool_reserved);
+        printf("String pool bytes used: %zu\n", string_pool_used);
+        printf("Distinct jobs: %u\n\n", num_jobs);
+}
 
-                if (read_string(input, name, new->name, MAX_NAME_LENGTH) == -1) {
-                        fprintf(stderr, "Invalid name input with employee %i, exiting\n",emp_num);
-                        exit(EXIT_FAILURE);   /*exits if input data is wrong*/
-                }
-                if (strcmp(new->name,"")==0||atoi(new->name)!=0) {
-                        fprintf(stderr, "Invalid name with employee %i, exiting\n",emp_num);
-                        exit(EXIT_FAILURE);
-                }
-                /*loop that checks surnames to determine the alphabetic position to place the new employee*/
-                for (cur = employee_list, prev = NULL;
-                     cur != NULL && strcmp(new->name, cur->name) > 0;
-                     prev = cur, cur = cur->next)
-                        ;
+/*****************************************************************************
+*                      operation statistics functions                       *
+*                                                                           *
+* Loads, adds, deletes, finds and prints are timed with the processor's     *
+* cycle counter. Each time goes into a histogram with four buckets per      *
+* power of two, so percentiles can be read off to within a quarter without  *
+* keeping every sample. Name comparisons and hash probes are counted as     *
+* they happen. Cycles are turned into microseconds only when the figures    *
+* are printed, by comparing the counter with the clock since start-up.      *
+* Building with -DNO_STATS leaves all of this out.                          *
+*****************************************************************************/
 
-                if (read_string(input, sex, &new->sex, 1) == -1) {
-                        fprintf(stderr, "Invalid gender input with employee %i, exiting\n",emp_num);
-                        exit(EXIT_FAILURE);
-                }
-                if (new->sex == 'f') new->sex = 'F';
-                if (new->sex == 'm') new->sex = 'M'; /*checks for valid gender input and exits if input data is wrong*/
-                if (new->sex != 'F' && new->sex != 'M') {
-                        fprintf(stderr, "Invalid gender with employee %i, exiting\n",emp_num);
-                        exit(EXIT_FAILURE);
-                }
+#ifndef NO_STATS
 
-                if (read_string(input, age, agestring, 3) == -1) {
-                        fprintf(stderr, "Invalid age input with employee %i, exiting\n",emp_num);
-                        exit(EXIT_FAILURE);                                       /*checks for valid age input and exits if input data is wrong*/
-                }
-                new->age=atoi(agestring);         /*converts the agestring to an integer*/
-                if (new->age <= 0) {
-                        fprintf(stderr, "Incorrect age, with employee %i, exiting\n",emp_num);
-                        exit(EXIT_FAILURE);
-                }
+#define STAT_LOAD    0
+#define STAT_ADD     1
+#define STAT_DELETE  2
+#define STAT_FIND    3
+#define STAT_PRINT   4
+#define NUM_STATS    5
+#define STAT_BUCKETS 252
 
-                if (read_string(input, job, new->job, MAX_JOB_LENGTH) == -1) {
-                        fprintf(stderr, "Invalid job input with employee %i, exiting\n",emp_num);
-                        exit(EXIT_FAILURE); /*exits if input data is wrong*/
-                }
-                if (strcmp(new->job,"")==0||atoi(new->job)!=0) {
-                        fprintf(stderr, "Invalid job with employee %i, exiting\n",emp_num);
-                        exit(EXIT_FAILURE);
-                }
-                /*adds the employee to the start of the list*/
-                new->next = cur;      /*links the new employee to the next employee in the correct position determined by the cur pointer */
-                if (prev == NULL)
-                        employee_list = new; /*checks if there are no employees before the new employees in the list then assigns them the first position*/
-                else
-                        prev->next = new; /*links the new employee to the previous employee in the correct position completing the double link*/
+struct OperationStats
+{
+        const char *name;
+        uint64_t count;                  /* operations timed */
+        uint64_t cycles, max_cycles;     /* their total and longest times */
+        uint64_t buckets[STAT_BUCKETS];  /* see stats_bucket() */
+};
 
-                emp_num++;                /*increments the employee number each time all fields are read correctly*/
-                /*takes in the \n*/
-                if ((test = fgetc(input)) != '\n') {
-                        fprintf(stderr, "Bad input file, exiting. Details: Missing '\\n' at end of employee %i field\n",emp_num);
-                        exit(EXIT_FAILURE);
-                }
-        } while ((test = fgetc(input)) != EOF); /*checks if it's the end of the file */
+static struct OperationStats operation_stats[NUM_STATS] = {
+        { "load", 0, 0, 0, { 0 } }, { "add", 0, 0, 0, { 0 } }, { "delete", 0, 0, 0, { 0 } },
+        { "find", 0, 0, 0, { 0 } }, { "print", 0, 0, 0, { 0 } }
+};
+/* each thread counts for itself, and a helper thread adds its counts to
+   the totals with stats_fold() when it is done */
+static _Thread_local uint64_t name_comparisons = 0;  /* strcmp()s made by the name index */
+static _Thread_local uint64_t hash_probes = 0;       /* slots looked at by name_table_find() */
+static uint64_t total_name_comparisons = 0, total_hash_probes = 0;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t stats_start_cycles;
+static struct timespec stats_start_time;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define stats_cycles() __rdtsc()
+#else
+/* without a cycle counter, nanoseconds stand in for cycles */
+static uint64_t stats_cycles(void)
+{
+        struct timespec now;
 
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+#endif
 
-        fclose(input); /*closes the file*/
+#define STATS_COUNT(counter)       ((counter)++)
+#define STATS_START()              stats_cycles()
+#define STATS_STOP(stat, started)  stats_record(stat, stats_cycles() - (started))
+#define STATS_USAGE                " [--stats <file>]"
 
-        /* fill in the code here in part 3, and add any extra functions you need */
+static void stats_init(void)
+{
+        clock_gettime(CLOCK_MONOTONIC, &stats_start_time);
+        stats_start_cycles = stats_cycles();
 }
 
-/* codes for menu */
-#define ADD_CODE    0
-#define DELETE_CODE 1
-#define PRINT_CODE  2
-#define EXIT_CODE   3
+/* adds this thread's counts to the totals */
+static void stats_fold(void)
+{
+        pthread_mutex_lock(&stats_lock);
+        total_name_comparisons += name_comparisons;
+        total_hash_probes += hash_probes;
+        name_comparisons = hash_probes = 0;
+        pthread_mutex_unlock(&stats_lock);
+}
 
-int main ( int argc, char *argv[] )
+/* stats_bucket():
+ *
+ * Times below 4 cycles have a bucket each; above that, every power of two
+ * is split into four buckets by the two bits after the leading one.
+ */
+static int stats_bucket ( uint64_t cycles )
 {
-        /* check arguments */
-        if ( argc != 1 && argc != 2 )
-        {
-                fprintf ( stderr, "Usage: %s [<database-file>]\n", argv[0] );
-                exit(-1);
-        }
+        int top;
 
-        /* read database file if provided, or start with empty database */
-        if ( argc == 2 )
-                read_employee_database ( argv[1] );
+        if ( cycles < 4 )
+                return cycles;
+        top = 63 - __builtin_clzll(cycles);
+        return 4 * (top - 1) + ((cycles >> (top - 2)) & 3);
+}
 
-        for(;;)
-        {
-                int choice, result;
-                char line[301];
+/* the first time, in cycles, beyond bucket "bucket" */
+static uint64_t stats_bucket_limit ( int bucket )
+{
+        if ( bucket < 4 )
+                return bucket + 1;
+        return (uint64_t) (5 + bucket % 4) << (bucket / 4 - 1);
+}
 
-                /* print menu to standard error */
-                fprintf ( stderr, "\nOptions:\n" );
-                fprintf ( stderr, "%d: Add new employee to database\n", ADD_CODE );
-                fprintf ( stderr, "%d: Delete employee from database\n", DELETE_CODE );
-                fprintf ( stderr, "%d: Print database to screen\n", PRINT_CODE );
-                fprintf ( stderr, "%d: Exit database program\n", EXIT_CODE );
-                fprintf ( stderr, "\nEnter option: " );
+static void stats_record ( int stat, uint64_t cycles )
+{
+        struct OperationStats *op = &operation_stats[stat];
 
-                if ( read_line ( stdin, line, 300 ) != 0 ) continue;
+        op->count++;
+        op->cycles += cycles;
+        if ( cycles > op->max_cycles )
+                op->max_cycles = cycles;
+        op->buckets[stats_bucket(cycles)]++;
+}
 
-                result = sscanf ( line, "%d", &choice );
-                if ( result != 1 )
-                {
-                        fprintf ( stderr, "corrupted menu choice\n" );
-                        continue;
-                }
+static double stats_cycles_per_microsecond(void)
+{
+        struct timespec now;
+        uint64_t cycles = stats_cycles() - stats_start_cycles;
+        double microseconds;
 
-                switch ( choice )
-                {
-                case ADD_CODE: /* add employee to database */
-                        menu_add_employee();
-                        break;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        microseconds = (now.tv_sec - stats_start_time.tv_sec) * 1e6
+                       + (now.tv_nsec - stats_start_time.tv_nsec) / 1e3;
+        return cycles > 0 && microseconds > 0 ? cycles / microseconds : 1;
+}
 
-                case DELETE_CODE: /* delete employee from database */
-                        menu_delete_employee();
-                        break;
+/* the time, in cycles, that "fraction" of the operations took at most,
+   rounded up to the end of its bucket but no further than the longest */
+static uint64_t stats_percentile ( const struct OperationStats *op, double fraction )
+{
+        uint64_t rank = (uint64_t) (fraction * op->count + 0.999999), seen = 0;
+        int bucket;
 
-                case PRINT_CODE: /* print database contents to screen
-                                    (standard output) */
-                        menu_print_database();
+        for ( bucket = 0; bucket < STAT_BUCKETS; bucket++ ) {
+                seen += op->buckets[bucket];
+                if ( seen >= rank && seen > 0 )
                         break;
+        }
+        if ( bucket == STAT_BUCKETS || stats_bucket_limit(bucket) > op->max_cycles )
+                return op->max_cycles;
+        return stats_bucket_limit(bucket);
+}
 
-                /* exit */
-                case EXIT_CODE:
-                        break;
+static size_t record_bytes(void)
+{
+        return num_live_employees * sizeof(struct Employee) + string_pool_used;
+}
 
-                default:
-                        fprintf ( stderr, "illegal choice %d\n", choice );
-                        break;
-                }
+/* menu_print_stats():
+ *
+ * Prints the operation statistics to standard output.
+ */
+static void menu_print_stats(void)
+{
+        double per_us = stats_cycles_per_microsecond();
+        const struct OperationStats *op;
+        int i;
 
-                /* check for exit menu choice */
-                if ( choice == EXIT_CODE )
-                        break;
+        printf("Operation     Count      Mean us       p50 us       p99 us       Max us\n");
+        for ( i = 0; i < NUM_STATS; i++ ) {
+                op = &operation_stats[i];
+                printf("%-8s %10llu %12.1f %12.1f %12.1f %12.1f\n", op->name,
+                       (unsigned long long) op->count,
+                       op->count == 0 ? 0.0 : op->cycles / per_us / op->count,
+                       stats_percentile(op, 0.5) / per_us, stats_percentile(op, 0.99) / per_us,
+                       op->max_cycles / per_us);
+        }
+        stats_fold();
+        printf("Name comparisons: %llu\n", (unsigned long long) total_name_comparisons);
+        printf("Name hash probes: %llu\n", (unsigned long long) total_hash_probes);
+        printf("Record bytes: %zu\n\n", record_bytes());
+}
+
+/* stats_write_json():
+ *
+ * Writes the operation statistics to "file_name" as a JSON object, with
+ * the histogram of each operation as [from, to, count] triples, "from"
+ * and "to" being the range of times in microseconds.
+ */
+static void stats_write_json ( const char *file_name )
+{
+        double per_us = stats_cycles_per_microsecond();
+        const struct OperationStats *op;
+        FILE *fp = fopen(file_name, "w");
+        const char *separator;
+        int i, bucket;
+
+        if ( fp == NULL ) {
+                fprintf(stderr, "Could not write statistics to %s\n", file_name);
+                return;
+        }
+        stats_fold();
+        fprintf(fp, "{\"operations\": {");
+        for ( i = 0; i < NUM_STATS; i++ ) {
+                op = &operation_stats[i];
+                fprintf(fp, "%s\n  \"%s\": {\"count\": %llu, \"mean_us\": %.3f, \"p50_us\": %.3f, "
+                        "\"p99_us\": %.3f, \"max_us\": %.3f, \"histogram\": [", i == 0 ? "" : ",",
+                        op->name, (unsigned long long) op->count,
+                        op->count == 0 ? 0.0 : op->cycles / per_us / op->count,
+                        stats_percentile(op, 0.5) / per_us, stats_percentile(op, 0.99) / per_us,
+                        op->max_cycles / per_us);
+                separator = "";
+                for ( bucket = 0; bucket < STAT_BUCKETS; bucket++ )
+                        if ( op->buckets[bucket] != 0 ) {
+                                fprintf(fp, "%s[%.3f, %.3f, %llu]", separator,
+                                        bucket == 0 ? 0.0 : stats_bucket_limit(bucket - 1) / per_us,
+                                        stats_bucket_limit(bucket) / per_us,
+                                        (unsigned long long) op->buckets[bucket]);
+                                separator = ", ";
+                        }
+                fprintf(fp, "]}");
         }
+        fprintf(fp, "\n},\n\"name_comparisons\": %llu,\n\"hash_probes\": %llu,\n\"record_bytes\": %zu}\n",
+                (unsigned long long) total_name_comparisons, (unsigned long long) total_hash_probes,
+                record_bytes());
+        if ( fclose(fp) != 0 )
+                fprintf(stderr, "Could not write statistics to %s\n", file_name);
+}
+
+#else
+
+#define STATS_COUNT(counter)       ((void) 0)
+#define STATS_START()              0
+#define STATS_STOP(stat, started)  ((void) (started))
+#define STATS_USAGE                ""
+#define stats_init()               ((void) 0)
+#define stats_fold()               ((void) 0)
+
+#endif
+
+/*****************************************************************************
+*                           name index functions                            *
+*                                                                           *
+* The employee list is kept in name order, and finding the right position   *
+* by walking it from the head costs O(n) per insert. The index is an AVL    *
+* tree threaded through the same Employee structures, ordered by name and,  *
+* for employees sharing a name, newest first by the sequence number each is *
+* given when it is added, so that every node has a unique key. The list and *
+* the tree always hold the same employees in the same order; the list is    *
+* still what menu_print_database() walks.                                   *
+*                                                                           *
+* Putting the newest of several employees with the same name first, and    *
+* deleting that one by name, is what the sorted insert into the list always *
+* did. A database file is taken to list such employees newest first, as     *
+* printing it does, so that reading back what was written keeps the order. *
+*****************************************************************************/
+
+static uint64_t next_sequence = 0;  /* sequence number of the next employee added */
+
+static int index_compare ( const struct Employee *a, const struct Employee *b )
+{
+        int result = strcmp(a->name, b->name);
+
+        STATS_COUNT(name_comparisons);
+        if ( result != 0 )
+                return result;
+        return (a->sequence < b->sequence) - (a->sequence > b->sequence);
+}
+
+static int index_height ( const struct Employee *node )
+{
+        return node == NULL ? 0 : node->height;
+}
+
+static void index_update_height ( struct Employee *node )
+{
+        int lh = index_height(node->left), rh = index_height(node->right);
+
+        node->height = (lh > rh ? lh : rh) + 1;
+}
+
+static struct Employee *index_rotate_right ( struct Employee *node )
+{
+        struct Employee *pivot = node->left;
+
+        node->left = pivot->right;
+        pivot->right = node;
+        index_update_height(node);
+        index_update_height(pivot);
+        return pivot;
+}
+
+static struct Employee *index_rotate_left ( struct Employee *node )
+{
+        struct Employee *pivot = node->right;
+
+        node->right = pivot->left;
+        pivot->left = node;
+        index_update_height(node);
+        index_update_height(pivot);
+        return pivot;
+}
+
+/* restores the AVL height condition at "node" after one of its subtrees
+   grew or shrank by one, returning the new root of the subtree */
+static struct Employee *index_balance ( struct Employee *node )
+{
+        int balance = index_height(node->left) - index_height(node->right);
+
+        if ( balance > 1 ) {
+                if ( index_height(node->left->left) < index_height(node->left->right) )
+                        node->left = index_rotate_left(node->left);
+                return index_rotate_right(node);
+        }
+        if ( balance < -1 ) {
+                if ( index_height(node->right->right) < index_height(node->right->left) )
+                        node->right = index_rotate_right(node->right);
+                return index_rotate_left(node);
+        }
+        index_update_height(node);
+        return node;
+}
+
+static struct Employee *index_insert_node ( struct Employee *root,
+                                            struct Employee *new )
+{
+        if ( root == NULL )
+                return new;
+        if ( index_compare(new, root) < 0 )
+                root->left = index_insert_node(root->left, new);
+        else
+                root->right = index_insert_node(root->right, new);
+        return index_balance(root);
+}
+
+/* detaches the leftmost node of the subtree, returning the new subtree root */
+static struct Employee *index_remove_min ( struct Employee *root )
+{
+        if ( root->left == NULL )
+                return root->right;
+        root->left = index_remove_min(root->left);
+        return index_balance(root);
+}
+
+static struct Employee *index_remove_node ( struct Employee *root,
+                                            struct Employee *old )
+{
+        struct Employee *min;
+        int result;
+
+        if ( root == NULL )
+                return NULL;
+
+        result = index_compare(old, root);
+        if ( result < 0 )
+                root->left = index_remove_node(root->left, old);
+        else if ( result > 0 )
+                root->right = index_remove_node(root->right, old);
+        else {
+                /* replace the node by its in-order successor */
+                if ( root->left == NULL )
+                        return root->right;
+                if ( root->right == NULL )
+                        return root->left;
+                for ( min = root->right; min->left != NULL; min = min->left )
+                        ;
+                min->right = index_remove_min(root->right);
+                min->left = root->left;
+                root = min;
+        }
+        return index_balance(root);
+}
+
+/* index_add_employee():
+ *
+ * Adds "new" to the index and links it into the list between its in-order
+ * neighbours, which are found on the way down the tree.
+ */
+static void index_add_employee ( struct Employee *new )
+{
+        struct Employee *cur, *before = NULL, *after = NULL;
+
+        for ( cur = employee_index; cur != NULL; )
+                if ( index_compare(new, cur) < 0 ) {
+                        after = cur;
+                        cur = cur->left;
+                } else {
+                        before = cur;
+                        cur = cur->right;
+                }
+
+        new->left = new->right = NULL;
+        new->height = 1;
+        employee_index = index_insert_node(employee_index, new);
+
+        new->prev = before;
+        new->next = after;
+        if ( before == NULL )
+                employee_list = new;
+        else
+                before->next = new;
+        if ( after != NULL )
+                after->prev = new;
+}
+
+/* index_remove_employee():
+ *
+ * Removes "old" from both the index and the list. The memory is not freed.
+ */
+static void index_remove_employee ( struct Employee *old )
+{
+        employee_index = index_remove_node(employee_index, old);
+
+        if ( old->prev == NULL )
+                employee_list = old->next;
+        else
+                old->prev->next = old->next;
+        if ( old->next != NULL )
+                old->next->prev = old->prev;
+}
+
+/*****************************************************************************
+*                           name hash functions                             *
+*                                                                           *
+* Exact-name lookups for delete go through an open-addressing hash table    *
+* from name to employee, using Robin Hood probing: an entry that is further *
+* from its home slot takes the place of one that is closer, which keeps     *
+* probe sequences short, and lets a lookup stop as soon as it passes the    *
+* point where its key would have been placed. Deletion shifts the following *
+* entries back so that no tombstones are needed.                            *
+*                                                                           *
+* With the sharded backend the table is split into one part per shard by    *
+* the top bits of the hash, which are never used to pick a slot, so that a  *
+* bulk change can work on every part at once on its own thread.             *
+*****************************************************************************/
+
+struct NameSlot
+{
+        unsigned long hash;              /* full hash of the name */
+        struct Employee *employee;       /* NULL if the slot is empty */
+};
+
+struct NameTable
+{
+        struct NameSlot *slots;          /* a power of two of them */
+        size_t size;                     /* number of slots */
+        size_t count;                    /* number of employees stored */
+};
+
+/* most parts the table can be split into, one per shard of the sharded
+   backend; the others keep the whole table in the first part */
+#define MAX_SHARDS 16
+
+static struct NameTable name_tables[MAX_SHARDS];
+static unsigned int name_table_mask = 0;  /* parts in use, less one */
+static size_t name_table_count = 0;       /* number of employees stored */
+
+/* FNV-1a hash of a name string */
+static unsigned long name_hash ( const char *name )
+{
+        unsigned long hash = 14695981039346656037UL;
+
+        while ( *name != '\0' ) {
+                hash ^= (unsigned char) *name++;
+                hash *= 1099511628211UL;
+        }
+        return hash;
+}
+
+/* the part a name with "hash" goes in, picked by bits that no table is
+   big enough to use for its slots */
+static unsigned int name_part ( unsigned long hash )
+{
+        return (hash >> 56) & name_table_mask;
+}
+
+/* distance of the entry with "hash" at slot "i" from its home slot */
+static size_t name_table_distance ( const struct NameTable *table, unsigned long hash, size_t i )
+{
+        return (i - (hash & (table->size - 1))) & (table->size - 1);
+}
+
+static void name_table_place ( struct NameTable *table, unsigned long hash, struct Employee *employee )
+{
+        struct NameSlot *slots = table->slots, tmp;
+        size_t mask = table->size - 1, i = hash & mask, dist = 0, slot_dist;
+
+        for (;;) {
+                if ( slots[i].employee == NULL ) {
+                        slots[i].hash = hash;
+                        slots[i].employee = employee;
+                        return;
+                }
+                /* take the slot from an entry that is closer to home */
+                slot_dist = name_table_distance(table, slots[i].hash, i);
+                if ( slot_dist < dist ) {
+                        tmp = slots[i];
+                        slots[i].hash = hash;
+                        slots[i].employee = employee;
+                        hash = tmp.hash;
+                        employee = tmp.employee;
+                        dist = slot_dist;
+                }
+                i = (i + 1) & mask;
+                dist++;
+        }
+}
+
+/* name_table_add():
+ *
+ * Adds "employee", whose name has "hash", to the part "table", doubling it
+ * when it is three quarters full. Parts are independent of each other, so
+ * different ones may be added to at the same time.
+ */
+static void name_table_add ( struct NameTable *table, unsigned long hash, struct Employee *employee )
+{
+        struct NameSlot *old = table->slots;
+        size_t old_size = table->size, i;
+
+        if ( (table->count + 1) * 4 > table->size * 3 ) {
+                table->size = old_size == 0 ? 64 : old_size * 2;
+                table->slots = calloc(table->size, sizeof(struct NameSlot));
+                if ( table->slots == NULL ) {
+                        fprintf(stderr, "Out of memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+                for ( i = 0; i < old_size; i++ )
+                        if ( old[i].employee != NULL )
+                                name_table_place(table, old[i].hash, old[i].employee);
+                free(old);
+        }
+
+        name_table_place(table, hash, employee);
+        table->count++;
+}
+
+/* name_table_insert():
+ *
+ * Adds "employee" to the hash table.
+ */
+static void name_table_insert ( struct Employee *employee )
+{
+        unsigned long hash = name_hash(employee->name);
+
+        name_table_add(&name_tables[name_part(hash)], hash, employee);
+        name_table_count++;
+}
+
+/* name_table_find_in():
+ *
+ * Returns the newest employee called "name", whose hash is "hash", from
+ * the part "table" for which "match" returns non-zero, or NULL if there is
+ * none. Every employee of that name is in the part, so they are all tried.
+ */
+static struct Employee *name_table_find_in ( const struct NameTable *table, unsigned long hash,
+                                             const char *name,
+                                             int (*match) ( const struct Employee *, const void * ),
+                                             const void *arg )
+{
+        const struct NameSlot *slots = table->slots;
+        struct Employee *found = NULL;
+        size_t mask = table->size - 1, i, dist;
+
+        if ( table->count == 0 )
+                return NULL;
+
+        for ( i = hash & mask, dist = 0;
+              slots[i].employee != NULL && name_table_distance(table, slots[i].hash, i) >= dist;
+              i = (i + 1) & mask, dist++ ) {
+                STATS_COUNT(hash_probes);
+                if ( slots[i].hash == hash
+                     && (found == NULL || slots[i].employee->sequence > found->sequence)
+                     && strcmp(slots[i].employee->name, name) == 0
+                     && (match == NULL || match(slots[i].employee, arg)) )
+                        found = slots[i].employee;
+        }
+        return found;
+}
+
+/* name_table_find_match():
+ *
+ * Returns the newest employee called "name" for which "match" returns
+ * non-zero, or NULL if there is none.
+ */
+static struct Employee *name_table_find_match ( const char *name,
+                                                int (*match) ( const struct Employee *, const void * ),
+                                                const void *arg )
+{
+        unsigned long hash = name_hash(name);
+
+        return name_table_find_in(&name_tables[name_part(hash)], hash, name, match, arg);
+}
+
+/* name_table_find():
+ *
+ * Returns the newest employee called "name", or NULL if there is none.
+ */
+static struct Employee *name_table_find ( const char *name )
+{
+        return name_table_find_match(name, NULL, NULL);
+}
+
+/* name_table_unlink():
+ *
+ * Removes "employee" itself (not just any employee of the same name) from
+ * the part "table", returning non-zero if it was there.
+ */
+static int name_table_unlink ( struct NameTable *table, struct Employee *employee )
+{
+        struct NameSlot *slots = table->slots;
+        size_t mask = table->size - 1, i, next;
+
+        if ( table->count == 0 )
+                return 0;
+
+        for ( i = name_hash(employee->name) & mask; slots[i].employee != employee; i = (i + 1) & mask )
+                if ( slots[i].employee == NULL )
+                        return 0;
+
+        /* shift the rest of the cluster back by one slot */
+        for ( next = (i + 1) & mask;
+              slots[next].employee != NULL && name_table_distance(table, slots[next].hash, next) > 0;
+              i = next, next = (next + 1) & mask )
+                slots[i] = slots[next];
+        slots[i].employee = NULL;
+        table->count--;
+        return 1;
+}
+
+/* name_table_remove():
+ *
+ * Removes "employee" from the hash table.
+ */
+static void name_table_remove ( struct Employee *employee )
+{
+        if ( name_table_unlink(&name_tables[name_part(name_hash(employee->name))], employee) )
+                name_table_count--;
+}
+
+static void release_name_table(void)
+{
+        unsigned int i;
+
+        for ( i = 0; i < MAX_SHARDS; i++ ) {
+                free(name_tables[i].slots);
+                memset(&name_tables[i], 0, sizeof(struct NameTable));
+        }
+        name_table_count = 0;
+}
+
+/*****************************************************************************
+*                        storage backend functions                          *
+*                                                                           *
+* The employees are kept in name order by one of several interchangeable    *
+* storage backends, picked with --backend when the program starts. A        *
+* backend only orders the employees: the records themselves, the name hash  *
+* table, the age and job indexes, the operation log and snapshots are       *
+* shared by all of them, so every menu option works with any backend. The   *
+* list backend is the linked list and name index above. The array backend   *
+* is a sorted array, which is walked faster and needs no tree; an erase     *
+* leaves a tombstone, but an insert moves half of the array on average. The *
+* columnar backend is the same array kept as a column for each field, which *
+* reports scan instead of the employees. The btree backend is a B+-tree     *
+* with cache-line sized nodes, which keeps both fast; it is used for any    *
+* database loaded with more than a few thousand employees unless --backend  *
+* names another. The sharded backend splits the employees by name hash      *
+* between several B+-trees that bulk changes fill and empty in parallel,    *
+* for databases changed in large batches.                                   *
+*****************************************************************************/
+
+/* where a walk of the sharded backend has got to in each shard's tree */
+struct ShardMerge
+{
+        struct Employee *employee[MAX_SHARDS];  /* the next employee of each shard */
+        void *node[MAX_SHARDS];                 /* its leaf */
+        size_t position[MAX_SHARDS];            /* and position there */
+        unsigned int heap[MAX_SHARDS];          /* shards with one left, least first */
+        unsigned int size;
+};
+
+/* a place in name order, for walking the employees */
+struct Cursor
+{
+        struct Employee *employee;       /* employee there, NULL at the end */
+        void *node;                      /* for the backend's own use */
+        size_t position;                 /* likewise */
+        struct ShardMerge merge;         /* for the sharded backend's use */
+};
+
+struct StorageBackend
+{
+        const char *name;
+
+        /* adds "new" in its place in name order */
+        void (*insert) ( struct Employee *new );
+        /* removes "old", without freeing it */
+        void (*erase) ( struct Employee *old );
+        /* removes "n" employees at once */
+        void (*erase_many) ( struct Employee * const *olds, size_t n );
+        /* adds "n" employees already in index order at once */
+        void (*load) ( struct Employee **records, size_t n );
+        /* moves "cursor" to the first employee whose name is not before
+           "name", or to the very first employee if "name" is NULL */
+        void (*seek) ( struct Cursor *cursor, const char *name );
+        /* moves "cursor" on to the next employee in name order */
+        void (*advance) ( struct Cursor *cursor );
+        /* frees whatever the backend allocated */
+        void (*release) ( void );
+};
+
+static int compare_indexed ( const void *p, const void *q )
+{
+        return index_compare(*(struct Employee * const *) p, *(struct Employee * const *) q);
+}
+
+/* builds a perfectly balanced index over "n" records in index order */
+static struct Employee *index_build ( struct Employee **records, size_t n )
+{
+        struct Employee *root;
+        size_t mid = n / 2;
+
+        if ( n == 0 )
+                return NULL;
+        root = records[mid];
+        root->left = index_build(records, mid);
+        root->right = index_build(records + mid + 1, n - mid - 1);
+        index_update_height(root);
+        return root;
+}
+
+/* relinks "n" employees in index order as the whole list and index */
+static void link_employee_array ( struct Employee **records, size_t n )
+{
+        size_t i;
+
+        for ( i = 0; i < n; i++ ) {
+                records[i]->prev = i > 0 ? records[i-1] : NULL;
+                records[i]->next = i + 1 < n ? records[i+1] : NULL;
+        }
+        employee_list = n > 0 ? records[0] : NULL;
+        employee_index = index_build(records, n);
+}
+
+/* index_rebuild():
+ *
+ * Rebuilds the name index, perfectly balanced, from the list, after
+ * employees have been unlinked from the list without it. The employees
+ * left must already be all that name_table_count counts.
+ */
+static void index_rebuild(void)
+{
+        struct Employee **records, *cur;
+        size_t n = 0;
+
+        records = malloc(name_table_count * sizeof(struct Employee *) + 1);
+        if ( records == NULL ) {
+                fprintf(stderr, "Out of memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        for ( cur = employee_list; cur != NULL; cur = cur->next )
+                records[n++] = cur;
+        link_employee_array(records, n);
+        free(records);
+}
+
+/* unlinks each of "olds" from the list, then rebuilds the index once */
+static void list_erase_many ( struct Employee * const *olds, size_t n )
+{
+        struct Employee *old;
+        size_t i;
+
+        for ( i = 0; i < n; i++ ) {
+                old = olds[i];
+                if ( old->prev == NULL )
+                        employee_list = old->next;
+                else
+                        old->prev->next = old->next;
+                if ( old->next != NULL )
+                        old->next->prev = old->prev;
+        }
+        if ( n > 0 )
+                index_rebuild();
+}
+
+/* list_load():
+ *
+ * A handful of employees are added to the index in turn; any more are
+ * merged with the list in one pass, and the index is rebuilt from the
+ * result, which for an empty list takes linear time.
+ */
+static void list_load ( struct Employee **records, size_t n )
+{
+        struct Employee **merged, *cur;
+        size_t i, m = 0;
+
+        if ( employee_list != NULL && n * 16 < name_table_count ) {
+                for ( i = 0; i < n; i++ )
+                        index_add_employee(records[i]);
+                return;
+        }
+        if ( n == 0 )
+                return;
+
+        merged = malloc((name_table_count + n) * sizeof(struct Employee *));
+        if ( merged == NULL ) {
+                fprintf(stderr, "Out of memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        for ( cur = employee_list, i = 0; cur != NULL || i < n; )
+                if ( i == n || (cur != NULL && index_compare(cur, records[i]) < 0) ) {
+                        merged[m++] = cur;
+                        cur = cur->next;
+                } else
+                        merged[m++] = records[i++];
+        link_employee_array(merged, m);
+        free(merged);
+}
+
+static void list_seek ( struct Cursor *cursor, const char *name )
+{
+        struct Employee *cur;
+
+        if ( name == NULL ) {
+                cursor->employee = employee_list;
+                return;
+        }
+        cursor->employee = NULL;
+        for ( cur = employee_index; cur != NULL; )
+                if ( strcmp(cur->name, name) >= 0 ) {
+                        cursor->employee = cur;
+                        cur = cur->left;
+                } else
+                        cur = cur->right;
+}
+
+static void list_advance ( struct Cursor *cursor )
+{
+        cursor->employee = cursor->employee->next;
+}
+
+/* the employees live in the slabs, so there is nothing to free */
+static void list_release(void)
+{
+        employee_list = employee_index = NULL;
+}
+
+static const struct StorageBackend list_backend = {
+        "list", index_add_employee, index_remove_employee, list_erase_many,
+        list_load, list_seek, list_advance, list_release
+};
+
+/* array backend:
+ *
+ * A sorted array of slots, each holding an employee and a copy of its key.
+ * Erasing an employee only empties its slot, leaving a tombstone, so that
+ * a run of deletes doesn't move the array once per employee; the key stays
+ * behind, since the employee's own slab slot may be reused for another
+ * name, and keeps the array in order for the binary search. Walks skip
+ * tombstones, an insert next to one takes it over, and once tombstones
+ * fill half of the slots they are squeezed out in one pass, so an erase
+ * costs amortized O(1) after the search.
+ */
+
+struct ArraySlot
+{
+        const char *name;
+        uint64_t sequence;
+        struct Employee *employee;       /* NULL once erased */
+};
+
+static struct ArraySlot *employee_array = NULL; /* slots in index order */
+static size_t array_count = 0, array_size = 0;  /* slots in use, tombstones included */
+static size_t array_deleted = 0;                /* tombstones among them */
+
+static void array_reserve ( size_t count )
+{
+        if ( count <= array_size )
+                return;
+        array_size = array_size == 0 ? 1024 : array_size;
+        while ( array_size < count )
+                array_size *= 2;
+        employee_array = realloc(employee_array, array_size * sizeof(struct ArraySlot));
+        if ( employee_array == NULL ) {
+                fprintf(stderr, "Out of memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+}
+
+static void array_fill ( struct ArraySlot *slot, struct Employee *employee )
+{
+        slot->name = employee->name;
+        slot->sequence = employee->sequence;
+        slot->employee = employee;
+}
+
+/* orders the key in "slot" against "employee" as index_compare() would */
+static int array_compare ( const struct ArraySlot *slot, const struct Employee *employee )
+{
+        int result = strcmp(slot->name, employee->name);
+
+        STATS_COUNT(name_comparisons);
+        if ( result != 0 )
+                return result;
+        return (slot->sequence < employee->sequence) - (slot->sequence > employee->sequence);
+}
+
+/* the position of "employee" in the array, or where it would go */
+static size_t array_position ( const struct Employee *employee )
+{
+        size_t low = 0, high = array_count, mid;
+
+        while ( low < high ) {
+                mid = low + (high - low) / 2;
+                if ( array_compare(&employee_array[mid], employee) < 0 )
+                        low = mid + 1;
+                else
+                        high = mid;
+        }
+        return low;
+}
+
+/* squeezes the tombstones out of the array */
+static void array_compact(void)
+{
+        size_t i, j;
+
+        for ( i = j = 0; i < array_count; i++ )
+                if ( employee_array[i].employee != NULL )
+                        employee_array[j++] = employee_array[i];
+        array_count = j;
+        array_deleted = 0;
+}
+
+static void array_insert ( struct Employee *new )
+{
+        size_t i = array_position(new);
+
+        /* a tombstone on either side can take it without moving anything */
+        if ( i > 0 && employee_array[i - 1].employee == NULL ) {
+                array_fill(&employee_array[i - 1], new);
+                array_deleted--;
+                return;
+        }
+        if ( i < array_count && employee_array[i].employee == NULL ) {
+                array_fill(&employee_array[i], new);
+                array_deleted--;
+                return;
+        }
+        array_reserve(array_count + 1);
+        memmove(&employee_array[i + 1], &employee_array[i],
+                (array_count - i) * sizeof(struct ArraySlot));
+        array_fill(&employee_array[i], new);
+        array_count++;
+}
+
+static void array_erase ( struct Employee *old )
+{
+        employee_array[array_position(old)].employee = NULL;
+        if ( ++array_deleted * 2 > array_count )
+                array_compact();
+}
+
+/* sorts a copy of "olds" into index order so that one pass drops them all,
+   and the tombstones with them */
+static void array_erase_many ( struct Employee * const *olds, size_t n )
+{
+        struct Employee **sorted;
+        size_t i, j, k = 0;
+
+        sorted = malloc(n * sizeof(struct Employee *) + 1);
+        if ( sorted == NULL ) {
+                fprintf(stderr, "Out of memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        memcpy(sorted, olds, n * sizeof(struct Employee *));
+        qsort(sorted, n, sizeof(struct Employee *), compare_indexed);
+        for ( i = j = 0; i < array_count; i++ )
+                if ( employee_array[i].employee == NULL )
+                        continue;
+                else if ( k < n && employee_array[i].employee == sorted[k] )
+                        k++;
+                else
+                        employee_array[j++] = employee_array[i];
+        array_count = j;
+        array_deleted = 0;
+        free(sorted);
+}
+
+/* merges "records" in from the back, so that nothing is moved twice; the
+   tombstones move with the rest, in order by their keys */
+static void array_load ( struct Employee **records, size_t n )
+{
+        size_t i = array_count, j = n, k = array_count + n;
+
+        array_reserve(array_count + n);
+        while ( j > 0 )
+                if ( i > 0 && array_compare(&employee_array[i - 1], records[j - 1]) > 0 )
+                        employee_array[--k] = employee_array[--i];
+                else
+                        array_fill(&employee_array[--k], records[--j]);
+        array_count += n;
+}
+
+/* moves "cursor" from its position on past any tombstones */
+static void array_skip ( struct Cursor *cursor )
+{
+        while ( cursor->position < array_count && employee_array[cursor->position].employee == NULL )
+                cursor->position++;
+        cursor->employee = cursor->position < array_count ? employee_array[cursor->position].employee : NULL;
+}
+
+static void array_seek ( struct Cursor *cursor, const char *name )
+{
+        size_t low = 0, high = array_count, mid;
+
+        while ( name != NULL && low < high ) {
+                mid = low + (high - low) / 2;
+                if ( strcmp(employee_array[mid].name, name) < 0 )
+                        low = mid + 1;
+                else
+                        high = mid;
+        }
+        cursor->position = low;
+        array_skip(cursor);
+}
+
+static void array_advance ( struct Cursor *cursor )
+{
+        cursor->position++;
+        array_skip(cursor);
+}
+
+static void array_release(void)
+{
+        free(employee_array);
+        employee_array = NULL;
+        array_count = array_size = array_deleted = 0;
+}
+
+static const struct StorageBackend array_backend = {
+        "array", array_insert, array_erase, array_erase_many,
+        array_load, array_seek, array_advance, array_release
+};
+
+/* columnar backend:
+ *
+ * The array backend with its slots taken apart into columns, one
+ * contiguous array to a field, for reports that scan every employee: see
+ * print_report(). Counting by sex reads a byte per employee and an age
+ * histogram two, rather than a 64-byte Employee each, and the count is
+ * vectorized. The name, sequence and employee columns are the key and
+ * employee of an array slot and are kept in the same way, tombstones and
+ * all; a tombstone's sex and age are 0, so that scans can count it along
+ * with the rest and take it off afterwards. Names are pointers rather than
+ * offsets, since they are in the string pool's chunks or a mapped snapshot
+ * with no one base, and ages take two bytes, since they go up to MAX_AGE.
+ */
+
+static const char **column_name = NULL;          /* key columns, in index order */
+static uint64_t *column_sequence = NULL;
+static struct Employee **column_employee = NULL; /* NULL once erased */
+static unsigned char *column_sex = NULL;         /* 'F' or 'M', 0 once erased */
+static uint16_t *column_age = NULL;              /* 0 once erased */
+static unsigned int *column_job = NULL;
+static size_t columnar_count = 0, columnar_size = 0; /* rows in use, tombstones included */
+static size_t columnar_deleted = 0;                  /* tombstones among them */
+
+static void *columnar_resize ( void *column, size_t width )
+{
+        column = realloc(column, columnar_size * width);
+        if ( column == NULL ) {
+                fprintf(stderr, "Out of memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        return column;
+}
+
+static void columnar_reserve ( size_t count )
+{
+        if ( count <= columnar_size )
+                return;
+        columnar_size = columnar_size == 0 ? 1024 : columnar_size;
+        while ( columnar_size < count )
+                columnar_size *= 2;
+        column_name = columnar_resize(column_name, sizeof(const char *));
+        column_sequence = columnar_resize(column_sequence, sizeof(uint64_t));
+        column_employee = columnar_resize(column_employee, sizeof(struct Employee *));
+        column_sex = columnar_resize(column_sex, 1);
+        column_age = columnar_resize(column_age, sizeof(uint16_t));
+        column_job = columnar_resize(column_job, sizeof(unsigned int));
+}
+
+static void columnar_fill ( size_t row, struct Employee *employee )
+{
+        column_name[row] = employee->name;
+        column_sequence[row] = employee->sequence;
+        column_employee[row] = employee;
+        column_sex[row] = employee->sex;
+        column_age[row] = employee->age;
+        column_job[row] = employee->job;
+}
+
+/* copies row "from" to row "to", which may be the same */
+static void columnar_copy ( size_t to, size_t from )
+{
+        column_name[to] = column_name[from];
+        column_sequence[to] = column_sequence[from];
+        column_employee[to] = column_employee[from];
+        column_sex[to] = column_sex[from];
+        column_age[to] = column_age[from];
+        column_job[to] = column_job[from];
+}
+
+/* moves rows "from" onwards along by "by" to make room, in each column */
+static void columnar_open ( size_t from, size_t by )
+{
+        size_t n = columnar_count - from;
+
+        memmove(&column_name[from + by], &column_name[from], n * sizeof(const char *));
+        memmove(&column_sequence[from + by], &column_sequence[from], n * sizeof(uint64_t));
+        memmove(&column_employee[from + by], &column_employee[from], n * sizeof(struct Employee *));
+        memmove(&column_sex[from + by], &column_sex[from], n);
+        memmove(&column_age[from + by], &column_age[from], n * sizeof(uint16_t));
+        memmove(&column_job[from + by], &column_job[from], n * sizeof(unsigned int));
+}
+
+/* orders the key of "row" against "employee" as index_compare() would */
+static int columnar_compare ( size_t row, const struct Employee *employee )
+{
+        int result = strcmp(column_name[row], employee->name);
+
+        STATS_COUNT(name_comparisons);
+        if ( result != 0 )
+                return result;
+        return (column_sequence[row] < employee->sequence) - (column_sequence[row] > employee->sequence);
+}
+
+/* the row of "employee", or where it would go */
+static size_t columnar_position ( const struct Employee *employee )
+{
+        size_t low = 0, high = columnar_count, mid;
+
+        while ( low < high ) {
+                mid = low + (high - low) / 2;
+                if ( columnar_compare(mid, employee) < 0 )
+                        low = mid + 1;
+                else
+                        high = mid;
+        }
+        return low;
+}
+
+/* squeezes the tombstones out of the columns */
+static void columnar_compact(void)
+{
+        size_t i, j;
+
+        for ( i = j = 0; i < columnar_count; i++ )
+                if ( column_employee[i] != NULL )
+                        columnar_copy(j++, i);
+        columnar_count = j;
+        columnar_deleted = 0;
+}
+
+static void columnar_insert ( struct Employee *new )
+{
+        size_t i = columnar_position(new);
+
+        /* a tombstone on either side can take it without moving anything */
+        if ( i > 0 && column_employee[i - 1] == NULL ) {
+                columnar_fill(i - 1, new);
+                columnar_deleted--;
+                return;
+        }
+        if ( i < columnar_count && column_employee[i] == NULL ) {
+                columnar_fill(i, new);
+                columnar_deleted--;
+                return;
+        }
+        columnar_reserve(columnar_count + 1);
+        columnar_open(i, 1);
+        columnar_fill(i, new);
+        columnar_count++;
+}
+
+static void columnar_erase ( struct Employee *old )
+{
+        size_t i = columnar_position(old);
+
+        column_employee[i] = NULL;
+        column_sex[i] = 0;
+        column_age[i] = 0;
+        if ( ++columnar_deleted * 2 > columnar_count )
+                columnar_compact();
+}
+
+/* drops "olds" and the tombstones in one pass, as array_erase_many() does */
+static void columnar_erase_many ( struct Employee * const *olds, size_t n )
+{
+        struct Employee **sorted;
+        size_t i, j, k = 0;
+
+        sorted = malloc(n * sizeof(struct Employee *) + 1);
+        if ( sorted == NULL ) {
+                fprintf(stderr, "Out of memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        memcpy(sorted, olds, n * sizeof(struct Employee *));
+        qsort(sorted, n, sizeof(struct Employee *), compare_indexed);
+        for ( i = j = 0; i < columnar_count; i++ )
+                if ( column_employee[i] == NULL )
+                        continue;
+                else if ( k < n && column_employee[i] == sorted[k] )
+                        k++;
+                else
+                        columnar_copy(j++, i);
+        columnar_count = j;
+        columnar_deleted = 0;
+        free(sorted);
+}
+
+/* merges "records" in from the back, as array_load() does */
+static void columnar_load ( struct Employee **records, size_t n )
+{
+        size_t i = columnar_count, j = n, k = columnar_count + n;
+
+        columnar_reserve(columnar_count + n);
+        while ( j > 0 )
+                if ( i > 0 && columnar_compare(i - 1, records[j - 1]) > 0 )
+                        columnar_copy(--k, --i);
+                else
+                        columnar_fill(--k, records[--j]);
+        columnar_count += n;
+}
+
+/* moves "cursor" from its row on past any tombstones */
+static void columnar_skip ( struct Cursor *cursor )
+{
+        while ( cursor->position < columnar_count && column_employee[cursor->position] == NULL )
+                cursor->position++;
+        cursor->employee = cursor->position < columnar_count ? column_employee[cursor->position] : NULL;
+}
+
+static void columnar_seek ( struct Cursor *cursor, const char *name )
+{
+        size_t low = 0, high = columnar_count, mid;
+
+        while ( name != NULL && low < high ) {
+                mid = low + (high - low) / 2;
+                if ( strcmp(column_name[mid], name) < 0 )
+                        low = mid + 1;
+                else
+                        high = mid;
+        }
+        cursor->position = low;
+        columnar_skip(cursor);
+}
+
+static void columnar_advance ( struct Cursor *cursor )
+{
+        cursor->position++;
+        columnar_skip(cursor);
+}
+
+static void columnar_release(void)
+{
+        free(column_name);
+        free(column_sequence);
+        free(column_employee);
+        free(column_sex);
+        free(column_age);
+        free(column_job);
+        column_name = NULL;
+        column_sequence = NULL;
+        column_employee = NULL;
+        column_sex = NULL;
+        column_age = NULL;
+        column_job = NULL;
+        columnar_count = columnar_size = columnar_deleted = 0;
+}
+
+static const struct StorageBackend columnar_backend = {
+        "columnar", columnar_insert, columnar_erase, columnar_erase_many,
+        columnar_load, columnar_seek, columnar_advance, columnar_release
+};
+
+/* B+-tree backend:
+ *
+ * Leaves hold the employees in index order and are linked for walking;
+ * inner nodes hold keys and children. Both are 512 bytes, eight cache
+ * lines, so a lookup touches a few lines per level and a walk reads 62
+ * employees per leaf. A key is a name and an address rather than an
+ * employee, since an erased employee's slot may be reused for another
+ * name while a copy of its key still separates two subtrees; a name is
+ * never freed before the program exits.
+ */
+
+#define BTREE_LEAF_SIZE    62    /* employees per leaf */
+#define BTREE_FANOUT       21    /* children per inner node */
+#define BTREE_LEAF_MIN     (BTREE_LEAF_SIZE / 2)
+#define BTREE_FANOUT_MIN   ((BTREE_FANOUT + 1) / 2)
+/* databases loaded with more employees than this use the B+-tree unless
+   --backend says otherwise */
+#define BTREE_DEFAULT_SIZE 4096
+
+struct BTreeKey
+{
+        const char *name;
+        uint64_t sequence;
+};
+
+struct BTreeLeaf
+{
+        unsigned int count;                          /* employees in use */
+        struct BTreeLeaf *next;                      /* next leaf in order */
+        struct Employee *employees[BTREE_LEAF_SIZE];
+};
+
+struct BTreeNode
+{
+        unsigned int count;                          /* children in use */
+        struct BTreeKey keys[BTREE_FANOUT - 1];      /* keys[i] is the least key under children[i + 1] */
+        void *children[BTREE_FANOUT];
+};
+
+/* each tree carves its nodes out of slabs of its own, aligned to a cache
+   line, so that different trees can be changed at the same time */
+#define BTREE_NODES_PER_SLAB 512
+
+union BTreeBlock
+{
+        struct BTreeLeaf leaf;
+        struct BTreeNode node;
+        union BTreeBlock *next_free;
+};
+
+struct BTreeSlab
+{
+        union BTreeBlock blocks[BTREE_NODES_PER_SLAB];
+        struct BTreeSlab *next;                          /* previously allocated slab */
+};
+
+struct BTree
+{
+        void *root;
+        int height;                      /* 1 when the root is a leaf, 0 when empty */
+        size_t count;                    /* employees in the tree */
+        struct BTreeSlab *slabs;         /* the tree's own nodes */
+        size_t slab_used;                /* blocks handed out from the newest slab */
+        union BTreeBlock *free_blocks;
+};
+
+static void *btree_malloc ( size_t size )
+{
+        void *memory = malloc(size);
+
+        if ( memory == NULL ) {
+                fprintf(stderr, "Out of memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        return memory;
+}
+
+/* returns space for a leaf or an inner node, reusing a freed one if any */
+static void *btree_alloc ( struct BTree *tree )
+{
+        union BTreeBlock *block;
+        void *slab;
+
+        if ( tree->free_blocks != NULL ) {
+                block = tree->free_blocks;
+                tree->free_blocks = block->next_free;
+                return block;
+        }
+        if ( tree->slabs == NULL || tree->slab_used == BTREE_NODES_PER_SLAB ) {
+                if ( posix_memalign(&slab, 64, sizeof(struct BTreeSlab)) != 0 ) {
+                        fprintf(stderr, "Out of memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+                ((struct BTreeSlab *) slab)->next = tree->slabs;
+                tree->slabs = slab;
+                tree->slab_used = 0;
+        }
+        return &tree->slabs->blocks[tree->slab_used++];
+}
+
+static void btree_free ( struct BTree *tree, void *node )
+{
+        union BTreeBlock *block = node;
+
+        block->next_free = tree->free_blocks;
+        tree->free_blocks = block;
+}
+
+static struct BTreeKey btree_key ( const struct Employee *employee )
+{
+        struct BTreeKey key;
+
+        key.name = employee->name;
+        key.sequence = employee->sequence;
+        return key;
+}
+
+/* orders "employee" against "key" as index_compare() would */
+static int btree_compare ( const struct Employee *employee, const struct BTreeKey *key )
+{
+        int result = strcmp(employee->name, key->name);
+
+        STATS_COUNT(name_comparisons);
+        if ( result != 0 )
+                return result;
+        return (employee->sequence < key->sequence) - (employee->sequence > key->sequence);
+}
+
+/* the child of "node" that "employee" belongs under */
+static unsigned int btree_child ( const struct BTreeNode *node, const struct Employee *employee )
+{
+        unsigned int low = 0, high = node->count - 1, mid;
+
+        while ( low < high ) {
+                mid = low + (high - low) / 2;
+                if ( btree_compare(employee, &node->keys[mid]) < 0 )
+                        high = mid;
+                else
+                        low = mid + 1;
+        }
+        return low;
+}
+
+/* the position of "employee" in "leaf", or where it would go */
+static unsigned int btree_leaf_position ( const struct BTreeLeaf *leaf, const struct Employee *employee )
+{
+        unsigned int low = 0, high = leaf->count, mid;
+
+        while ( low < high ) {
+                mid = low + (high - low) / 2;
+                if ( index_compare(leaf->employees[mid], employee) < 0 )
+                        low = mid + 1;
+                else
+                        high = mid;
+        }
+        return low;
+}
+
+/* btree_insert_into():
+ *
+ * Adds "new" to the subtree "height" levels tall at "subtree" of "tree".
+ * If the subtree's top node has to split, returns the new right half and
+ * sets "*separator" to the least key under it; otherwise returns NULL.
+ */
+static void *btree_insert_into ( struct BTree *tree, void *subtree, int height,
+                                 struct Employee *new, struct BTreeKey *separator )
+{
+        struct Employee *employees[BTREE_LEAF_SIZE + 1];
+        struct BTreeKey keys[BTREE_FANOUT], key;
+        void *children[BTREE_FANOUT + 1], *split;
+        struct BTreeLeaf *leaf, *right_leaf;
+        struct BTreeNode *node, *right;
+        unsigned int i, n, half;
+
+        if ( height == 1 ) {
+                leaf = subtree;
+                i = btree_leaf_position(leaf, new);
+                if ( leaf->count < BTREE_LEAF_SIZE ) {
+                        memmove(&leaf->employees[i + 1], &leaf->employees[i],
+                                (leaf->count - i) * sizeof(struct Employee *));
+                        leaf->employees[i] = new;
+                        leaf->count++;
+                        return NULL;
+                }
+
+                /* split the full leaf into two halves */
+                memcpy(employees, leaf->employees, i * sizeof(struct Employee *));
+                employees[i] = new;
+                memcpy(employees + i + 1, leaf->employees + i,
+                       (BTREE_LEAF_SIZE - i) * sizeof(struct Employee *));
+                n = BTREE_LEAF_SIZE + 1;
+                half = n / 2;
+                right_leaf = btree_alloc(tree);
+                leaf->count = half;
+                memcpy(leaf->employees, employees, half * sizeof(struct Employee *));
+                right_leaf->count = n - half;
+                memcpy(right_leaf->employees, employees + half, (n - half) * sizeof(struct Employee *));
+                right_leaf->next = leaf->next;
+                leaf->next = right_leaf;
+                *separator = btree_key(right_leaf->employees[0]);
+                return right_leaf;
+        }
+
+        node = subtree;
+        i = btree_child(node, new);
+        split = btree_insert_into(tree, node->children[i], height - 1, new, &key);
+        if ( split == NULL )
+                return NULL;
+        if ( node->count < BTREE_FANOUT ) {
+                memmove(&node->keys[i + 1], &node->keys[i], (node->count - 1 - i) * sizeof(struct BTreeKey));
+                memmove(&node->children[i + 2], &node->children[i + 1], (node->count - 1 - i) * sizeof(void *));
+                node->keys[i] = key;
+                node->children[i + 1] = split;
+                node->count++;
+                return NULL;
+        }
+
+        /* split the full node, sending the middle key up */
+        memcpy(keys, node->keys, i * sizeof(struct BTreeKey));
+        keys[i] = key;
+        memcpy(keys + i + 1, node->keys + i, (BTREE_FANOUT - 1 - i) * sizeof(struct BTreeKey));
+        memcpy(children, node->children, (i + 1) * sizeof(void *));
+        children[i + 1] = split;
+        memcpy(children + i + 2, node->children + i + 1, (BTREE_FANOUT - 1 - i) * sizeof(void *));
+        n = BTREE_FANOUT + 1;
+        half = n / 2;
+        right = btree_alloc(tree);
+        node->count = half;
+        memcpy(node->keys, keys, (half - 1) * sizeof(struct BTreeKey));
+        memcpy(node->children, children, half * sizeof(void *));
+        *separator = keys[half - 1];
+        right->count = n - half;
+        memcpy(right->keys, keys + half, (n - half - 1) * sizeof(struct BTreeKey));
+        memcpy(right->children, children + half, (n - half) * sizeof(void *));
+        return right;
+}
+
+static void btree_insert ( struct BTree *tree, struct Employee *new )
+{
+        struct BTreeLeaf *leaf;
+        struct BTreeNode *root;
+        struct BTreeKey key;
+        void *split;
+
+        if ( tree->root == NULL ) {
+                leaf = btree_alloc(tree);
+                leaf->count = 0;
+                leaf->next = NULL;
+                tree->root = leaf;
+                tree->height = 1;
+        }
+        split = btree_insert_into(tree, tree->root, tree->height, new, &key);
+        if ( split != NULL ) {
+                root = btree_alloc(tree);
+                root->count = 2;
+                root->keys[0] = key;
+                root->children[0] = tree->root;
+                root->children[1] = split;
+                tree->root = root;
+                tree->height++;
+        }
+        tree->count++;
+}
+
+/* removes keys[j] and children[j + 1] from "node" */
+static void btree_remove_child ( struct BTreeNode *node, unsigned int j )
+{
+        memmove(&node->keys[j], &node->keys[j + 1], (node->count - 2 - j) * sizeof(struct BTreeKey));
+        memmove(&node->children[j + 1], &node->children[j + 2], (node->count - 2 - j) * sizeof(void *));
+        node->count--;
+}
+
+/* btree_rebalance():
+ *
+ * Merges children[j] and children[j + 1] of "node", which are "height"
+ * levels tall, if they fit in one node, or else shares their entries out
+ * evenly between them.
+ */
+static void btree_rebalance ( struct BTree *tree, struct BTreeNode *node, unsigned int j, int height )
+{
+        struct Employee *employees[2 * BTREE_LEAF_SIZE];
+        struct BTreeKey keys[2 * BTREE_FANOUT];
+        void *children[2 * BTREE_FANOUT];
+        struct BTreeLeaf *left_leaf, *right_leaf;
+        struct BTreeNode *left, *right;
+        unsigned int n, half;
+
+        if ( height == 1 ) {
+                left_leaf = node->children[j];
+                right_leaf = node->children[j + 1];
+                n = left_leaf->count + right_leaf->count;
+                memcpy(employees, left_leaf->employees, left_leaf->count * sizeof(struct Employee *));
+                memcpy(employees + left_leaf->count, right_leaf->employees,
+                       right_leaf->count * sizeof(struct Employee *));
+                if ( n <= BTREE_LEAF_SIZE ) {
+                        memcpy(left_leaf->employees, employees, n * sizeof(struct Employee *));
+                        left_leaf->count = n;
+                        left_leaf->next = right_leaf->next;
+                        btree_free(tree, right_leaf);
+                        btree_remove_child(node, j);
+                        return;
+                }
+                half = n / 2;
+                left_leaf->count = half;
+                memcpy(left_leaf->employees, employees, half * sizeof(struct Employee *));
+                right_leaf->count = n - half;
+                memcpy(right_leaf->employees, employees + half, (n - half) * sizeof(struct Employee *));
+                node->keys[j] = btree_key(right_leaf->employees[0]);
+                return;
+        }
+
+        /* the separator comes down between the two nodes' keys */
+        left = node->children[j];
+        right = node->children[j + 1];
+        n = left->count + right->count;
+        memcpy(keys, left->keys, (left->count - 1) * sizeof(struct BTreeKey));
+        keys[left->count - 1] = node->keys[j];
+        memcpy(keys + left->count, right->keys, (right->count - 1) * sizeof(struct BTreeKey));
+        memcpy(children, left->children, left->count * sizeof(void *));
+        memcpy(children + left->count, right->children, right->count * sizeof(void *));
+        if ( n <= BTREE_FANOUT ) {
+                memcpy(left->keys, keys, (n - 1) * sizeof(struct BTreeKey));
+                memcpy(left->children, children, n * sizeof(void *));
+                left->count = n;
+                btree_free(tree, right);
+                btree_remove_child(node, j);
+                return;
+        }
+        half = n / 2;
+        left->count = half;
+        memcpy(left->keys, keys, (half - 1) * sizeof(struct BTreeKey));
+        memcpy(left->children, children, half * sizeof(void *));
+        node->keys[j] = keys[half - 1];
+        right->count = n - half;
+        memcpy(right->keys, keys + half, (n - half - 1) * sizeof(struct BTreeKey));
+        memcpy(right->children, children + half, (n - half) * sizeof(void *));
+}
+
+/* removes "old" from the subtree at "subtree", returning non-zero if that
+   leaves its top node with too few entries */
+static int btree_erase_from ( struct BTree *tree, void *subtree, int height,
+                              const struct Employee *old )
+{
+        struct BTreeLeaf *leaf;
+        struct BTreeNode *node;
+        unsigned int i;
+
+        if ( height == 1 ) {
+                leaf = subtree;
+                i = btree_leaf_position(leaf, old);
+                memmove(&leaf->employees[i], &leaf->employees[i + 1],
+                        (leaf->count - i - 1) * sizeof(struct Employee *));
+                leaf->count--;
+                return leaf->count < BTREE_LEAF_MIN;
+        }
+        node = subtree;
+        i = btree_child(node, old);
+        if ( btree_erase_from(tree, node->children[i], height - 1, old) )
+                btree_rebalance(tree, node, i + 1 < node->count ? i : i - 1, height - 1);
+        return node->count < BTREE_FANOUT_MIN;
+}
+
+static void btree_erase ( struct BTree *tree, struct Employee *old )
+{
+        struct BTreeNode *root;
+
+        btree_erase_from(tree, tree->root, tree->height, old);
+        tree->count--;
+        /* a root left with one child hands over to it */
+        while ( tree->height > 1 && ((struct BTreeNode *) tree->root)->count == 1 ) {
+                root = tree->root;
+                tree->root = root->children[0];
+                btree_free(tree, root);
+                tree->height--;
+        }
+        if ( tree->height == 1 && ((struct BTreeLeaf *) tree->root)->count == 0 ) {
+                btree_free(tree, tree->root);
+                tree->root = NULL;
+                tree->height = 0;
+        }
+}
+
+static void btree_release ( struct BTree *tree )
+{
+        struct BTreeSlab *slab;
+
+        while ( tree->slabs != NULL ) {
+                slab = tree->slabs;
+                tree->slabs = slab->next;
+                free(slab);
+        }
+        memset(tree, 0, sizeof(struct BTree));
+}
+
+/* btree_build():
+ *
+ * Replaces "tree" with one over "n" employees in index order, built a
+ * level at a time from the leaves up. Each level is packed as full as it
+ * can be, with the entries spread evenly so that no node is left short.
+ */
+static void btree_build ( struct BTree *tree, struct Employee **records, size_t n )
+{
+        struct BTreeLeaf *leaf;
+        struct BTreeNode *node;
+        struct BTreeKey *least;
+        void **level;
+        size_t count, parents, first, size, i, j;
+
+        btree_release(tree);
+        if ( n == 0 )
+                return;
+        count = (n + BTREE_LEAF_SIZE - 1) / BTREE_LEAF_SIZE;
+        level = btree_malloc(count * sizeof(void *));
+        least = btree_malloc(count * sizeof(struct BTreeKey));
+        for ( i = 0, first = 0; i < count; i++, first += size ) {
+                size = (n - first) / (count - i);
+                leaf = btree_alloc(tree);
+                leaf->count = size;
+                leaf->next = NULL;
+                memcpy(leaf->employees, records + first, size * sizeof(struct Employee *));
+                if ( i > 0 )
+                        ((struct BTreeLeaf *) level[i - 1])->next = leaf;
+                level[i] = leaf;
+                least[i] = btree_key(records[first]);
+        }
+        tree->height = 1;
+
+        /* each level's nodes become the children of the next */
+        for ( ; count > 1; count = parents, tree->height++ ) {
+                parents = (count + BTREE_FANOUT - 1) / BTREE_FANOUT;
+                for ( i = 0, first = 0; i < parents; i++, first += size ) {
+                        size = (count - first) / (parents - i);
+                        node = btree_alloc(tree);
+                        node->count = size;
+                        for ( j = 0; j < size; j++ ) {
+                                node->children[j] = level[first + j];
+                                if ( j > 0 )
+                                        node->keys[j - 1] = least[first + j];
+                        }
+                        level[i] = node;
+                        least[i] = least[first];
+                }
+        }
+        tree->root = level[0];
+        tree->count = n;
+        free(level);
+        free(least);
+}
+
+/* the leftmost leaf, where a walk starts */
+static struct BTreeLeaf *btree_first_leaf ( const struct BTree *tree )
+{
+        void *node = tree->root;
+        int height;
+
+        for ( height = tree->height; height > 1; height-- )
+                node = ((struct BTreeNode *) node)->children[0];
+        return node;
+}
+
+/* a few employees are erased in turn; more are dropped in one walk of the
+   leaves, skipping a sorted copy of "olds", and the tree rebuilt */
+static void btree_erase_many ( struct BTree *tree, struct Employee * const *olds, size_t n )
+{
+        struct Employee **sorted, **kept;
+        struct BTreeLeaf *leaf;
+        size_t i, k = 0, m = 0;
+
+        if ( n * 16 < tree->count ) {
+                for ( i = 0; i < n; i++ )
+                        btree_erase(tree, olds[i]);
+                return;
+        }
+        sorted = btree_malloc(n * sizeof(struct Employee *) + 1);
+        kept = btree_malloc(tree->count * sizeof(struct Employee *) + 1);
+        memcpy(sorted, olds, n * sizeof(struct Employee *));
+        qsort(sorted, n, sizeof(struct Employee *), compare_indexed);
+        for ( leaf = btree_first_leaf(tree); leaf != NULL; leaf = leaf->next )
+                for ( i = 0; i < leaf->count; i++ )
+                        if ( k < n && leaf->employees[i] == sorted[k] )
+                                k++;
+                        else
+                                kept[m++] = leaf->employees[i];
+        btree_build(tree, kept, m);
+        free(kept);
+        free(sorted);
+}
+
+/* a few employees are inserted in turn; more are merged with the leaves
+   and the tree rebuilt from the result */
+static void btree_load ( struct BTree *tree, struct Employee **records, size_t n )
+{
+        struct Employee **merged;
+        struct BTreeLeaf *leaf;
+        size_t i = 0, j = 0, m = 0;
+
+        if ( tree->count > 0 && n * 16 < tree->count ) {
+                for ( i = 0; i < n; i++ )
+                        btree_insert(tree, records[i]);
+                return;
+        }
+        if ( tree->count == 0 ) {
+                btree_build(tree, records, n);
+                return;
+        }
+        merged = btree_malloc((tree->count + n) * sizeof(struct Employee *));
+        for ( leaf = btree_first_leaf(tree); leaf != NULL; leaf = leaf->next )
+                for ( i = 0; i < leaf->count; i++ ) {
+                        while ( j < n && index_compare(records[j], leaf->employees[i]) < 0 )
+                                merged[m++] = records[j++];
+                        merged[m++] = leaf->employees[i];
+                }
+        while ( j < n )
+                merged[m++] = records[j++];
+        btree_build(tree, merged, m);
+        free(merged);
+}
+
+static void btree_seek ( const struct BTree *tree, struct Cursor *cursor, const char *name )
+{
+        const struct BTreeNode *node;
+        struct BTreeLeaf *leaf;
+        unsigned int low, high, mid;
+        void *subtree = tree->root;
+        int height;
+
+        cursor->employee = NULL;
+        cursor->node = NULL;
+        if ( subtree == NULL )
+                return;
+        /* follow the child after the last key before "name" */
+        for ( height = tree->height; height > 1; height-- ) {
+                node = subtree;
+                for ( low = 0, high = node->count - 1; name != NULL && low < high; ) {
+                        mid = low + (high - low) / 2;
+                        if ( strcmp(node->keys[mid].name, name) < 0 )
+                                low = mid + 1;
+                        else
+                                high = mid;
+                }
+                subtree = node->children[low];
+        }
+        leaf = subtree;
+        for ( low = 0, high = leaf->count; name != NULL && low < high; ) {
+                mid = low + (high - low) / 2;
+                if ( strcmp(leaf->employees[mid]->name, name) < 0 )
+                        low = mid + 1;
+                else
+                        high = mid;
+        }
+        if ( low == leaf->count ) {
+                leaf = leaf->next;
+                low = 0;
+        }
+        cursor->node = leaf;
+        cursor->position = low;
+        cursor->employee = leaf != NULL ? leaf->employees[low] : NULL;
+}
+
+static void btree_advance ( struct Cursor *cursor )
+{
+        struct BTreeLeaf *leaf = cursor->node;
+
+        if ( ++cursor->position == leaf->count ) {
+                leaf = leaf->next;
+                cursor->node = leaf;
+                cursor->position = 0;
+        }
+        cursor->employee = leaf != NULL ? leaf->employees[cursor->position] : NULL;
+}
+
+static struct BTree btree_tree;   /* the btree backend's tree */
+
+static void btree_backend_insert ( struct Employee *new )
+{
+        btree_insert(&btree_tree, new);
+}
+
+static void btree_backend_erase ( struct Employee *old )
+{
+        btree_erase(&btree_tree, old);
+}
+
+static void btree_backend_erase_many ( struct Employee * const *olds, size_t n )
+{
+        btree_erase_many(&btree_tree, olds, n);
+}
+
+static void btree_backend_load ( struct Employee **records, size_t n )
+{
+        btree_load(&btree_tree, records, n);
+}
+
+static void btree_backend_seek ( struct Cursor *cursor, const char *name )
+{
+        btree_seek(&btree_tree, cursor, name);
+}
+
+static void btree_backend_release(void)
+{
+        btree_release(&btree_tree);
+}
+
+static const struct StorageBackend btree_backend = {
+        "btree", btree_backend_insert, btree_backend_erase, btree_backend_erase_many,
+        btree_backend_load, btree_backend_seek, btree_advance, btree_backend_release
+};
+
+/* sharded backend:
+ *
+ * The employees are split between MAX_SHARDS B+-trees by the hash of their
+ * name, just as the name hash table is split into parts, so all employees
+ * of one name are in the same shard and the same part. A bulk load or
+ * erase sorts the employees out by shard and works on all the shards at
+ * once, on up to one thread per processor; no two threads share a shard,
+ * so no shard needs a lock. Single changes are made one at a time, as
+ * with every backend, so only bulk changes gain from the shards. A walk in
+ * name order merges the shards, keeping them in a heap ordered on the next
+ * employee of each, in the walk's Cursor.
+ */
+
+struct Shard
+{
+        struct BTree tree;
+};
+
+static struct Shard shards[MAX_SHARDS];
+
+static struct Shard *shard_of ( const struct Employee *employee )
+{
+        return &shards[name_part(name_hash(employee->name))];
+}
+
+static void sharded_insert ( struct Employee *new )
+{
+        btree_insert(&shard_of(new)->tree, new);
+}
+
+static void sharded_erase ( struct Employee *old )
+{
+        btree_erase(&shard_of(old)->tree, old);
+}
+
+struct ShardWork
+{
+        void (*work) ( unsigned int shard, void *arg );
+        void *arg;
+        unsigned int first, step;        /* shards first, first + step, ... */
+};
+
+static void *shard_thread ( void *arg )
+{
+        struct ShardWork *job = arg;
+        unsigned int s;
+
+        for ( s = job->first; s <= name_table_mask; s += job->step )
+                job->work(s, job->arg);
+        stats_fold();
+        return NULL;
+}
+
+/* shard_run():
+ *
+ * Calls "work" with "arg" for each shard in use, which is just the one
+ * unless the backend is sharded, spreading them over up to one thread per
+ * processor. A call may change its own shard and part of the name hash
+ * table, but nothing that the shards share.
+ */
+static void shard_run ( void (*work) ( unsigned int shard, void *arg ), void *arg )
+{
+        struct ShardWork jobs[MAX_SHARDS];
+        pthread_t threads[MAX_SHARDS];
+        int started[MAX_SHARDS];
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        unsigned int num_threads = name_table_mask + 1, t;
+
+        if ( cpus < (long) num_threads )
+                num_threads = cpus < 1 ? 1 : cpus;
+        for ( t = 0; t < num_threads; t++ ) {
+                jobs[t].work = work;
+                jobs[t].arg = arg;
+                jobs[t].first = t;
+                jobs[t].step = num_threads;
+        }
+        for ( t = 1; t < num_threads; t++ )
+                started[t] = pthread_create(&threads[t], NULL, shard_thread, &jobs[t]) == 0;
+        for ( t = 1; t < num_threads; t++ )
+                if ( !started[t] )
+                        shard_thread(&jobs[t]);
+        shard_thread(&jobs[0]);
+        for ( t = 1; t < num_threads; t++ )
+                if ( started[t] )
+                        pthread_join(threads[t], NULL);
+}
+
+/* employees of a bulk change, sorted out by shard */
+struct ShardBatch
+{
+        struct Employee **records;
+        size_t first[MAX_SHARDS + 1];    /* where each shard's employees start */
+        int link;                        /* whether to add them to the hash table */
+};
+
+/* shard_split():
+ *
+ * Sorts "n" employees out by shard into "batch", keeping their order
+ * within each shard.
+ */
+static void shard_split ( struct ShardBatch *batch, struct Employee * const *records, size_t n )
+{
+        unsigned char *shard = btree_malloc(n + 1);
+        size_t next[MAX_SHARDS], i;
+        unsigned int s;
+
+        memset(batch->first, 0, sizeof(batch->first));
+        for ( i = 0; i < n; i++ ) {
+                shard[i] = name_part(name_hash(records[i]->name));
+                batch->first[shard[i] + 1]++;
+        }
+        for ( s = 0; s < MAX_SHARDS; s++ ) {
+                batch->first[s + 1] += batch->first[s];
+                next[s] = batch->first[s];
+        }
+        batch->records = btree_malloc(n * sizeof(struct Employee *) + 1);
+        for ( i = 0; i < n; i++ )
+                batch->records[next[shard[i]]++] = records[i];
+        free(shard);
+}
+
+static void shard_load ( unsigned int s, void *arg )
+{
+        struct ShardBatch *batch = arg;
+        struct Employee **records = batch->records + batch->first[s];
+        size_t n = batch->first[s + 1] - batch->first[s], i;
+
+        if ( n == 0 )
+                return;
+        btree_load(&shards[s].tree, records, n);
+        if ( batch->link )
+                for ( i = 0; i < n; i++ )
+                        name_table_add(&name_tables[s], name_hash(records[i]->name), records[i]);
+}
+
+static void shard_erase ( unsigned int s, void *arg )
+{
+        struct ShardBatch *batch = arg;
+        size_t n = batch->first[s + 1] - batch->first[s];
+
+        if ( n == 0 )
+                return;
+        btree_erase_many(&shards[s].tree, batch->records + batch->first[s], n);
+}
+
+static void sharded_erase_many ( struct Employee * const *olds, size_t n )
+{
+        struct ShardBatch batch;
+
+        shard_split(&batch, olds, n);
+        shard_run(shard_erase, &batch);
+        free(batch.records);
+}
+
+static void sharded_load ( struct Employee **records, size_t n )
+{
+        struct ShardBatch batch;
+
+        shard_split(&batch, records, n);
+        batch.link = 0;
+        shard_run(shard_load, &batch);
+        free(batch.records);
+}
+
+/* sharded_link():
+ *
+ * Loads "n" employees in index order into the shards as sharded_load()
+ * does, adding each to its part of the hash table on the same thread.
+ */
+static void sharded_link ( struct Employee **records, size_t n )
+{
+        struct ShardBatch batch;
+
+        shard_split(&batch, records, n);
+        batch.link = 1;
+        shard_run(shard_load, &batch);
+        free(batch.records);
+        name_table_count += n;
+}
+
+/* sifts the shard at heap[i] down to its place */
+static void shard_merge_down ( struct ShardMerge *merge, unsigned int i )
+{
+        unsigned int s = merge->heap[i], child;
+
+        for ( ; (child = 2*i + 1) < merge->size; i = child ) {
+                if ( child + 1 < merge->size
+                     && index_compare(merge->employee[merge->heap[child+1]],
+                                      merge->employee[merge->heap[child]]) < 0 )
+                        child++;
+                if ( index_compare(merge->employee[merge->heap[child]], merge->employee[s]) >= 0 )
+                        break;
+                merge->heap[i] = merge->heap[child];
+        }
+        merge->heap[i] = s;
+}
+
+/* starts "merge" at the first employee whose name is not before "name",
+   or at the very first if "name" is NULL, and returns that employee */
+static struct Employee *shard_merge_seek ( struct ShardMerge *merge, const char *name )
+{
+        struct Cursor at;
+        unsigned int s, i;
+
+        merge->size = 0;
+        for ( s = 0; s <= name_table_mask; s++ ) {
+                btree_seek(&shards[s].tree, &at, name);
+                merge->employee[s] = at.employee;
+                merge->node[s] = at.node;
+                merge->position[s] = at.position;
+                if ( at.employee != NULL )
+                        merge->heap[merge->size++] = s;
+        }
+        for ( i = merge->size / 2; i-- > 0; )
+                shard_merge_down(merge, i);
+        return merge->size > 0 ? merge->employee[merge->heap[0]] : NULL;
+}
+
+/* moves "merge" on, returning the next employee or NULL at the end */
+static struct Employee *shard_merge_advance ( struct ShardMerge *merge )
+{
+        unsigned int s = merge->heap[0];
+        struct Cursor at;
+
+        at.node = merge->node[s];
+        at.position = merge->position[s];
+        btree_advance(&at);
+        merge->employee[s] = at.employee;
+        merge->node[s] = at.node;
+        merge->position[s] = at.position;
+        if ( at.employee == NULL && --merge->size > 0 )
+                merge->heap[0] = merge->heap[merge->size];
+        if ( merge->size == 0 )
+                return NULL;
+        shard_merge_down(merge, 0);
+        return merge->employee[merge->heap[0]];
+}
+
+static void sharded_seek ( struct Cursor *cursor, const char *name )
+{
+        cursor->employee = shard_merge_seek(&cursor->merge, name);
+}
+
+static void sharded_advance ( struct Cursor *cursor )
+{
+        cursor->employee = shard_merge_advance(&cursor->merge);
+}
+
+static void sharded_release(void)
+{
+        unsigned int s;
+
+        for ( s = 0; s < MAX_SHARDS; s++ )
+                btree_release(&shards[s].tree);
+}
+
+static const struct StorageBackend sharded_backend = {
+        "sharded", sharded_insert, sharded_erase, sharded_erase_many,
+        sharded_load, sharded_seek, sharded_advance, sharded_release
+};
+
+static const struct StorageBackend *backends[] = {
+        &list_backend, &array_backend, &columnar_backend, &btree_backend, &sharded_backend
+};
+static const struct StorageBackend *backend = &list_backend;
+static int backend_chosen = 0;   /* set by --backend */
+
+/* picks the backend called "name", returning -1 if there is none */
+static int choose_backend ( const char *name )
+{
+        size_t i;
+
+        for ( i = 0; i < sizeof(backends) / sizeof(backends[0]); i++ )
+                if ( strcmp(backends[i]->name, name) == 0 ) {
+                        backend = backends[i];
+                        backend_chosen = 1;
+                        /* split the hash table the same way */
+                        if ( backend == &sharded_backend )
+                                name_table_mask = MAX_SHARDS - 1;
+                        return 0;
+                }
+        return -1;
+}
+
+/* hands the employees over from the current backend to "next" */
+static void switch_backend ( const struct StorageBackend *next )
+{
+        struct Employee **records;
+        struct Cursor at;
+        size_t n = 0;
+
+        records = btree_malloc(name_table_count * sizeof(struct Employee *) + 1);
+        for ( backend->seek(&at, NULL); at.employee != NULL; backend->advance(&at) )
+                records[n++] = at.employee;
+        backend->release();
+        backend = next;
+        backend->load(records, n);
+        free(records);
+}
+
+/*****************************************************************************
+*                              output functions                             *
+*                                                                           *
+* Printing the database with four printf() calls per employee spends most  *
+* of its time parsing format strings. Instead each employee is formatted by *
+* hand into a large buffer, which is written out to a file descriptor with  *
+* write() whenever it fills. A string too long to fit is sent along with    *
+* the buffer in a single writev().                                          *
+*****************************************************************************/
+
+#define OUTPUT_BUFFER_SIZE 65536
+#define OUTPUT_MEMORY      (-2)  /* fd of output kept in memory */
+
+struct OutputBuffer
+{
+        int fd;                          /* where the output goes */
+        int failed;                      /* set if a write has failed */
+        size_t used;                     /* bytes waiting in data */
+        char *memory;                    /* output written, if fd is OUTPUT_MEMORY */
+        size_t memory_used, memory_size;
+        char data[OUTPUT_BUFFER_SIZE];
+};
+
+/* writes all of "iov" to "out->fd", carrying on after partial writes */
+static void output_writev ( struct OutputBuffer *out, struct iovec *iov, int count )
+{
+        ssize_t result;
+
+        if ( out->fd == OUTPUT_MEMORY ) {
+                for ( ; count > 0; iov++, count-- ) {
+                        if ( out->memory_used + iov->iov_len > out->memory_size ) {
+                                out->memory_size = (out->memory_used + iov->iov_len) * 2;
+                                out->memory = realloc(out->memory, out->memory_size);
+                                if ( out->memory == NULL ) {
+                                        fprintf(stderr, "Out of memory, exiting\n");
+                                        exit(EXIT_FAILURE);
+                                }
+                        }
+                        memcpy(out->memory + out->memory_used, iov->iov_base, iov->iov_len);
+                        out->memory_used += iov->iov_len;
+                }
+                return;
+        }
+        while ( count > 0 && !out->failed ) {
+                result = writev(out->fd, iov, count);
+                if ( result == -1 ) {
+                        if ( errno != EINTR )
+                                out->failed = 1;
+                        continue;
+                }
+                /* skip whatever was written */
+                while ( count > 0 && (size_t) result >= iov->iov_len ) {
+                        result -= iov->iov_len;
+                        iov++;
+                        count--;
+                }
+                if ( count > 0 ) {
+                        iov->iov_base = (char *) iov->iov_base + result;
+                        iov->iov_len -= result;
+                }
+        }
+}
+
+static void output_flush ( struct OutputBuffer *out )
+{
+        struct iovec iov;
+
+        iov.iov_base = out->data;
+        iov.iov_len = out->used;
+        output_writev(out, &iov, 1);
+        out->used = 0;
+}
+
+static void output_text ( struct OutputBuffer *out, const char *text, size_t length )
+{
+        struct iovec iov[2];
+
+        if ( length <= OUTPUT_BUFFER_SIZE - out->used ) {
+                memcpy(out->data + out->used, text, length);
+                out->used += length;
+                return;
+        }
+        if ( length < OUTPUT_BUFFER_SIZE / 2 ) {
+                output_flush(out);
+                memcpy(out->data, text, length);
+                out->used = length;
+                return;
+        }
+
+        /* a long string goes out directly, after what is buffered */
+        iov[0].iov_base = out->data;
+        iov[0].iov_len = out->used;
+        iov[1].iov_base = (char *) text;
+        iov[1].iov_len = length;
+        output_writev(out, iov, 2);
+        out->used = 0;
+}
+
+/* adds the decimal digits of "number" to the output */
+static void output_number ( struct OutputBuffer *out, unsigned long number )
+{
+        char digits[20];
+        int i = sizeof(digits);
+
+        do {
+                digits[--i] = '0' + number % 10;
+                number /= 10;
+        } while ( number != 0 );
+        output_text(out, digits + i, sizeof(digits) - i);
+}
+
+/* output_record():
+ *
+ * Adds an employee's details to the output in the same form as the
+ * database file, with "prefix" in front of the name in place of "Name: ".
+ */
+static void output_record ( struct OutputBuffer *out, const char *prefix,
+                            const char *name, size_t name_length, char sex_char,
+                            unsigned int age, const char *job, size_t job_length )
+{
+        char sex[8] = "\nSex: ?\n";
+
+        output_text(out, prefix, strlen(prefix));
+        output_text(out, name, name_length);
+        sex[6] = sex_char;
+        output_text(out, sex, sizeof(sex));
+        output_text(out, "Age: ", 5);
+        output_number(out, age);
+        output_text(out, "\nJob: ", 6);
+        output_text(out, job, job_length);
+        output_text(out, "\n\n", 2);
+}
+
+/* adds an employee to the output in the same form as the database file */
+static void output_employee ( struct OutputBuffer *out, const struct Employee *employee )
+{
+        const char *job = job_title(employee->job);
+
+        output_record(out, "Name: ", employee->name, strlen(employee->name),
+                      employee->sex, employee->age, job, strlen(job));
+}
+
+/* formats the database can be written in, besides its own */
+#define FORMAT_TEXT  0   /* the database file format */
+#define FORMAT_CSV   1   /* a "name,sex,age,job" header, then a line each */
+#define FORMAT_JSONL 2   /* a JSON object on a line each */
+
+/* characters that make a CSV field be quoted, and that a JSON string has to
+   escape, for strcspn() to look for in one pass */
+static const char csv_special[] = ",\"\r\n";
+static const char json_special[] = "\"\\\001\002\003\004\005\006\007\010\011\012\013\014\015\016\017"
+                                   "\020\021\022\023\024\025\026\027\030\031\032\033\034\035\036\037";
+
+/* adds "text", a string of "length" characters, as a CSV field, quoted if
+   it holds a special character or starts or ends with a space */
+static void output_csv_field ( struct OutputBuffer *out, const char *text, size_t length )
+{
+        const char *quote;
+
+        if ( strcspn(text, csv_special) == length
+             && (length == 0 || (text[0] != ' ' && text[length - 1] != ' ')) ) {
+                output_text(out, text, length);
+                return;
+        }
+        /* quoted, with each quote inside doubled */
+        output_text(out, "\"", 1);
+        while ( (quote = memchr(text, '"', length)) != NULL ) {
+                output_text(out, text, quote + 1 - text);
+                output_text(out, "\"", 1);
+                length -= quote + 1 - text;
+                text = quote + 1;
+        }
+        output_text(out, text, length);
+        output_text(out, "\"", 1);
+}
+
+/* adds "text", a string of "length" characters, as the inside of a JSON
+   string, copying the runs between characters that need escaping whole */
+static void output_json_string ( struct OutputBuffer *out, const char *text, size_t length )
+{
+        static const char hex[] = "0123456789abcdef";
+        char escape[6] = "\\u00";
+        size_t run;
+
+        while ( (run = strcspn(text, json_special)) < length ) {
+                output_text(out, text, run);
+                switch ( text[run] ) {
+                case '"':  output_text(out, "\\\"", 2); break;
+                case '\\': output_text(out, "\\\\", 2); break;
+                case '\n': output_text(out, "\\n", 2); break;
+                case '\r': output_text(out, "\\r", 2); break;
+                case '\t': output_text(out, "\\t", 2); break;
+                default:
+                        escape[4] = hex[(unsigned char) text[run] >> 4];
+                        escape[5] = hex[text[run] & 15];
+                        output_text(out, escape, 6);
+                        break;
+                }
+                text += run + 1;
+                length -= run + 1;
+        }
+        output_text(out, text, length);
+}
+
+/* adds an employee to the output in "format" */
+static void output_formatted ( struct OutputBuffer *out, const struct Employee *employee, int format )
+{
+        const char *job = job_title(employee->job);
+        char sex[2] = { employee->sex, ',' };
+
+        switch ( format ) {
+        case FORMAT_CSV:
+                output_csv_field(out, employee->name, strlen(employee->name));
+                output_text(out, ",", 1);
+                output_text(out, sex, 2);
+                output_number(out, employee->age);
+                output_text(out, ",", 1);
+                output_csv_field(out, job, strlen(job));
+                output_text(out, "\n", 1);
+                break;
+        case FORMAT_JSONL:
+                output_text(out, "{\"name\":\"", 9);
+                output_json_string(out, employee->name, strlen(employee->name));
+                output_text(out, "\",\"sex\":\"", 9);
+                output_text(out, sex, 1);
+                output_text(out, "\",\"age\":", 8);
+                output_number(out, employee->age);
+                output_text(out, ",\"job\":\"", 8);
+                output_json_string(out, job, strlen(job));
+                output_text(out, "\"}\n", 3);
+                break;
+        default:
+                output_employee(out, employee);
+                break;
+        }
+}
+
+/* the format named by the extension of "file_name", or "otherwise" if it
+   names none */
+static int file_format ( const char *file_name, int otherwise )
+{
+        const char *dot = strrchr(file_name, '.');
+
+        if ( dot != NULL && strcmp(dot, ".csv") == 0 )
+                return FORMAT_CSV;
+        if ( dot != NULL && (strcmp(dot, ".jsonl") == 0 || strcmp(dot, ".ndjson") == 0) )
+                return FORMAT_JSONL;
+        return otherwise;
+}
+
+static struct OutputBuffer output_buffer;
+
+/* employees in a piece of the sharded backend's output, on average */
+#define WRITE_PIECE_SIZE 16384
+
+struct WritePiece
+{
+        const char *from, *to;           /* names from "from" on, and before "to"
+                                            unless it is NULL */
+        int format;
+        struct OutputBuffer *out;        /* the piece, kept in memory */
+};
+
+/* merges the shards' employees in "arg", a WritePiece, into its output */
+static void *write_piece ( void *arg )
+{
+        struct WritePiece *piece = arg;
+        struct ShardMerge merge;
+        struct Employee *employee;
+
+        piece->out->failed = 0;
+        piece->out->used = 0;
+        piece->out->memory_used = 0;
+        for ( employee = shard_merge_seek(&merge, piece->from);
+              employee != NULL && (piece->to == NULL || strcmp(employee->name, piece->to) < 0);
+              employee = shard_merge_advance(&merge) )
+                output_formatted(piece->out, employee, piece->format);
+        output_flush(piece->out);
+        stats_fold();
+        return NULL;
+}
+
+/* write_shards():
+ *
+ * Writes every employee of the sharded backend to "out" in name order, in
+ * "format", on this thread alone unless "threaded" is set.
+ * The order is cut into pieces at names spaced evenly through the biggest
+ * shard, which holds a fair sample of all the names as every shard does.
+ * A round of pieces is merged and formatted into memory on one thread
+ * each, and then written out in order, until all have been.
+ */
+static void write_shards ( struct OutputBuffer *out, int format, int threaded )
+{
+        struct WritePiece pieces[MAX_SHARDS];
+        pthread_t threads[MAX_SHARDS];
+        int started[MAX_SHARDS];
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        size_t num_pieces = name_table_count / WRITE_PIECE_SIZE, position = 0, p, k;
+        const struct BTree *biggest = &shards[0].tree;
+        const struct BTreeLeaf *leaf;
+        struct ShardMerge merge;
+        struct Employee *employee;
+        const char **names;
+        unsigned int num_threads = cpus > MAX_SHARDS ? MAX_SHARDS : cpus, s, t;
+
+        if ( !threaded || num_threads < 2 || num_pieces < 2 ) {
+                for ( employee = shard_merge_seek(&merge, NULL); employee != NULL;
+                      employee = shard_merge_advance(&merge) )
+                        output_formatted(out, employee, format);
+                return;
+        }
+
+        /* names[p] starts piece p, except that names[0] and names[num_pieces]
+           are NULL, for no limit */
+        for ( s = 1; s <= name_table_mask; s++ )
+                if ( shards[s].tree.count > biggest->count )
+                        biggest = &shards[s].tree;
+        names = btree_malloc((num_pieces + 1) * sizeof(const char *));
+        names[0] = names[num_pieces] = NULL;
+        for ( leaf = btree_first_leaf(biggest), k = 1; leaf != NULL && k < num_pieces; leaf = leaf->next ) {
+                while ( k < num_pieces && k * biggest->count / num_pieces < position + leaf->count ) {
+                        names[k] = leaf->employees[k * biggest->count / num_pieces - position]->name;
+                        k++;
+                }
+                position += leaf->count;
+        }
+
+        for ( t = 0; t < num_threads; t++ ) {
+                pieces[t].format = format;
+                pieces[t].out = btree_malloc(sizeof(struct OutputBuffer));
+                pieces[t].out->fd = OUTPUT_MEMORY;
+                pieces[t].out->memory = NULL;
+                pieces[t].out->memory_size = 0;
+        }
+        for ( p = 0; p < num_pieces; p += num_threads ) {
+                for ( t = 0; t < num_threads && p + t < num_pieces; t++ ) {
+                        pieces[t].from = names[p + t];
+                        pieces[t].to = names[p + t + 1];
+                        started[t] = t > 0
+                                     && pthread_create(&threads[t], NULL, write_piece, &pieces[t]) == 0;
+                }
+                for ( t = 0; t < num_threads && p + t < num_pieces; t++ )
+                        if ( !started[t] )
+                                write_piece(&pieces[t]);
+                for ( t = 0; t < num_threads && p + t < num_pieces; t++ ) {
+                        if ( started[t] )
+                                pthread_join(threads[t], NULL);
+                        output_text(out, pieces[t].out->memory, pieces[t].out->memory_used);
+                }
+        }
+        for ( t = 0; t < num_threads; t++ ) {
+                free(pieces[t].out->memory);
+                free(pieces[t].out);
+        }
+        free(names);
+}
+
+/* write_database_as():
+ *
+ * Writes every employee, in name order, to the file descriptor "fd" in
+ * "format". The sharded backend may use helper threads for this if
+ * "threaded" is set. Returns -1 if writing failed, or 0 on success.
+ */
+static int write_database_as ( int fd, int format, int threaded )
+{
+        struct OutputBuffer *out = &output_buffer;
+        struct Cursor at;
+
+        out->fd = fd;
+        out->failed = 0;
+        out->used = 0;
+        if ( format == FORMAT_CSV )
+                output_text(out, "name,sex,age,job\n", 17);
+        if ( backend == &sharded_backend )
+                write_shards(out, format, threaded);
+        else
+                for ( backend->seek(&at, NULL); at.employee != NULL; backend->advance(&at) )
+                        output_formatted(out, at.employee, format);
+        output_flush(out);
+        return out->failed ? -1 : 0;
+}
+
+/* writes every employee, in name order, to "fd" as the database file holds
+   them, as write_database_as() does */
+static int write_database ( int fd )
+{
+        return write_database_as(fd, FORMAT_TEXT, 1);
+}
+
+/* writes the "n" employees in "employees" to "fd", as write_database() does */
+static int write_employees ( int fd, struct Employee **employees, size_t n )
+{
+        struct OutputBuffer *out = &output_buffer;
+        size_t i;
+
+        out->fd = fd;
+        out->failed = 0;
+        out->used = 0;
+        for ( i = 0; i < n; i++ )
+                output_employee(out, employees[i]);
+        output_flush(out);
+        return out->failed ? -1 : 0;
+}
+
+/*****************************************************************************
+*                         secondary index functions                         *
+*                                                                           *
+* Reports ask for employees by age range or by job, which the name order    *
+* doesn't help with. Ages are small, so each possible age has a bucket, and *
+* each job number has a posting list; both hold pointers to employees in no *
+* particular order. Each employee remembers where it is in its two lists,   *
+* so it is removed in O(1) by moving the last entry into its place. A query *
+* walks the smaller of the buckets and the posting list it needs, and sorts *
+* just the employees it finds into name order.                              *
+*****************************************************************************/
+
+/* ages are read as at most three digits */
+#define MAX_AGE 999
+
+struct Posting
+{
+        struct Employee **employees;
+        unsigned int count, capacity;
+};
+
+static struct Posting age_postings[MAX_AGE + 1];   /* indexed by age */
+static struct Posting *job_postings = NULL;        /* indexed by job number */
+static unsigned int num_job_postings = 0;
+
+/* adds "employee" to "posting", returning its position there */
+static unsigned int posting_add ( struct Posting *posting, struct Employee *employee )
+{
+        if ( posting->count == posting->capacity ) {
+                posting->capacity = posting->capacity == 0 ? 8 : posting->capacity * 2;
+                posting->employees = realloc(posting->employees,
+                                             posting->capacity * sizeof(struct Employee *));
+                if ( posting->employees == NULL ) {
+                        fprintf(stderr, "Out of memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+        }
+        posting->employees[posting->count] = employee;
+        return posting->count++;
+}
+
+/* removes the entry at "slot" from "posting", returning the employee moved
+   into its place, or NULL if it was the last */
+static struct Employee *posting_remove ( struct Posting *posting, unsigned int slot )
+{
+        struct Employee *moved = posting->employees[--posting->count];
+
+        posting->employees[slot] = moved;
+        return slot < posting->count ? moved : NULL;
+}
+
+/* query_index_add():
+ *
+ * Adds "employee" to its age bucket and its job's posting list, and to the
+ * report columns and the name search index.
+ */
+static void query_index_add ( struct Employee *employee )
+{
+        unsigned int old = num_job_postings;
+
+        if ( employee->job >= num_job_postings ) {
+                while ( employee->job >= num_job_postings )
+                        num_job_postings = num_job_postings == 0 ? 64 : num_job_postings * 2;
+                job_postings = realloc(job_postings, num_job_postings * sizeof(struct Posting));
+                if ( job_postings == NULL ) {
+                        fprintf(stderr, "Out of memory, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+                memset(job_postings + old, 0, (num_job_postings - old) * sizeof(struct Posting));
+        }
+        employee->age_slot = posting_add(&age_postings[employee->age], employee);
+        employee->job_slot = posting_add(&job_postings[employee->job], employee);
+        if ( backend != &columnar_backend )
+                report_columns_add(employee);
+        search_index_add(employee);
+}
+
+/* query_index_remove():
+ *
+ * Removes "employee" from its age bucket and its job's posting list, and
+ * from the report columns and the name search index.
+ */
+static void query_index_remove ( struct Employee *employee )
+{
+        struct Employee *moved;
+
+        moved = posting_remove(&age_postings[employee->age], employee->age_slot);
+        if ( moved != NULL )
+                moved->age_slot = employee->age_slot;
+        if ( backend != &columnar_backend )
+                report_columns_remove(employee);
+        moved = posting_remove(&job_postings[employee->job], employee->job_slot);
+        if ( moved != NULL )
+                moved->job_slot = employee->job_slot;
+        search_index_remove(employee);
+}
+
+static void release_query_index(void)
+{
+        unsigned int i;
+
+        for ( i = 0; i <= MAX_AGE; i++ )
+                free(age_postings[i].employees);
+        for ( i = 0; i < num_job_postings; i++ )
+                free(job_postings[i].employees);
+        free(job_postings);
+}
+
+/* query_employees():
+ *
+ * Writes the employees aged from "low" to "high" and with the job title
+ * "job", or any job if it is NULL, to "fd" in name order. Returns how many
+ * employees there were.
+ */
+static size_t query_employees ( int low, int high, const char *job, int fd )
+{
+        const struct Posting *posting = NULL;
+        struct Employee **found, *employee;
+        size_t n = 0, in_ages = 0;
+        unsigned int number = 0, i;
+        int age;
+
+        if ( low < 1 )
+                low = 1;
+        if ( high > MAX_AGE )
+                high = MAX_AGE;
+        for ( age = low; age <= high; age++ )
+                in_ages += age_postings[age].count;
+        if ( job != NULL ) {
+                number = find_job(job, strlen(job));
+                if ( number == NO_JOB || number >= num_job_postings )
+                        return 0;
+                posting = &job_postings[number];
+        }
+
+        /* collect from whichever index narrows the search down more */
+        found = malloc((posting != NULL && posting->count < in_ages ? posting->count : in_ages)
+                       * sizeof(struct Employee *) + 1);
+        if ( found == NULL ) {
+                fprintf(stderr, "Out of memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        if ( posting != NULL && posting->count < in_ages ) {
+                for ( i = 0; i < posting->count; i++ ) {
+                        employee = posting->employees[i];
+                        if ( employee->age >= low && employee->age <= high )
+                                found[n++] = employee;
+                }
+        } else {
+                for ( age = low; age <= high; age++ )
+                        for ( i = 0; i < age_postings[age].count; i++ ) {
+                                employee = age_postings[age].employees[i];
+                                if ( job == NULL || employee->job == number )
+                                        found[n++] = employee;
+                        }
+        }
+
+        qsort(found, n, sizeof(struct Employee *), compare_indexed);
+        write_employees(fd, found, n);
+        free(found);
+        return n;
+}
+
+/* parse_age_range():
+ *
+ * Reads an age range given as "<low>-<high>", or a single age, into "low"
+ * and "high". Returns -1 if "text" is anything else or the range is the
+ * wrong way round, and 0 otherwise.
+ */
+static int parse_age_range ( const char *text, int *low, int *high )
+{
+        char *end;
+
+        *low = strtol(text, &end, 10);
+        if ( end == text )
+                return -1;
+        *high = *low;
+        if ( *end == '-' ) {
+                text = end + 1;
+                *high = strtol(text, &end, 10);
+                if ( end == text )
+                        return -1;
+        }
+        return *end != '\0' || *low > *high ? -1 : 0;
+}
+
+/*******************************************************************************************
+*               menu_add_employee():                                                      *
+*                                                                                         *
+* Function that adds new employees to the database in their correct positions and keeps   *
+*  an ordered list.                                                                       *
+*  Creates a new node pointer and takes a slot for it from the employee allocator.        *
+*  Using the Surname as a sorting parameter the name index finds the position that keeps  *
+*  the list ordered, without cycling through the list.                                    *
+*  Checks the input to ensure its valid before adding it to the list.                     *
+*******************************************************************************************/
+
+static void menu_add_employee(void)
+{
+        struct Employee *new;
+        uint64_t started;                          /*when the input was complete, for the statistics*/
+        char agestring[4];                         /*sets up node pointer for new employee*/
+        static char *text = NULL;                  /*buffer for the name and job as they are typed*/
+        static size_t text_size = 0;
+        new = alloc_employee(); /*takes a slot for the new employee from the employee slabs*/
+        /*adds in the data*/
+        fprintf(stderr, "Employee Name [Surname, other names]: ");
+        do {
+                read_long_line(stdin, &text, &text_size);
+        } while (strcmp(text,"")==0||atoi(text)!=0);                                 /*check for valid name input*/
+        new->name = pool_string(text, strlen(text));                                 /*keeps the name in the string pool*/
+
+        fprintf(stderr, "Employee Gender [Enter F or M]: ");
+        do {
+                read_line (stdin, &new->sex, 1);
+                if (new->sex == 'f') new->sex = 'F';
+                if (new->sex == 'm') new->sex = 'M';
+        }
+        while (new->sex != 'F' && new->sex != 'M');             /*check for valid gender input*/
+
+        fprintf(stderr, "Employee Age: ");
+        do {
+                read_line(stdin,agestring,3);
+                new->age=atoi(agestring);       /*convert agestring into an integer*/
+                if (new->age <= 0)
+                        fprintf(stderr, "Incorrect age, please try again\n");
+        } while ((new->age <= 0));                              /*check for valid gender input*/
+
+        fprintf(stderr, "Employee job: ");
+        do {
+                read_long_line(stdin, &text, &text_size);
+        } while (strcmp(text,"")==0||atoi(text)!=0);                                 /*check for valid job input*/
+        started = STATS_START();
+        new->job = intern_job(text, strlen(text));                                   /*looks up the job number, adding the job if it is new*/
+
+        new->sequence = next_sequence++; /*before any employee of the same name already there*/
+        backend->insert(new);         /*puts the new employee in its alphabetic position*/
+        name_table_insert(new);       /*makes the new employee findable by name*/
+        query_index_add(new);         /*and by age and job*/
+        database_modified = 1;
+        log_employee("Name: ", new);  /*records the addition in the operation log*/
+        log_commit();
+        STATS_STOP(STAT_ADD, started);
+}
+
+
+/********************************************************************
+*         menu_print_database():                                   *
+*                                                                  *
+* Prints the  database of employees to standard output.            *
+*  It hands the list to write_database(), which cycles through     *
+* it formatting the details for each employee into a buffer and    *
+* writing the buffer out whenever it fills                         *
+********************************************************************/
+
+static void menu_print_database(void)
+{
+        uint64_t started;
+
+        if (name_table_count == 0) /*displays message if there are no employees in the list*/
+                fprintf(stderr, "No Employee entries");
+        else {
+                started = STATS_START();
+                fflush(stdout);   /*anything printf'd so far must come out first*/
+                write_database(STDOUT_FILENO);
+                STATS_STOP(STAT_PRINT, started);
+        }
+}
+
+/********************************************************************
+*         menu_export_database():                                  *
+*                                                                  *
+* Streams the database to a file named by the user, in the same    *
+* form as the database file and as menu_print_database() prints it *
+* or, for a name ending in .csv or .jsonl, as CSV or JSON Lines    *
+********************************************************************/
+
+static void menu_export_database(void)
+{
+        static char *file_name = NULL;     /*buffer for the name of the file to write*/
+        static size_t file_name_size = 0;
+        int fd;
+
+        fprintf(stderr, "Enter the file to write the database to: ");
+        read_long_line(stdin, &file_name, &file_name_size);
+        fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+                fprintf(stderr, "Could not open %s\n", file_name);
+                return;
+        }
+        if (write_database_as(fd, file_format(file_name, FORMAT_TEXT), 1) == -1 || close(fd) == -1)
+                fprintf(stderr, "Could not write %s\n", file_name);
+        else
+                fprintf(stderr, "Database written to %s\n", file_name);
+}
+/********************************************************************
+*         menu_query_ages():                                       *
+*                                                                  *
+* Prints the employees whose age is in a range the user gives, in  *
+* name order, from the age buckets rather than the whole list      *
+********************************************************************/
+
+static void menu_query_ages(void)
+{
+        char agestring[4];
+        int low, high;
+        uint64_t started;
+
+        fprintf(stderr, "Lowest age: ");
+        read_line(stdin, agestring, 3);
+        low = atoi(agestring);
+        fprintf(stderr, "Highest age: ");
+        read_line(stdin, agestring, 3);
+        high = atoi(agestring);
+
+        started = STATS_START();
+        fflush(stdout);
+        if (query_employees(low, high, NULL, STDOUT_FILENO) == 0)
+                fprintf(stderr, "No employees aged %d to %d\n", low, high);
+        STATS_STOP(STAT_FIND, started);
+}
+
+/********************************************************************
+*         menu_query_job():                                        *
+*                                                                  *
+* Prints the employees with a job the user gives, in name order,   *
+* from the job's posting list rather than the whole list           *
+********************************************************************/
+
+static void menu_query_job(void)
+{
+        static char *job = NULL;           /*buffer for the job title*/
+        static size_t job_size = 0;
+        uint64_t started;
+
+        fprintf(stderr, "Job: ");
+        read_long_line(stdin, &job, &job_size);
+
+        started = STATS_START();
+        fflush(stdout);
+        if (query_employees(1, MAX_AGE, job, STDOUT_FILENO) == 0)
+                fprintf(stderr, "No employees with job %s\n", job);
+        STATS_STOP(STAT_FIND, started);
+}
+
+/********************************************************************
+*         menu_search_names():                                     *
+*                                                                  *
+* Prints the employees whose names start with, or if "anywhere" is *
+* set contain, some text the user gives, in name order             *
+********************************************************************/
+
+static void menu_search_names(int anywhere)
+{
+        static char *text = NULL;          /*buffer for the text to look for*/
+        static size_t text_size = 0;
+        size_t found;
+        uint64_t started;
+
+        fprintf(stderr, anywhere ? "Name contains: " : "Name starts with: ");
+        read_long_line(stdin, &text, &text_size);
+
+        started = STATS_START();
+        fflush(stdout);
+        found = anywhere ? search_names_containing(text, STDOUT_FILENO)
+                         : search_names_starting(text, STDOUT_FILENO);
+        if (found == 0)
+                fprintf(stderr, "No employees found matching %s\n", text);
+        STATS_STOP(STAT_FIND, started);
+}
+
+/*********************************************************************************************
+*       menu_delete_employee():                                                             *
+*  Delete new employee from database.                                                       *
+* It creates an array to take input from the user of the employee to be                     *
+* deleted. It first checks if the list has employees and if empty prints                    *
+* an error message. If the list isn't empty, it looks the employee up in the name hash    *
+* and if found, links the previous employee to the next employee and frees its slot.        *
+*********************************************************************************************/
+static void menu_delete_employee(void)
+{
+        struct Employee *cur;                  /*sets up position node*/
+        uint64_t started;                      /*when the name was entered, for the statistics*/
+
+        static char *name = NULL;              /*sets up a buffer for taking in the name to be deleted*/
+        static size_t name_size = 0;
+        if (name_table_count == 0)
+                fprintf(stderr, "Nothing to delete"); /*displays error if no entries in the list */
+        else {
+                fprintf(stderr, "Enter the name you wish to delete:\n");
+                read_long_line(stdin, &name, &name_size);
+                started = STATS_START();
+                fprintf(stderr, "searching for: %s\n", name);
+                cur = name_table_find(name); /*looks up the name to be deleted in the name hash table*/
+
+                if(cur == NULL) {                       /*if the employee isn't found, display a message and leave the list as it before*/
+                        fprintf(stderr, "Employee: %s not found\n",name);
+                        STATS_STOP(STAT_DELETE, started);
+                        return;
+                }
+                backend->erase(cur); /*links the previous employee to the next*/
+                name_table_remove(cur);
+                query_index_remove(cur);
+                database_modified = 1;
+                log_employee("Delete: ", cur); /*records the deletion in the operation log*/
+                log_commit();
+                free_employee(cur); /*returns the employee's slot for reuse, effectively deleting them */
+                fprintf(stderr, "Deleted: %s\n", name);
+                STATS_STOP(STAT_DELETE, started);
+        }
+}
+
+
+/*****************************************************************************
+*                          bulk loading functions                           *
+*                                                                           *
+* Loading a database file inserts every employee at once, so rather than   *
+* placing each record as it is read, the records are collected in a        *
+* buffer, sorted once by name with an MSD radix sort, and then linked into *
+* the list, the name index and the hash table in a single pass each.       *
+* While they are sorted the records are still parsed views into the file,  *
+* see the parallel loading functions below.                                *
+*****************************************************************************/
+
+/* buckets smaller than this are finished off with an insertion sort */
+#define RADIX_SORT_CUTOFF 32
+
+/* an employee as read from a database file, before it is stored */
+struct ParsedEmployee
+{
+        const char *name;        /* name, pointing into the file */
+        unsigned int name_length;
+        unsigned int job;        /* job number local to the chunk it came from */
+        short age;
+        char sex;
+};
+
+/* character "depth" of a parsed name, or 0 past its end */
+static unsigned char parsed_char ( const struct ParsedEmployee *record, size_t depth )
+{
+        return depth < record->name_length ? (unsigned char) record->name[depth] : 0;
+}
+
+/* orders parsed names as strcmp() would order them once copied, looking
+   only from "depth" on */
+static int compare_parsed ( const struct ParsedEmployee *a,
+                            const struct ParsedEmployee *b, size_t depth )
+{
+        size_t a_length = a->name_length - depth, b_length = b->name_length - depth;
+        int result = memcmp(a->name + depth, b->name + depth,
+                            a_length < b_length ? a_length : b_length);
+
+        if ( result != 0 )
+                return result;
+        return a_length < b_length ? -1 : a_length > b_length;
+}
+
+/* distributes "n" parsed employees into buckets by the character at
+   "depth" of their names, keeping their order within each bucket, and
+   sets count[c] to the end of bucket c */
+static void radix_distribute ( struct ParsedEmployee **records,
+                               struct ParsedEmployee **buffer,
+                               size_t n, size_t depth, size_t *count )
+{
+        size_t start, i;
+
+        memset(count, 0, 256 * sizeof(size_t));
+        for ( i = 0; i < n; i++ )
+                count[parsed_char(records[i], depth)]++;
+        for ( i = 0, start = 0; i < 256; i++ ) {
+                start += count[i];
+                count[i] = start - count[i];
+        }
+        for ( i = 0; i < n; i++ )
+                buffer[count[parsed_char(records[i], depth)]++] = records[i];
+        memcpy(records, buffer, n * sizeof(struct ParsedEmployee *));
+}
+
+/* radix_sort_parsed():
+ *
+ * Sorts "n" parsed employees by name, given that they all share the first
+ * "depth" characters of their names. The sort is stable, so employees with
+ * the same name stay in file order. "buffer" is scratch space for at least
+ * "n" pointers. Only the smaller buckets are sorted by recursion, and the
+ * largest by going round again, so however long the names the recursion
+ * is never deeper than log2(n).
+ */
+static void radix_sort_parsed ( struct ParsedEmployee **records,
+                                struct ParsedEmployee **buffer,
+                                size_t n, size_t depth )
+{
+        size_t count[256], largest, i, j;
+        struct ParsedEmployee *tmp;
+
+        for ( ; n >= RADIX_SORT_CUTOFF; depth++ ) {
+                /* count[c] is the end of bucket c; bucket 0 holds the names
+                   that ended at "depth", which are all equal and already in
+                   file order */
+                radix_distribute(records, buffer, n, depth, count);
+                for ( largest = 1, i = 2; i < 256; i++ )
+                        if ( count[i] - count[i-1] > count[largest] - count[largest-1] )
+                                largest = i;
+                for ( i = 1; i < 256; i++ )
+                        if ( i != largest && count[i] - count[i-1] > 1 )
+                                radix_sort_parsed(records + count[i-1], buffer,
+                                                  count[i] - count[i-1], depth + 1);
+                records += count[largest-1];
+                n = count[largest] - count[largest-1];
+        }
+
+        for ( i = 1; i < n; i++ ) {
+                tmp = records[i];
+                for ( j = i; j > 0 && compare_parsed(tmp, records[j-1], depth) < 0; j-- )
+                        records[j] = records[j-1];
+                records[j] = tmp;
+        }
+}
+
+/* order_equal_names():
+ *
+ * Puts runs of employees with the same name in "n" employees sorted by name
+ * into index order, newest first, once they have their sequence numbers.
+ */
+static void order_equal_names ( struct Employee **records, size_t n )
+{
+        size_t i, j;
+
+        for ( i = 0; i < n; i = j ) {
+                for ( j = i + 1; j < n && strcmp(records[i]->name, records[j]->name) == 0; j++ )
+                        ;
+                if ( j - i > 1 )
+                        qsort(records + i, j - i, sizeof(struct Employee *), compare_indexed);
+        }
+}
+
+/* link_sorted_employees():
+ *
+ * Adds "n" employees already in index order to the database, handing them
+ * to the storage backend in one go, and then to the hash table and the age
+ * and job indexes. The sharded backend fills each shard and its part of
+ * the hash table together, on the shard's thread.
+ */
+static void link_sorted_employees ( struct Employee **records, size_t n )
+{
+        size_t i;
+
+        if ( !backend_chosen && backend != &btree_backend
+             && name_table_count + n > BTREE_DEFAULT_SIZE )
+                switch_backend(&btree_backend);
+        if ( backend == &sharded_backend ) {
+                sharded_link(records, n);
+                for ( i = 0; i < n; i++ )
+                        query_index_add(records[i]);
+                return;
+        }
+        backend->load(records, n);
+        for ( i = 0; i < n; i++ ) {
+                name_table_insert(records[i]);
+                query_index_add(records[i]);
+        }
+}
+
+/*****************************************************************************
+*                          database file functions                          *
+*                                                                           *
+* A database file is mapped into memory in one go rather than read a        *
+* character at a time with fgetc(). Lines are found with memchr() and each  *
+* field is handled as a view (a start and a length) into the mapping; only  *
+* the parts that end up in an Employee structure are ever copied. Files     *
+* that cannot be mapped, such as pipes, are read into a buffer instead.     *
+*****************************************************************************/
+
+struct DatabaseFile
+{
+        const char *data;        /* contents of the file */
+        size_t size;             /* length of the contents */
+        int mapped;              /* 1 if data is a mapping, 0 if malloc'd */
+};
+
+struct FieldView
+{
+        const char *start;       /* first character of the field */
+        size_t length;           /* number of characters, excluding '\n' */
+};
+
+/* map_database_file():
+ *
+ * Makes the contents of "file_name" available in "file", returning -1 if
+ * it cannot be opened or read, or 0 on success.
+ */
+static int map_database_file ( const char *file_name, struct DatabaseFile *file )
+{
+        struct stat info;
+        char *buffer = NULL, *bigger;
+        size_t capacity = 0;
+        ssize_t result;
+        int fd;
+
+        fd = open(file_name, O_RDONLY);
+        if ( fd == -1 )
+                return -1;
+        if ( fstat(fd, &info) == -1 ) {
+                close(fd);
+                return -1;
+        }
+
+        file->data = NULL;
+        file->size = 0;
+        file->mapped = 0;
+
+        if ( S_ISREG(info.st_mode) ) {
+                if ( info.st_size > 0 ) {
+                        buffer = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                        if ( buffer == MAP_FAILED ) {
+                                close(fd);
+                                return -1;
+                        }
+                        madvise(buffer, info.st_size, MADV_SEQUENTIAL);
+                        file->data = buffer;
+                        file->size = info.st_size;
+                        file->mapped = 1;
+                }
+                close(fd);
+                return 0;
+        }
+
+        /* not a regular file, so read it all into a growing buffer */
+        for (;;) {
+                if ( file->size == capacity ) {
+                        capacity = capacity == 0 ? 65536 : capacity * 2;
+                        bigger = realloc(buffer, capacity);
+                        if ( bigger == NULL ) {
+                                free(buffer);
+                                close(fd);
+                                return -1;
+                        }
+                        buffer = bigger;
+                }
+                result = read(fd, buffer + file->size, capacity - file->size);
+                if ( result == -1 ) {
+                        free(buffer);
+                        close(fd);
+                        return -1;
+                }
+                if ( result == 0 )
+                        break;
+                file->size += result;
+        }
+        close(fd);
+        file->data = buffer;
+        return 0;
+}
+
+static void unmap_database_file ( struct DatabaseFile *file )
+{
+        if ( file->mapped )
+                munmap((void *) file->data, file->size);
+        else
+                free((void *) file->data);
+        file->data = NULL;
+}
+
+/* scan_field():
+ *
+ * The in-memory counterpart of the old read_string(): checks that the line
+ * at "*pos" starts with "prefix" and sets "field" to the rest of the line,
+ * moving "*pos" past the '\n'. Returns -1 if the prefix doesn't match or
+ * the end of the file comes before the end of the line, and 0 otherwise.
+ */
+static int scan_field ( const char **pos, const char *end,
+                        const char *prefix, struct FieldView *field )
+{
+        size_t prefix_length = strlen(prefix);
+        const char *newline;
+
+        if ( (size_t) (end - *pos) < prefix_length
+             || memcmp(*pos, prefix, prefix_length) != 0 )
+                return -1;
+
+        field->start = *pos + prefix_length;
+        newline = memchr(field->start, '\n', end - field->start);
+        if ( newline == NULL )
+                return -1;
+
+        field->length = newline - field->start;
+        *pos = newline + 1;
+        return 0;
+}
+
+/* field_is_number():
+ *
+ * Returns whether atoi() would read a non-zero number from the start of the
+ * field, without needing the field to be terminated.
+ */
+static int field_is_number ( const struct FieldView *field )
+{
+        const char *p = field->start, *end = field->start + field->length;
+
+        while ( p < end && isspace((unsigned char) *p) )
+                p++;
+        if ( p < end && (*p == '+' || *p == '-') )
+                p++;
+        for ( ; p < end && isdigit((unsigned char) *p); p++ )
+                if ( *p != '0' )
+                        return 1;
+        return 0;
+}
+
+/* copies a field into "string", keeping at most "max_length" characters
+   as read_line() does */
+static void copy_field ( char *string, const struct FieldView *field, int max_length )
+{
+        size_t length = field->length < (size_t) max_length ? field->length : (size_t) max_length;
+
+        memcpy(string, field->start, length);
+        string[length] = '\0';
+}
+
+/* check_name(), check_sex(), check_age(), check_job():
+ *
+ * The checks made on each field of an employee read from a file, shared by
+ * every format that employees are read in. Each returns the format of the
+ * error message if the field is not valid, or NULL after filling in "new".
+ */
+static const char *check_name ( const struct FieldView *field, struct ParsedEmployee *new )
+{
+        const char *nul;
+
+        if ( field->length == 0 || field_is_number(field) )
+                return "Invalid name with employee %i, exiting\n";
+        /* a name ends at any '\0' in it, as it will once copied */
+        nul = memchr(field->start, '\0', field->length);
+        new->name = field->start;
+        new->name_length = nul != NULL ? (size_t) (nul - field->start) : field->length;
+        return NULL;
+}
+
+static const char *check_sex ( const struct FieldView *field, struct ParsedEmployee *new )
+{
+        new->sex = field->length > 0 ? field->start[0] : '\0';
+        if ( new->sex == 'f' ) new->sex = 'F';
+        if ( new->sex == 'm' ) new->sex = 'M';
+        if ( new->sex != 'F' && new->sex != 'M' )
+                return "Invalid gender with employee %i, exiting\n";
+        return NULL;
+}
+
+static const char *check_age ( const struct FieldView *field, struct ParsedEmployee *new )
+{
+        char agestring[4];
+
+        copy_field(agestring, field, 3);
+        new->age = atoi(agestring);
+        if ( new->age <= 0 )
+                return "Incorrect age, with employee %i, exiting\n";
+        return NULL;
+}
+
+static const char *check_job ( const struct FieldView *field )
+{
+        if ( field->length == 0 || field_is_number(field) )
+                return "Invalid job with employee %i, exiting\n";
+        return NULL;
+}
+
+/*****************************************************************************
+*                         parallel loading functions                        *
+*                                                                           *
+* A large database file is split into chunks at blank lines, which is where *
+* records end, and the chunks are parsed and sorted at the same time on     *
+* separate threads. Each thread only reads the file and writes to its own   *
+* LoadChunk: parsed employees are views into the file, and job titles are   *
+* numbered within the chunk. The main thread then reports the first error   *
+* in file order, with the employee number counted from the start of the     *
+* file, or merges the sorted chunks and stores the employees in one pass.   *
+*                                                                           *
+* Splitting at a blank line never changes what a file means: a blank line   *
+* either ends a record, in which case the next chunk starts exactly where   *
+* reading the whole file in one go would have started the next record, or  *
+* it is an error that the earlier chunk reports itself.                     *
+*****************************************************************************/
+
+/* most threads to load with, and least file to give each of them */
+#define MAX_LOAD_THREADS 32
+#define MIN_LOAD_CHUNK   (1 << 20)
+
+struct LoadChunk
+{
+        const char *start, *end;         /* the chunk of the file */
+
+        struct ParsedEmployee *records;  /* employees, in file order */
+        struct ParsedEmployee **sorted;  /* the same, in name order */
+        size_t num_records, max_records;
+
+        struct FieldView *jobs;          /* distinct job titles */
+        unsigned int *job_numbers;       /* their numbers in job_titles */
+        unsigned int num_jobs, max_jobs;
+        unsigned int *job_table;         /* hash slots holding local job + 1 */
+        size_t job_table_size;
+
+        const char *error;               /* format of the first error, or NULL */
+        int error_employee;              /* employee number within the chunk */
+};
+
+static void *load_alloc ( void *old, size_t size )
+{
+        void *block = realloc(old, size);
+
+        if ( block == NULL ) {
+                fprintf(stderr, "Out of memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        return block;
+}
+
+/* numbers the job title "field" within "chunk" */
+static unsigned int chunk_job ( struct LoadChunk *chunk, const struct FieldView *field )
+{
+        size_t i, mask;
+
+        if ( (chunk->num_jobs + 1) * 2 > chunk->job_table_size ) {
+                chunk->job_table_size = chunk->job_table_size == 0 ? 64 : chunk->job_table_size * 2;
+                free(chunk->job_table);
+                chunk->job_table = load_alloc(NULL, chunk->job_table_size * sizeof(unsigned int));
+                memset(chunk->job_table, 0, chunk->job_table_size * sizeof(unsigned int));
+                mask = chunk->job_table_size - 1;
+                for ( i = 0; i < chunk->num_jobs; i++ ) {
+                        size_t slot = text_hash(chunk->jobs[i].start, chunk->jobs[i].length) & mask;
+                        while ( chunk->job_table[slot] != 0 )
+                                slot = (slot + 1) & mask;
+                        chunk->job_table[slot] = i + 1;
+                }
+        }
+
+        mask = chunk->job_table_size - 1;
+        for ( i = text_hash(field->start, field->length) & mask; chunk->job_table[i] != 0;
+              i = (i + 1) & mask ) {
+                const struct FieldView *job = &chunk->jobs[chunk->job_table[i] - 1];
+                if ( job->length == field->length
+                     && memcmp(job->start, field->start, field->length) == 0 )
+                        return chunk->job_table[i] - 1;
+        }
+
+        if ( chunk->num_jobs == chunk->max_jobs ) {
+                chunk->max_jobs = chunk->max_jobs == 0 ? 64 : chunk->max_jobs * 2;
+                chunk->jobs = load_alloc(chunk->jobs, chunk->max_jobs * sizeof(struct FieldView));
+        }
+        chunk->jobs[chunk->num_jobs] = *field;
+        chunk->job_table[i] = chunk->num_jobs + 1;
+        return chunk->num_jobs++;
+}
+
+/* parse_record():
+ *
+ * Reads the name line, starting with "prefix", and the Sex, Age and Job
+ * lines of one employee at "*pos" into "new", numbering the job title
+ * within "chunk". Returns the format of the error message if the record is
+ * not valid, or NULL if it is.
+ */
+static const char *parse_record ( struct LoadChunk *chunk, const char **pos,
+                                  const char *end, const char *prefix,
+                                  struct ParsedEmployee *new )
+{
+        struct FieldView field;
+        const char *error;
+
+        if ( scan_field(pos, end, prefix, &field) == -1 )
+                return "Invalid name input with employee %i, exiting\n";
+        if ( (error = check_name(&field, new)) != NULL )
+                return error;
+
+        if ( scan_field(pos, end, "Sex: ", &field) == -1 )
+                return "Invalid gender input with employee %i, exiting\n";
+        if ( (error = check_sex(&field, new)) != NULL )
+                return error;
+
+        if ( scan_field(pos, end, "Age: ", &field) == -1 )
+                return "Invalid age input with employee %i, exiting\n";
+        if ( (error = check_age(&field, new)) != NULL )
+                return error;
+
+        if ( scan_field(pos, end, "Job: ", &field) == -1 )
+                return "Invalid job input with employee %i, exiting\n";
+        if ( (error = check_job(&field)) != NULL )
+                return error;
+        new->job = chunk_job(chunk, &field);
+        return NULL;
+}
+
+/* makes room for one more record in "chunk" and returns it */
+static struct ParsedEmployee *chunk_record ( struct LoadChunk *chunk )
+{
+        if ( chunk->num_records == chunk->max_records ) {
+                chunk->max_records = chunk->max_records == 0 ? 1024 : chunk->max_records * 2;
+                chunk->records = load_alloc(chunk->records,
+                                            chunk->max_records * sizeof(struct ParsedEmployee));
+        }
+        return &chunk->records[chunk->num_records];
+}
+
+/* least records worth sorting on more than one thread */
+#define MIN_PARALLEL_SORT 65536
+
+/* the buckets of a first radix sort pass, for threads to finish off */
+struct SortBuckets
+{
+        struct ParsedEmployee **records, **buffer;
+        size_t count[256];               /* where each bucket ends */
+        atomic_uint next;                /* the next bucket to be taken */
+};
+
+/* sorts the buckets of "arg", a SortBuckets, one at a time until none are
+   left; the records of a bucket share only their first character */
+static void *sort_buckets ( void *arg )
+{
+        struct SortBuckets *sort = arg;
+        unsigned int c;
+
+        while ( (c = atomic_fetch_add(&sort->next, 1)) < 256 )
+                if ( sort->count[c] - sort->count[c-1] > 1 )
+                        radix_sort_parsed(sort->records + sort->count[c-1], sort->buffer + sort->count[c-1],
+                                          sort->count[c] - sort->count[c-1], 1);
+        return NULL;
+}
+
+/* sort_chunk():
+ *
+ * Sorts the records of "chunk" by name into chunk->sorted. If "parallel"
+ * is set and there are enough of them, the records are distributed by
+ * their first character and the buckets sorted on up to one thread per
+ * processor.
+ */
+static void sort_chunk ( struct LoadChunk *chunk, int parallel )
+{
+        struct ParsedEmployee **buffer;
+        struct SortBuckets sort;
+        pthread_t threads[MAX_LOAD_THREADS];
+        int started[MAX_LOAD_THREADS], num_threads = 1, t;
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        size_t i;
+
+        chunk->sorted = load_alloc(NULL, chunk->num_records * sizeof(struct ParsedEmployee *) + 1);
+        buffer = load_alloc(NULL, chunk->num_records * sizeof(struct ParsedEmployee *) + 1);
+        for ( i = 0; i < chunk->num_records; i++ )
+                chunk->sorted[i] = &chunk->records[i];
+        if ( parallel && chunk->num_records >= MIN_PARALLEL_SORT )
+                num_threads = cpus > MAX_LOAD_THREADS ? MAX_LOAD_THREADS : cpus;
+        if ( num_threads < 2 ) {
+                radix_sort_parsed(chunk->sorted, buffer, chunk->num_records, 0);
+                free(buffer);
+                return;
+        }
+
+        sort.records = chunk->sorted;
+        sort.buffer = buffer;
+        radix_distribute(chunk->sorted, buffer, chunk->num_records, 0, sort.count);
+        atomic_init(&sort.next, 1);
+        for ( t = 1; t < num_threads; t++ )
+                started[t] = pthread_create(&threads[t], NULL, sort_buckets, &sort) == 0;
+        sort_buckets(&sort);
+        for ( t = 1; t < num_threads; t++ )
+                if ( started[t] )
+                        pthread_join(threads[t], NULL);
+        free(buffer);
+}
+
+/* parse_chunk():
+ *
+ * Thread function that reads the employees in a LoadChunk, checking them
+ * exactly as reading the whole file would, and sorts them by name. It
+ * stops at the first error, recording it in the chunk.
+ */
+static void *parse_chunk ( void *arg )
+{
+        struct LoadChunk *chunk = arg;
+        const char *pos = chunk->start, *end = chunk->end;
+        int emp_num = 1;
+
+        do {
+                chunk->error = parse_record(chunk, &pos, end, "Name: ", chunk_record(chunk));
+                if ( chunk->error != NULL )
+                        break;
+                chunk->num_records++;
+
+                emp_num++;
+                /* takes in the blank line after the employee */
+                if ( pos == end || *pos++ != '\n' ) {
+                        chunk->error = "Bad input file, exiting. Details: Missing '\\n' at end of employee %i field\n";
+                        break;
+                }
+        } while ( pos != end );
+
+        if ( chunk->error != NULL ) {
+                chunk->error_employee = emp_num;
+                return NULL;
+        }
+
+        sort_chunk(chunk, 0);
+        return NULL;
+}
+
+/* returns the start of the record after the first blank line at or after
+   "pos", or "end" if there is none */
+static const char *next_record ( const char *pos, const char *end )
+{
+        const char *newline;
+
+        while ( pos < end && (newline = memchr(pos, '\n', end - pos)) != NULL ) {
+                if ( newline + 1 < end && newline[1] == '\n' )
+                        return newline + 2;
+                pos = newline + 1;
+        }
+        return end;
+}
+
+/* merge_chunks():
+ *
+ * Stores the employees of "num_chunks" sorted chunks in the database in
+ * name order, using a heap of the chunks keyed on their next employee.
+ * Employees with the same name are taken from earlier chunks first. The
+ * records are numbered as if added in the order they were read, or in the
+ * opposite order if "newest_first" is set, as it is for a database file.
+ */
+static void merge_chunks ( struct LoadChunk *chunks, int num_chunks, size_t total,
+                           int newest_first )
+{
+        int heap[MAX_LOAD_THREADS], heap_size = 0, child, c, i, tmp;
+        size_t next[MAX_LOAD_THREADS], first[MAX_LOAD_THREADS], n = 0, read;
+        struct Employee **records, *employee;
+        const struct ParsedEmployee *parsed;
+        unsigned int j;
+
+#define HEAD(c) (chunks[c].sorted[next[c]])
+#define BEFORE(a, b) (compare_parsed(HEAD(a), HEAD(b), 0) < 0 \
+                      || (compare_parsed(HEAD(a), HEAD(b), 0) == 0 && (a) < (b)))
+
+        /* give each chunk's job titles their database job numbers */
+        for ( c = 0; c < num_chunks; c++ ) {
+                chunks[c].job_numbers = load_alloc(NULL, (chunks[c].num_jobs + 1) * sizeof(unsigned int));
+                for ( j = 0; j < chunks[c].num_jobs; j++ )
+                        chunks[c].job_numbers[j] = intern_job(chunks[c].jobs[j].start,
+                                                              chunks[c].jobs[j].length);
+        }
+
+        for ( c = 0, read = 0; c < num_chunks; c++ ) {
+                next[c] = 0;
+                first[c] = read;
+                read += chunks[c].num_records;
+                if ( chunks[c].num_records == 0 )
+                        continue;
+                /* sift the chunk up into the heap */
+                for ( i = heap_size++; i > 0 && BEFORE(c, heap[(i-1)/2]); i = (i-1)/2 )
+                        heap[i] = heap[(i-1)/2];
+                heap[i] = c;
+        }
+
+        records = load_alloc(NULL, total * sizeof(struct Employee *) + 1);
+        while ( heap_size > 0 ) {
+                c = heap[0];
+                parsed = HEAD(c);
+                employee = alloc_employee();
+                employee->name = pool_string(parsed->name, parsed->name_length);
+                employee->job = chunks[c].job_numbers[parsed->job];
+                employee->age = parsed->age;
+                employee->sex = parsed->sex;
+                read = first[c] + (parsed - chunks[c].records);
+                employee->sequence = next_sequence + (newest_first ? total - 1 - read : read);
+                records[n++] = employee;
+
+                /* move on in this chunk, or drop it, then sift down */
+                if ( ++next[c] == chunks[c].num_records )
+                        c = heap[--heap_size];
+                for ( i = 0; (child = 2*i + 1) < heap_size; i = child ) {
+                        if ( child + 1 < heap_size && BEFORE(heap[child+1], heap[child]) )
+                                child++;
+                        if ( !BEFORE(heap[child], c) )
+                                break;
+                        tmp = heap[child];
+                        heap[i] = tmp;
+                }
+                if ( heap_size > 0 )
+                        heap[i] = c;
+        }
+#undef BEFORE
+#undef HEAD
+
+        next_sequence += total;
+        order_equal_names(records, n);
+        link_sorted_employees(records, n);
+        free(records);
+}
+
+/* load_text_database():
+ *
+ * Reads the employees in a database file's contents "data", of "size"
+ * bytes, on as many threads as it is worth using, exiting with the same
+ * error message that reading it in one go would give if it is not valid.
+ */
+static void load_text_database ( const char *data, size_t size )
+{
+        struct LoadChunk chunks[MAX_LOAD_THREADS];
+        pthread_t threads[MAX_LOAD_THREADS];
+        int num_chunks, started[MAX_LOAD_THREADS], c;
+        const char *pos = data, *end = data + size;
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        size_t total = 0;
+
+        /* split the file into up to one chunk per processor */
+        num_chunks = size / MIN_LOAD_CHUNK;
+        if ( num_chunks > cpus )
+                num_chunks = cpus;
+        if ( num_chunks > MAX_LOAD_THREADS )
+                num_chunks = MAX_LOAD_THREADS;
+        if ( num_chunks < 1 )
+                num_chunks = 1;
+
+        memset(chunks, 0, sizeof(chunks));
+        for ( c = 0; c < num_chunks && (c == 0 || pos < end); c++ ) {
+                chunks[c].start = pos;
+                pos = c == num_chunks - 1 ? end
+                      : next_record(data + size / num_chunks * (c + 1) > pos
+                                    ? data + size / num_chunks * (c + 1) - 1 : pos, end);
+                chunks[c].end = pos;
+        }
+        num_chunks = c;
+
+        /* parse the chunks, the first one on this thread */
+        for ( c = 1; c < num_chunks; c++ )
+                started[c] = pthread_create(&threads[c], NULL, parse_chunk, &chunks[c]) == 0;
+        for ( c = 1; c < num_chunks; c++ )
+                if ( !started[c] )
+                        parse_chunk(&chunks[c]);
+        parse_chunk(&chunks[0]);
+        for ( c = 1; c < num_chunks; c++ )
+                if ( started[c] )
+                        pthread_join(threads[c], NULL);
+
+        /* report the first error in the file */
+        for ( c = 0; c < num_chunks; c++ ) {
+                if ( chunks[c].error != NULL ) {
+                        fprintf(stderr, chunks[c].error, (int) total + chunks[c].error_employee);
+                        exit(EXIT_FAILURE);
+                }
+                total += chunks[c].num_records;
+        }
+
+        merge_chunks(chunks, num_chunks, total, 1);
+
+        for ( c = 0; c < num_chunks; c++ ) {
+                free(chunks[c].records);
+                free(chunks[c].sorted);
+                free(chunks[c].jobs);
+                free(chunks[c].job_numbers);
+                free(chunks[c].job_table);
+        }
+}
+
+/*****************************************************************************
+*                           name search functions                           *
+*                                                                           *
+* Names are "Surname, other names", so searching by the start of a surname  *
+* is a range of the name index: the first employee not before the prefix is *
+* found in O(log n) and the list is followed from there while names still   *
+* start with it.                                                            *
+*                                                                           *
+* Searching for text anywhere in a name uses an index of the three-         *
+* character sequences (trigrams) in the names. Each trigram is hashed into  *
+* one of TRIGRAM_BUCKETS sets, which hold every employee whose name has it, *
+* once, in no particular order. A search reads the smallest set among its   *
+* own trigrams, checks each name in it with strstr() and sorts the          *
+* employees it finds into name order. The index is built on the first such  *
+* search and then kept up to date as employees come and go. An employee has *
+* no room for its place in each of its sets, as it has for its job's        *
+* posting list, so each set is a hash table of employee addresses, and      *
+* adding or deleting an employee costs O(1) on average per trigram of its   *
+* name, however common the trigram is. Text of fewer than three characters  *
+* is looked for in every name.                                              *
+*****************************************************************************/
+
+#define TRIGRAM_BUCKETS 65536
+
+/* the employees with one trigram, as an open-addressed hash set of their
+   addresses, so that one is found in O(1) to be taken off; a slot is NULL
+   when empty */
+struct TrigramSet
+{
+        struct Employee **employees;
+        unsigned int count, capacity;    /* capacity is 0 or a power of two */
+};
+
+static struct TrigramSet *trigram_sets = NULL;   /* TRIGRAM_BUCKETS sets, once built */
+static unsigned int *trigram_seen = NULL;        /* name that last went in each set */
+static unsigned int trigram_stamp = 0;           /* number of the current name */
+
+static unsigned int trigram_bucket ( const char *text )
+{
+        const unsigned char *t = (const unsigned char *) text;
+
+        return ((t[0] * 257u + t[1]) * 263u + t[2]) & (TRIGRAM_BUCKETS - 1);
+}
+
+/* starts a new name for trigram_seen, so that each of its trigrams is
+   handled once */
+static void trigram_next_name(void)
+{
+        if ( ++trigram_stamp == 0 ) {
+                memset(trigram_seen, 0, TRIGRAM_BUCKETS * sizeof(unsigned int));
+                trigram_stamp = 1;
+        }
+}
+
+/* the slot of a set with "capacity" slots where a search for "employee"
+   starts */
+static unsigned int trigram_home ( const struct Employee *employee, unsigned int capacity )
+{
+        return (unsigned int) (((uint64_t) (uintptr_t) employee * 0x9E3779B97F4A7C15ULL) >> 32)
+               & (capacity - 1);
+}
+
+static void trigram_set_place ( struct TrigramSet *set, struct Employee *employee )
+{
+        unsigned int i = trigram_home(employee, set->capacity);
+
+        while ( set->employees[i] != NULL )
+                i = (i + 1) & (set->capacity - 1);
+        set->employees[i] = employee;
+}
+
+/* moves the employees of "set" into "capacity" slots */
+static void trigram_set_resize ( struct TrigramSet *set, unsigned int capacity )
+{
+        struct Employee **old = set->employees;
+        unsigned int old_capacity = set->capacity, i;
+
+        set->employees = calloc(capacity, sizeof(struct Employee *));
+        if ( set->employees == NULL ) {
+                fprintf(stderr, "Out of memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        set->capacity = capacity;
+        for ( i = 0; i < old_capacity; i++ )
+                if ( old[i] != NULL )
+                        trigram_set_place(set, old[i]);
+        free(old);
+}
+
+/* adds "employee" to "set", which is kept at most three quarters full */
+static void trigram_set_add ( struct TrigramSet *set, struct Employee *employee )
+{
+        if ( 4 * (set->count + 1) > 3 * set->capacity )
+                trigram_set_resize(set, set->capacity == 0 ? 8 : 2 * set->capacity);
+        trigram_set_place(set, employee);
+        set->count++;
+}
+
+/* trigram_set_remove():
+ *
+ * Takes "employee" out of "set", moving back any later employee of the
+ * same run that could sit in its slot, so that no search stops short,
+ * and halves the set once it is less than an eighth full.
+ */
+static void trigram_set_remove ( struct TrigramSet *set, const struct Employee *employee )
+{
+        unsigned int mask = set->capacity - 1, i, j, home;
+
+        for ( i = trigram_home(employee, set->capacity); set->employees[i] != employee; i = (i + 1) & mask )
+                if ( set->employees[i] == NULL )
+                        return;
+        for ( j = (i + 1) & mask; set->employees[j] != NULL; j = (j + 1) & mask ) {
+                home = trigram_home(set->employees[j], set->capacity);
+                /* it may move back unless its home is after the gap */
+                if ( ((j - home) & mask) >= ((j - i) & mask) ) {
+                        set->employees[i] = set->employees[j];
+                        i = j;
+                }
+        }
+        set->employees[i] = NULL;
+        set->count--;
+        if ( set->capacity > 8 && 8 * set->count < set->capacity )
+                trigram_set_resize(set, set->capacity / 2);
+}
+
+/* search_index_add():
+ *
+ * Puts "employee" in the set of each trigram in its name, if the index
+ * has been built.
+ */
+static void search_index_add ( struct Employee *employee )
+{
+        unsigned int bucket;
+        const char *p;
+
+        if ( trigram_sets == NULL )
+                return;
+        trigram_next_name();
+        for ( p = employee->name; p[0] != '\0' && p[1] != '\0' && p[2] != '\0'; p++ ) {
+                bucket = trigram_bucket(p);
+                if ( trigram_seen[bucket] != trigram_stamp ) {
+                        trigram_seen[bucket] = trigram_stamp;
+                        trigram_set_add(&trigram_sets[bucket], employee);
+                }
+        }
+}
+
+/* search_index_remove():
+ *
+ * Takes "employee" out of the set of each trigram in its name, if the
+ * index has been built.
+ */
+static void search_index_remove ( struct Employee *employee )
+{
+        unsigned int bucket;
+        const char *p;
+
+        if ( trigram_sets == NULL )
+                return;
+        trigram_next_name();
+        for ( p = employee->name; p[0] != '\0' && p[1] != '\0' && p[2] != '\0'; p++ ) {
+                bucket = trigram_bucket(p);
+                if ( trigram_seen[bucket] != trigram_stamp ) {
+                        trigram_seen[bucket] = trigram_stamp;
+                        trigram_set_remove(&trigram_sets[bucket], employee);
+                }
+        }
+}
+
+/* search_index_build():
+ *
+ * Builds the trigram index over every employee in the database. Placing
+ * the employees in the sets in name order would scatter them over all of
+ * the sets at once, so they are appended to a plain list for each trigram
+ * first, and each list then becomes its set in one go, while it and the
+ * set are in the cache.
+ */
+static void search_index_build(void)
+{
+        struct Posting *lists;
+        struct TrigramSet *set;
+        struct Cursor at;
+        unsigned int bucket, capacity, i;
+        const char *p;
+
+        trigram_sets = load_alloc(NULL, TRIGRAM_BUCKETS * sizeof(struct TrigramSet));
+        trigram_seen = load_alloc(NULL, TRIGRAM_BUCKETS * sizeof(unsigned int));
+        lists = load_alloc(NULL, TRIGRAM_BUCKETS * sizeof(struct Posting));
+        memset(trigram_sets, 0, TRIGRAM_BUCKETS * sizeof(struct TrigramSet));
+        memset(trigram_seen, 0, TRIGRAM_BUCKETS * sizeof(unsigned int));
+        memset(lists, 0, TRIGRAM_BUCKETS * sizeof(struct Posting));
+        for ( backend->seek(&at, NULL); at.employee != NULL; backend->advance(&at) ) {
+                trigram_next_name();
+                for ( p = at.employee->name; p[0] != '\0' && p[1] != '\0' && p[2] != '\0'; p++ ) {
+                        bucket = trigram_bucket(p);
+                        if ( trigram_seen[bucket] != trigram_stamp ) {
+                                trigram_seen[bucket] = trigram_stamp;
+                                posting_add(&lists[bucket], at.employee);
+                        }
+                }
+        }
+        for ( bucket = 0; bucket < TRIGRAM_BUCKETS; bucket++ ) {
+                set = &trigram_sets[bucket];
+                if ( lists[bucket].count == 0 )
+                        continue;
+                for ( capacity = 8; 4 * lists[bucket].count > 3 * capacity; capacity *= 2 )
+                        ;
+                trigram_set_resize(set, capacity);
+                for ( i = 0; i < lists[bucket].count; i++ )
+                        trigram_set_place(set, lists[bucket].employees[i]);
+                set->count = lists[bucket].count;
+                free(lists[bucket].employees);
+        }
+        free(lists);
+}
+
+static void release_search_index(void)
+{
+        unsigned int bucket;
+
+        if ( trigram_sets == NULL )
+                return;
+        for ( bucket = 0; bucket < TRIGRAM_BUCKETS; bucket++ )
+                free(trigram_sets[bucket].employees);
+        free(trigram_sets);
+        free(trigram_seen);
+}
+
+/* search_names_starting():
+ *
+ * Writes the employees whose names start with "prefix" to "fd" in name
+ * order, returning how many there were.
+ */
+static size_t search_names_starting ( const char *prefix, int fd )
+{
+        struct Employee **found = NULL;
+        struct Cursor at;
+        size_t length = strlen(prefix), n = 0, max_found = 0;
+
+        /* from the first employee whose name is not before the prefix */
+        for ( backend->seek(&at, prefix);
+              at.employee != NULL && strncmp(at.employee->name, prefix, length) == 0;
+              backend->advance(&at) ) {
+                if ( n == max_found ) {
+                        max_found = max_found == 0 ? 64 : max_found * 2;
+                        found = load_alloc(found, max_found * sizeof(struct Employee *));
+                }
+                found[n++] = at.employee;
+        }
+        write_employees(fd, found, n);
+        free(found);
+        return n;
+}
+
+/* search_names_containing():
+ *
+ * Writes the employees whose names contain "text" to "fd" in name order,
+ * returning how many there were.
+ */
+static size_t search_names_containing ( const char *text, int fd )
+{
+        struct Employee **found = NULL, *employee;
+        const struct TrigramSet *shortest = NULL, *set;
+        size_t length = strlen(text), n = 0, max_found = 0, i;
+        struct Cursor at;
+
+        if ( trigram_sets == NULL )
+                search_index_build();
+
+        /* the smallest set of the text's trigrams, if it has any */
+        for ( i = 0; length >= 3 && i + 2 < length; i++ ) {
+                set = &trigram_sets[trigram_bucket(text + i)];
+                if ( shortest == NULL || set->count < shortest->count )
+                        shortest = set;
+        }
+
+        if ( shortest != NULL ) {
+                found = load_alloc(NULL, shortest->count * sizeof(struct Employee *) + 1);
+                for ( i = 0; i < shortest->capacity; i++ ) {
+                        employee = shortest->employees[i];
+                        if ( employee != NULL && strstr(employee->name, text) != NULL )
+                                found[n++] = employee;
+                }
+                qsort(found, n, sizeof(struct Employee *), compare_indexed);
+        } else
+                for ( backend->seek(&at, NULL); at.employee != NULL; backend->advance(&at) ) {
+                        if ( strstr(at.employee->name, text) == NULL )
+                                continue;
+                        if ( n == max_found ) {
+                                max_found = max_found == 0 ? 64 : max_found * 2;
+                                found = load_alloc(found, max_found * sizeof(struct Employee *));
+                        }
+                        found[n++] = at.employee;
+                }
+        write_employees(fd, found, n);
+        free(found);
+        return n;
+}
+
+/*****************************************************************************
+*                              report functions                             *
+*                                                                           *
+* Reports that count or average over every employee only look at a field or *
+* two of each, but walking the list drags whole 64-byte Employee structures *
+* through the cache one pointer at a time. Reports read columns instead, so *
+* a scan over one field reads nothing else, and counts and totals over a    *
+* column are vectorized. With the columnar backend they are the backend's   *
+* own columns. With any other backend they are the sex and age of the       *
+* employees in each job in two contiguous arrays, in the same order as the  *
+* job's posting list, kept up to date as employees are added and deleted    *
+* through the job_slot the posting list already keeps.                      *
+*****************************************************************************/
+
+struct ReportColumns
+{
+        unsigned char *sex;      /* 'F' or 'M' */
+        uint16_t *age;           /* ages go up to MAX_AGE, so two bytes */
+        unsigned int capacity;
+};
+
+static struct ReportColumns *job_columns = NULL;   /* indexed by job number */
+static unsigned int num_job_columns = 0;
+
+/* report_columns_add():
+ *
+ * Puts the sex and age of "employee" in its job's columns, at the position
+ * it has just been given in the job's posting list, which is the end.
+ */
+static void report_columns_add ( struct Employee *employee )
+{
+        const struct Posting *posting = &job_postings[employee->job];
+        struct ReportColumns *columns;
+        unsigned int old = num_job_columns;
+
+        if ( employee->job >= num_job_columns ) {
+                num_job_columns = num_job_postings;
+                job_columns = load_alloc(job_columns, num_job_columns * sizeof(struct ReportColumns));
+                memset(job_columns + old, 0, (num_job_columns - old) * sizeof(struct ReportColumns));
+        }
+        columns = &job_columns[employee->job];
+        if ( columns->capacity < posting->capacity ) {
+                columns->capacity = posting->capacity;
+                columns->sex = load_alloc(columns->sex, columns->capacity);
+                columns->age = load_alloc(columns->age, columns->capacity * sizeof(uint16_t));
+        }
+        columns->sex[employee->job_slot] = employee->sex;
+        columns->age[employee->job_slot] = employee->age;
+}
+
+/* report_columns_remove():
+ *
+ * Moves the last entry in the columns of the job of "employee" into its
+ * place, as posting_remove() is about to do in the job's posting list.
+ */
+static void report_columns_remove ( struct Employee *employee )
+{
+        struct ReportColumns *columns = &job_columns[employee->job];
+        unsigned int last = job_postings[employee->job].count - 1;
+
+        columns->sex[employee->job_slot] = columns->sex[last];
+        columns->age[employee->job_slot] = columns->age[last];
+}
+
+static void release_report_columns(void)
+{
+        unsigned int j;
+
+        for ( j = 0; j < num_job_columns; j++ ) {
+                free(job_columns[j].sex);
+                free(job_columns[j].age);
+        }
+        free(job_columns);
+}
+
+/* the scans below go through their columns in blocks of this many, as
+   loops of a fixed length are vectorized at -O2 where open-ended ones are
+   left for -O3 */
+#define SCAN_BLOCK 64
+
+/* number of employees whose sex is "wanted" */
+static size_t count_sex ( const unsigned char *sex, size_t n, unsigned char wanted )
+{
+        size_t count = 0, i = 0;
+        unsigned int block, k;
+
+        for ( ; i + SCAN_BLOCK <= n; i += SCAN_BLOCK ) {
+                block = 0;
+                for ( k = 0; k < SCAN_BLOCK; k++ )
+                        block += sex[i + k] == wanted;
+                count += block;
+        }
+        for ( ; i < n; i++ )
+                count += sex[i] == wanted;
+        return count;
+}
+
+/* adds the number of employees of each age to "histogram" */
+static void age_histogram ( const uint16_t *age, size_t n, size_t *histogram )
+{
+        size_t i;
+
+        for ( i = 0; i < n; i++ )
+                histogram[age[i]]++;
+}
+
+/* total of "n" ages */
+static uint64_t sum_ages ( const uint16_t *age, size_t n )
+{
+        uint64_t total = 0;
+        size_t i = 0;
+        unsigned int block, k;
+
+        for ( ; i + SCAN_BLOCK <= n; i += SCAN_BLOCK ) {
+                block = 0;
+                for ( k = 0; k < SCAN_BLOCK; k++ )
+                        block += age[i + k];
+                total += block;
+        }
+        for ( ; i < n; i++ )
+                total += age[i];
+        return total;
+}
+
+/* adds each of "n" ages to the total of its job in "totals" */
+static void sum_ages_by_job ( const unsigned int *job, const uint16_t *age, size_t n, uint64_t *totals )
+{
+        size_t i;
+
+        for ( i = 0; i < n; i++ )
+                totals[job[i]] += age[i];
+}
+
+/* print_report():
+ *
+ * Prints the headcount by sex, the age histogram and the average age in
+ * each job to standard output. The columnar backend's columns are scanned
+ * whole, tombstones and all, and the tombstones, which have no sex and an
+ * age of 0, taken off the histogram afterwards; otherwise each job's own
+ * columns are. Either way a job's headcount is the length of its posting
+ * list.
+ */
+static void print_report(void)
+{
+        size_t histogram[MAX_AGE + 1], employees = 0, female = 0, n, i;
+        uint64_t *job_ages;
+        unsigned int j;
+
+        memset(histogram, 0, sizeof(histogram));
+        job_ages = load_alloc(NULL, num_job_postings * sizeof(uint64_t) + 1);
+        memset(job_ages, 0, num_job_postings * sizeof(uint64_t));
+        if ( backend == &columnar_backend ) {
+                employees = columnar_count - columnar_deleted;
+                female = count_sex(column_sex, columnar_count, 'F');
+                age_histogram(column_age, columnar_count, histogram);
+                histogram[0] -= columnar_deleted;
+                sum_ages_by_job(column_job, column_age, columnar_count, job_ages);
+        } else
+                for ( j = 0; j < num_job_columns; j++ ) {
+                        n = job_postings[j].count;
+                        employees += n;
+                        female += count_sex(job_columns[j].sex, n, 'F');
+                        age_histogram(job_columns[j].age, n, histogram);
+                        job_ages[j] = sum_ages(job_columns[j].age, n);
+                }
+        printf("Employees: %zu\n", employees);
+        printf("Female: %zu\n", female);
+        printf("Male: %zu\n\n", employees - female);
+
+        printf("Age  Employees\n");
+        for ( i = 0; i <= MAX_AGE; i++ )
+                if ( histogram[i] != 0 )
+                        printf("%-4zu %zu\n", i, histogram[i]);
+
+        printf("\nJob: Employees, Average age\n");
+        for ( j = 0; j < num_job_postings && j < num_jobs; j++ ) {
+                n = job_postings[j].count;
+                if ( n != 0 )
+                        printf("%s: %zu, %.1f\n", job_title(j), n, (double) job_ages[j] / n);
+        }
+        printf("\n");
+        free(job_ages);
+}
+
+/*****************************************************************************
+*                              batch functions                              *
+*                                                                           *
+* A batch file changes the database without the menu. It holds records in   *
+* the database file syntax, each followed by a blank line; a record is      *
+* either an employee to add, or a "Delete: <name>" line naming an employee  *
+* to delete, as the menu would. A delete may go on to give the Sex, Age and *
+* Job lines too, to say which of several employees with the same name is    *
+* meant; the operation log always writes them. The whole file is checked    *
+* before anything is changed. Deletes are applied first, so a batch can     *
+* replace an employee by deleting and re-adding them. Each delete is one    *
+* hash lookup, and the employees are unlinked from the list only; the index *
+* is rebuilt once afterwards. The additions are sorted together and merged  *
+* with the list in a single pass by link_sorted_employees().                *
+*                                                                           *
+* A large batch of additions is sorted on several threads. With the sharded *
+* backend the deletes are also looked up in every part of the hash table at *
+* once, a thread to a part, so that only logging and the age and job        *
+* indexes are left to a single thread.                                      *
+*****************************************************************************/
+
+struct BatchResult
+{
+        size_t added, deleted, missing;
+};
+
+/* whether "employee" is the one "record" describes; a record with no sex
+   was given by name alone */
+struct BatchDelete
+{
+        const struct LoadChunk *chunk;       /* where the record was read */
+        const struct ParsedEmployee *record; /* the delete record */
+};
+
+static int batch_record_matches ( const struct Employee *employee, const void *arg )
+{
+        const struct LoadChunk *chunk = ((const struct BatchDelete *) arg)->chunk;
+        const struct ParsedEmployee *record = ((const struct BatchDelete *) arg)->record;
+        const char *job;
+
+        if ( record->sex == '\0' )
+                return 1;
+        job = job_title(employee->job);
+        return employee->sex == record->sex && employee->age == record->age
+               && strlen(job) == chunk->jobs[record->job].length
+               && memcmp(job, chunk->jobs[record->job].start, chunk->jobs[record->job].length) == 0;
+}
+
+/* the delete records of a batch, sorted out by part of the hash table */
+struct BatchDeletes
+{
+        const struct LoadChunk *chunk;       /* where the records were read */
+        const struct ParsedEmployee *records;
+        unsigned long *hashes;               /* the hash of each record's name */
+        size_t *order;                       /* record numbers, by part */
+        size_t first[MAX_SHARDS + 1];        /* where each part's start in "order" */
+        struct Employee **found;             /* what each record deletes, or NULL */
+};
+
+/* batch_find_part():
+ *
+ * Finds the employees named by the delete records that fall in part "s"
+ * of the hash table, taking each out of the part as it is found, so that
+ * records naming the same employee twice find two of that name, or none.
+ * The records of a part are taken in file order.
+ */
+static void batch_find_part ( unsigned int s, void *arg )
+{
+        struct BatchDeletes *batch = arg;
+        const struct ParsedEmployee *record;
+        struct BatchDelete match;
+        struct Employee *cur;
+        char *name = NULL;
+        size_t name_size = 0, k, i;
+
+        match.chunk = batch->chunk;
+        for ( k = batch->first[s]; k < batch->first[s + 1]; k++ ) {
+                i = batch->order[k];
+                record = &batch->records[i];
+                if ( record->name_length + 1 > name_size ) {
+                        name_size = record->name_length + 1;
+                        name = load_alloc(name, name_size);
+                }
+                memcpy(name, record->name, record->name_length);
+                name[record->name_length] = '\0';
+                match.record = record;
+                cur = name_table_find_in(&name_tables[s], batch->hashes[i], name,
+                                         batch_record_matches, &match);
+                if ( cur != NULL )
+                        name_table_unlink(&name_tables[s], cur);
+                batch->found[i] = cur;
+        }
+        free(name);
+}
+
+/* batch_find():
+ *
+ * Sets found[i] to the employee that the delete record "records[i]" names,
+ * or to NULL if there is none, for each of the "n" records, taking them
+ * out of the hash table. Each part of the table is searched on a thread
+ * of its own.
+ */
+static void batch_find ( const struct LoadChunk *chunk, const struct ParsedEmployee *records,
+                         size_t n, struct Employee **found )
+{
+        struct BatchDeletes batch;
+        size_t next[MAX_SHARDS], i;
+        char *name = NULL;
+        size_t name_size = 0;
+        unsigned int s;
+
+        batch.chunk = chunk;
+        batch.records = records;
+        batch.found = found;
+        batch.hashes = load_alloc(NULL, n * sizeof(unsigned long));
+        batch.order = load_alloc(NULL, n * sizeof(size_t));
+        memset(batch.first, 0, sizeof(batch.first));
+        for ( i = 0; i < n; i++ ) {
+                if ( records[i].name_length + 1 > name_size ) {
+                        name_size = records[i].name_length + 1;
+                        name = load_alloc(name, name_size);
+                }
+                memcpy(name, records[i].name, records[i].name_length);
+                name[records[i].name_length] = '\0';
+                batch.hashes[i] = name_hash(name);
+                batch.first[name_part(batch.hashes[i]) + 1]++;
+        }
+        for ( s = 0; s < MAX_SHARDS; s++ ) {
+                batch.first[s + 1] += batch.first[s];
+                next[s] = batch.first[s];
+        }
+        for ( i = 0; i < n; i++ )
+                batch.order[next[name_part(batch.hashes[i])]++] = i;
+
+        shard_run(batch_find_part, &batch);
+
+        free(name);
+        free(batch.order);
+        free(batch.hashes);
+}
+
+/* apply_records():
+ *
+ * Checks and applies the records from "*pos" up to "end", counting them in
+ * "*op_num" and "result". If "in_order" is set, as it is when replaying the
+ * operation log, it stops before a delete that follows an addition, so
+ * that calling it until "*pos" reaches "end" applies the records in the
+ * order they were written. Returns the format of the error message if a
+ * record is not valid, in which case nothing has been changed, or NULL.
+ */
+static const char *apply_records ( const char **pos, const char *end, int in_order,
+                                   int *op_num, struct BatchResult *result )
+{
+        struct LoadChunk chunk;
+        struct ParsedEmployee *deletes = NULL, *record;
+        struct FieldView field;
+        size_t num_deletes = 0, max_deletes = 0, deleted = 0, i;
+        const char *error = NULL, *line_end;
+        struct Employee *cur, **gone = NULL;
+
+        /* check the records, collecting the deletes and additions */
+        memset(&chunk, 0, sizeof(chunk));
+        while ( *pos != end ) {
+                if ( end - *pos >= 8 && memcmp(*pos, "Delete: ", 8) == 0 ) {
+                        if ( in_order && chunk.num_records > 0 )
+                                break;
+                        if ( num_deletes == max_deletes ) {
+                                max_deletes = max_deletes == 0 ? 1024 : max_deletes * 2;
+                                deletes = load_alloc(deletes, max_deletes * sizeof(struct ParsedEmployee));
+                        }
+                        record = &deletes[num_deletes];
+                        line_end = memchr(*pos, '\n', end - *pos);
+                        if ( line_end != NULL && end - line_end > 5
+                             && memcmp(line_end + 1, "Sex: ", 5) == 0 )
+                                error = parse_record(&chunk, pos, end, "Delete: ", record);
+                        else if ( scan_field(pos, end, "Delete: ", &field) == -1 )
+                                error = "Invalid name input with employee %i, exiting\n";
+                        else if ( field.length == 0 )
+                                error = "Invalid name with employee %i, exiting\n";
+                        else {
+                                /* given by name alone */
+                                record->name = field.start;
+                                record->name_length = field.length;
+                                record->sex = '\0';
+                        }
+                        if ( error != NULL )
+                                break;
+                        num_deletes++;
+                } else {
+                        error = parse_record(&chunk, pos, end, "Name: ", chunk_record(&chunk));
+                        if ( error != NULL )
+                                break;
+                        chunk.num_records++;
+                }
+
+                ++*op_num;
+                /* takes in the blank line after the record */
+                if ( *pos == end || *(*pos)++ != '\n' ) {
+                        error = "Bad input file, exiting. Details: Missing '\\n' at end of employee %i field\n";
+                        break;
+                }
+        }
+        if ( error != NULL )
+                goto done;
+
+        /* take the deleted employees out of the hash table, then in file
+           order out of the indexes, and out of the backend all at once */
+        if ( num_deletes > 0 ) {
+                gone = load_alloc(NULL, num_deletes * sizeof(struct Employee *));
+                batch_find(&chunk, deletes, num_deletes, gone);
+        }
+        for ( i = 0; i < num_deletes; i++ ) {
+                cur = gone[i];
+                if ( cur == NULL ) {
+                        fprintf(stderr, "Employee: %.*s not found\n",
+                                (int) deletes[i].name_length, deletes[i].name);
+                        result->missing++;
+                        continue;
+                }
+                log_employee("Delete: ", cur);
+                name_table_count--;
+                query_index_remove(cur);
+                gone[deleted++] = cur;
+        }
+        if ( deleted > 0 ) {
+                backend->erase_many(gone, deleted);
+                for ( i = 0; i < deleted; i++ )
+                        free_employee(gone[i]);
+                database_modified = 1;
+        }
+        result->deleted += deleted;
+
+        /* merge the additions into the list in one pass */
+        for ( i = 0; i < chunk.num_records; i++ ) {
+                record = &chunk.records[i];
+                log_record("Name: ", record->name, record->name_length, record->sex, record->age,
+                           chunk.jobs[record->job].start, chunk.jobs[record->job].length);
+        }
+        if ( chunk.num_records > 0 ) {
+                sort_chunk(&chunk, 1);
+                merge_chunks(&chunk, 1, chunk.num_records, 0);
+                database_modified = 1;
+        }
+        result->added += chunk.num_records;
+
+done:
+        free(gone);
+        free(deletes);
+        free(chunk.records);
+        free(chunk.sorted);
+        free(chunk.jobs);
+        free(chunk.job_numbers);
+        free(chunk.job_table);
+        return error;
+}
+
+/* apply_batch():
+ *
+ * Applies the batch file "file_name", or standard input if it is "-",
+ * exiting with an error message numbering the bad record if it is not
+ * valid.
+ */
+static void apply_batch ( const char *file_name )
+{
+        struct DatabaseFile file;
+        struct BatchResult result = { 0, 0, 0 };
+        const char *pos, *error;
+        int op_num = 1;
+
+        if ( map_database_file(strcmp(file_name, "-") == 0 ? "/dev/stdin" : file_name, &file) == -1 ) {
+                fprintf(stderr, "Could not open batch file, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+
+        pos = file.data;
+        error = apply_records(&pos, file.data + file.size, 0, &op_num, &result);
+        if ( error != NULL ) {
+                fprintf(stderr, error, op_num);
+                exit(EXIT_FAILURE);
+        }
+        log_commit();
+        fprintf(stderr, "Batch applied: %lu added, %lu deleted, %lu not found\n",
+                (unsigned long) result.added, (unsigned long) result.deleted,
+                (unsigned long) result.missing);
+
+        unmap_database_file(&file);
+}
+
+/*****************************************************************************
+*                        import and export functions                        *
+*                                                                           *
+* Besides its own file format the database can be written out as CSV or as  *
+* JSON Lines, and read back in from either. Both are streamed: export goes  *
+* through the same output buffer as printing, and import reads a buffer of  *
+* the file at a time and parses each line in place, so neither needs more   *
+* memory than one line however large the file. A field is only copied when  *
+* it has to be unescaped; otherwise it is a view into the buffer, as it is  *
+* in the loader, and every employee goes through the same checks as one     *
+* read from the database file. The whole input is checked before anything   *
+* is added, then the employees are logged, sorted together and linked into  *
+* the database in one pass, as a batch file's additions are.                *
+*****************************************************************************/
+
+#define IMPORT_BUFFER_SIZE 65536
+
+struct ImportReader
+{
+        int fd;
+        char *data;                      /* the buffer of the file */
+        size_t start, end, size;         /* unread bytes are data[start..end) */
+        int eof;
+        char *scratch;                   /* holds unescaped fields of a line */
+        size_t scratch_size, scratch_used;
+};
+
+/* import_line():
+ *
+ * Returns the next line of "reader", without its "\n" or "\r\n", setting
+ * "*length" to its length, or NULL at the end of the input. The line stays
+ * valid until the next call. The buffer only grows for a line longer than
+ * itself. The last line need not end with a '\n'.
+ */
+static char *import_line ( struct ImportReader *reader, size_t *length )
+{
+        char *line, *newline;
+        size_t searched = 0;
+        ssize_t got;
+
+        for ( ;; ) {
+                line = reader->data + reader->start;
+                newline = memchr(line + searched, '\n', reader->end - reader->start - searched);
+                if ( newline != NULL ) {
+                        reader->start = newline + 1 - reader->data;
+                        break;
+                }
+                searched = reader->end - reader->start;
+                if ( reader->eof ) {
+                        if ( searched == 0 )
+                                return NULL;
+                        newline = reader->data + reader->end;
+                        reader->start = reader->end;
+                        break;
+                }
+
+                /* move the start of the line down, or make room for more */
+                if ( reader->start > 0 ) {
+                        memmove(reader->data, line, searched);
+                        reader->start = 0;
+                        reader->end = searched;
+                } else if ( reader->end == reader->size ) {
+                        reader->size *= 2;
+                        reader->data = load_alloc(reader->data, reader->size);
+                }
+                got = read(reader->fd, reader->data + reader->end, reader->size - reader->end);
+                if ( got == -1 && errno == EINTR )
+                        continue;
+                if ( got == -1 ) {
+                        fprintf(stderr, "Could not read import file, exiting\n");
+                        exit(EXIT_FAILURE);
+                }
+                if ( got == 0 )
+                        reader->eof = 1;
+                reader->end += got;
+        }
+
+        if ( newline > line && newline[-1] == '\r' )
+                newline--;
+        *length = newline - line;
+        return line;
+}
+
+/* csv_field():
+ *
+ * Reads the CSV field at "*pos" into "field", moving "*pos" past it and
+ * the comma after it. A quoted field is a view inside its quotes unless it
+ * holds a doubled quote, in which case it is copied without them. Returns
+ * 1 if another field follows, 0 if this was the last on the line, or -1 if
+ * the field is not valid CSV, which is how a quoted field running over
+ * more than one line is taken, as the database cannot hold it.
+ */
+static int csv_field ( const char **pos, const char *end, struct FieldView *field,
+                       struct ImportReader *reader )
+{
+        const char *p = *pos, *quote, *comma;
+        char *copy;
+        int doubled = 0;
+
+        if ( p == end || *p != '"' ) {
+                comma = memchr(p, ',', end - p);
+                field->start = p;
+                field->length = (comma != NULL ? comma : end) - p;
+                *pos = comma != NULL ? comma + 1 : end;
+                return comma != NULL;
+        }
+
+        for ( p++; ; p = quote + 2, doubled = 1 ) {
+                quote = memchr(p, '"', end - p);
+                if ( quote == NULL )
+                        return -1;
+                if ( quote + 1 == end || quote[1] != '"' )
+                        break;
+        }
+        field->start = *pos + 1;
+        field->length = quote - field->start;
+        if ( doubled ) {
+                copy = reader->scratch + reader->scratch_used;
+                for ( p = field->start; p < quote; p++ ) {
+                        reader->scratch[reader->scratch_used++] = *p;
+                        if ( *p == '"' )
+                                p++;
+                }
+                field->start = copy;
+                field->length = reader->scratch + reader->scratch_used - copy;
+        }
+
+        if ( quote + 1 == end ) {
+                *pos = end;
+                return 0;
+        }
+        if ( quote[1] != ',' )
+                return -1;
+        *pos = quote + 2;
+        return 1;
+}
+
+/* parse_csv_line():
+ *
+ * Splits a CSV line into the name, sex, age and job "fields". Returns the
+ * number of the first field that is missing or not valid CSV, the job if
+ * there are too many, or 4 if the line is good.
+ */
+static int parse_csv_line ( const char *line, size_t length, struct FieldView *fields,
+                            struct ImportReader *reader )
+{
+        const char *pos = line, *end = line + length;
+        int i, more;
+
+        for ( i = 0; i < 4; i++ ) {
+                more = csv_field(&pos, end, &fields[i], reader);
+                if ( more == -1 )
+                        return i;
+                if ( more == 0 && i < 3 )
+                        return i + 1;
+                if ( more == 1 && i == 3 )
+                        return 3;
+        }
+        return 4;
+}
+
+static const char *skip_json_space ( const char *p, const char *end )
+{
+        while ( p < end && (*p == ' ' || *p == '\t' || *p == '\r') )
+                p++;
+        return p;
+}
+
+/* reads four hex digits at "p" */
+static long json_hex ( const char *p, const char *end )
+{
+        long code = 0;
+        int i;
+
+        if ( end - p < 4 )
+                return -1;
+        for ( i = 0; i < 4; i++, p++ ) {
+                code <<= 4;
+                if ( *p >= '0' && *p <= '9' ) code |= *p - '0';
+                else if ( *p >= 'a' && *p <= 'f' ) code |= *p - 'a' + 10;
+                else if ( *p >= 'A' && *p <= 'F' ) code |= *p - 'A' + 10;
+                else return -1;
+        }
+        return code;
+}
+
+/* json_string():
+ *
+ * Reads the JSON string at "*pos", which starts with its quote, into
+ * "field", moving "*pos" past it. A string without escapes is a view into
+ * the line; one with them is decoded into the scratch space, with "\u"
+ * escapes as UTF-8. Returns -1 if the string is not valid or decodes to
+ * something the database cannot hold, or 0.
+ */
+static int json_string ( const char **pos, const char *end, struct FieldView *field,
+                         struct ImportReader *reader )
+{
+        const char *p = *pos + 1, *run;
+        char *copy = NULL;
+        long code, low;
+
+        for ( ;; ) {
+                for ( run = p; p < end && *p != '"' && *p != '\\' && (unsigned char) *p >= ' '; p++ )
+                        ;
+                if ( copy == NULL && p < end && *p == '"' ) {
+                        /* the fast path, with nothing to unescape */
+                        field->start = run;
+                        field->length = p - run;
+                        *pos = p + 1;
+                        return 0;
+                }
+                if ( copy == NULL )
+                        copy = reader->scratch + reader->scratch_used;
+                memcpy(reader->scratch + reader->scratch_used, run, p - run);
+                reader->scratch_used += p - run;
+                if ( p == end || (unsigned char) *p < ' ' )
+                        return -1;
+                if ( *p == '"' )
+                        break;
+
+                /* an escape */
+                if ( ++p == end )
+                        return -1;
+                switch ( *p++ ) {
+                case '"':  code = '"'; break;
+                case '\\': code = '\\'; break;
+                case '/':  code = '/'; break;
+                case 'b':  code = '\b'; break;
+                case 'f':  code = '\f'; break;
+                case 'r':  code = '\r'; break;
+                case 't':  code = '\t'; break;
+                case 'u':
+                        if ( (code = json_hex(p, end)) == -1 )
+                                return -1;
+                        p += 4;
+                        if ( code >= 0xDC00 && code <= 0xDFFF )
+                                return -1;
+                        if ( code >= 0xD800 && code <= 0xDBFF ) {
+                                if ( end - p < 2 || p[0] != '\\' || p[1] != 'u' )
+                                        return -1;
+                                low = json_hex(p + 2, end);
+                                if ( low < 0xDC00 || low > 0xDFFF )
+                                        return -1;
+                                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                                p += 6;
+                        }
+                        break;
+                default:   return -1;   /* including "\n" */
+                }
+                if ( code == '\n' )
+                        return -1;
+
+                /* as UTF-8, never longer than the escape */
+                if ( code < 0x80 )
+                        reader->scratch[reader->scratch_used++] = code;
+                else if ( code < 0x800 ) {
+                        reader->scratch[reader->scratch_used++] = 0xC0 | code >> 6;
+                        reader->scratch[reader->scratch_used++] = 0x80 | (code & 0x3F);
+                } else if ( code < 0x10000 ) {
+                        reader->scratch[reader->scratch_used++] = 0xE0 | code >> 12;
+                        reader->scratch[reader->scratch_used++] = 0x80 | (code >> 6 & 0x3F);
+                        reader->scratch[reader->scratch_used++] = 0x80 | (code & 0x3F);
+                } else {
+                        reader->scratch[reader->scratch_used++] = 0xF0 | code >> 18;
+                        reader->scratch[reader->scratch_used++] = 0x80 | (code >> 12 & 0x3F);
+                        reader->scratch[reader->scratch_used++] = 0x80 | (code >> 6 & 0x3F);
+                        reader->scratch[reader->scratch_used++] = 0x80 | (code & 0x3F);
+                }
+        }
+
+        field->start = copy;
+        field->length = reader->scratch + reader->scratch_used - copy;
+        *pos = p + 1;
+        return 0;
+}
+
+/* kinds of JSON value that json_value() reads */
+#define JSON_STRING 0
+#define JSON_NUMBER 1
+#define JSON_OTHER  2   /* true, false or null */
+
+/* json_value():
+ *
+ * Reads the JSON value at "*pos" into "field", moving "*pos" past it, and
+ * returns its kind, or -1 if it is not valid or is an object or an array,
+ * which no field of an employee can be. A number is left as its text.
+ */
+static int json_value ( const char **pos, const char *end, struct FieldView *field,
+                        struct ImportReader *reader )
+{
+        static const char *const words[] = { "true", "false", "null" };
+        const char *p = *pos;
+        size_t i, length;
+
+        if ( p == end )
+                return -1;
+        if ( *p == '"' )
+                return json_string(pos, end, field, reader) == -1 ? -1 : JSON_STRING;
+        if ( *p == '-' || isdigit((unsigned char) *p) ) {
+                while ( p < end && (isdigit((unsigned char) *p) || strchr("+-.eE", *p) != NULL) )
+                        p++;
+                field->start = *pos;
+                field->length = p - *pos;
+                *pos = p;
+                return JSON_NUMBER;
+        }
+        for ( i = 0; i < 3; i++ ) {
+                length = strlen(words[i]);
+                if ( (size_t) (end - p) >= length && memcmp(p, words[i], length) == 0 ) {
+                        *pos = p + length;
+                        return JSON_OTHER;
+                }
+        }
+        return -1;
+}
+
+/* parse_json_line():
+ *
+ * Reads a JSON object on one line into the name, sex, age and job
+ * "fields", ignoring other keys. The name, sex and job must be strings and
+ * the age a number or a string. Returns the number of the first field that
+ * is missing or of the wrong kind, or 4 if the line is good. If the line is
+ * not valid JSON, the first field not read yet counts as the bad one, or
+ * the job if they all were.
+ */
+static int parse_json_line ( const char *line, size_t length, struct FieldView *fields,
+                             struct ImportReader *reader )
+{
+        static const char *const keys[] = { "name", "sex", "age", "job" };
+        const char *pos = line, *end = line + length;
+        struct FieldView key, value;
+        int found[4] = { 0, 0, 0, 0 };
+        int i, kind;
+
+        pos = skip_json_space(pos, end);
+        if ( pos == end || *pos++ != '{' )
+                goto bad;
+        pos = skip_json_space(pos, end);
+        if ( pos < end && *pos == '}' )
+                pos++;
+        else for ( ;; ) {
+                if ( pos == end || *pos != '"' || json_string(&pos, end, &key, reader) == -1 )
+                        goto bad;
+                pos = skip_json_space(pos, end);
+                if ( pos == end || *pos++ != ':' )
+                        goto bad;
+                pos = skip_json_space(pos, end);
+                if ( (kind = json_value(&pos, end, &value, reader)) == -1 )
+                        goto bad;
+                for ( i = 0; i < 4; i++ )
+                        if ( key.length == strlen(keys[i])
+                             && memcmp(key.start, keys[i], key.length) == 0 ) {
+                                found[i] = kind == JSON_STRING || (i == 2 && kind == JSON_NUMBER);
+                                fields[i] = value;
+                        }
+                pos = skip_json_space(pos, end);
+                if ( pos < end && *pos == ',' ) {
+                        pos = skip_json_space(pos + 1, end);
+                        continue;
+                }
+                if ( pos == end || *pos++ != '}' )
+                        goto bad;
+                break;
+        }
+        if ( skip_json_space(pos, end) != end )
+                goto bad;
+
+        for ( i = 0; i < 4 && found[i]; i++ )
+                ;
+        return i;
+
+bad:
+        for ( i = 0; i < 3 && found[i]; i++ )
+                ;
+        return i;
+}
+
+/* check_fields():
+ *
+ * Checks the fields of an employee read from a line whose first bad field
+ * is "bad", in the same order and with the same messages as parse_record()
+ * checks the lines of a record. Returns the format of the error message,
+ * or NULL after filling in "new".
+ */
+static const char *check_fields ( const struct FieldView *fields, int bad,
+                                  struct ParsedEmployee *new )
+{
+        const char *error;
+
+        if ( bad == 0 )
+                return "Invalid name input with employee %i, exiting\n";
+        if ( (error = check_name(&fields[0], new)) != NULL )
+                return error;
+
+        if ( bad == 1 )
+                return "Invalid gender input with employee %i, exiting\n";
+        if ( (error = check_sex(&fields[1], new)) != NULL )
+                return error;
+
+        if ( bad == 2 )
+                return "Invalid age input with employee %i, exiting\n";
+        if ( (error = check_age(&fields[2], new)) != NULL )
+                return error;
+
+        if ( bad == 3 )
+                return "Invalid job input with employee %i, exiting\n";
+        return check_job(&fields[3]);
+}
+
+/* whether a line holds nothing but spaces */
+static int blank_line ( const char *line, size_t length )
+{
+        while ( length > 0 && isspace((unsigned char) line[length - 1]) )
+                length--;
+        return length == 0;
+}
+
+/* import_employees():
+ *
+ * Adds the employees in the CSV or JSON Lines file "file_name", or standard
+ * input if it is "-", in "format", or in the format its first line looks
+ * like if "format" is -1. Exits with the same error messages as loading
+ * the database file does, numbering the employees from the first line that
+ * is neither blank nor the CSV header, if any of them is not valid.
+ */
+static void import_employees ( const char *file_name, int format )
+{
+        struct ImportReader reader;
+        struct FieldView fields[4];
+        struct ParsedEmployee parsed;
+        struct Employee **records = NULL, *employee;
+        size_t num_records = 0, max_records = 0, length, i;
+        const char *error;
+        char *line;
+        int emp_num = 0, first = 1, bad;
+
+        memset(&reader, 0, sizeof(reader));
+        reader.fd = strcmp(file_name, "-") == 0 ? STDIN_FILENO : open(file_name, O_RDONLY);
+        if ( reader.fd == -1 ) {
+                fprintf(stderr, "Could not open import file, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        reader.size = IMPORT_BUFFER_SIZE;
+        reader.data = load_alloc(NULL, reader.size);
+
+        while ( (line = import_line(&reader, &length)) != NULL ) {
+                if ( blank_line(line, length) )
+                        continue;
+                if ( format == -1 )
+                        format = *skip_json_space(line, line + length) == '{' ? FORMAT_JSONL : FORMAT_CSV;
+                if ( first && format == FORMAT_CSV && length == 16
+                     && strncasecmp(line, "name,sex,age,job", 16) == 0 ) {
+                        first = 0;
+                        continue;
+                }
+                first = 0;
+                emp_num++;
+
+                /* unescaped fields are never longer than the line */
+                if ( reader.scratch_size < length ) {
+                        reader.scratch_size = length;
+                        reader.scratch = load_alloc(reader.scratch, reader.scratch_size + 1);
+                }
+                reader.scratch_used = 0;
+                if ( format == FORMAT_JSONL )
+                        bad = parse_json_line(line, length, fields, &reader);
+                else
+                        bad = parse_csv_line(line, length, fields, &reader);
+
+                error = check_fields(fields, bad, &parsed);
+                if ( error != NULL ) {
+                        fprintf(stderr, error, emp_num);
+                        exit(EXIT_FAILURE);
+                }
+
+                employee = alloc_employee();
+                employee->name = pool_string(parsed.name, parsed.name_length);
+                employee->job = intern_job(fields[3].start, fields[3].length);
+                employee->age = parsed.age;
+                employee->sex = parsed.sex;
+                employee->sequence = next_sequence++;
+                if ( num_records == max_records ) {
+                        max_records = max_records == 0 ? 1024 : max_records * 2;
+                        records = load_alloc(records, max_records * sizeof(struct Employee *));
+                }
+                records[num_records++] = employee;
+        }
+        if ( reader.fd != STDIN_FILENO )
+                close(reader.fd);
+        free(reader.data);
+        free(reader.scratch);
+
+        for ( i = 0; i < num_records; i++ )
+                log_employee("Name: ", records[i]);
+        if ( num_records > 0 ) {
+                qsort(records, num_records, sizeof(struct Employee *), compare_indexed);
+                link_sorted_employees(records, num_records);
+                database_modified = 1;
+        }
+        log_commit();
+        free(records);
+        fprintf(stderr, "Imported %lu employees\n", (unsigned long) num_records);
+}
+
+/* export_employees():
+ *
+ * Writes the database to "file_name", or standard output if it is "-", in
+ * "format", exiting with an error message if it cannot.
+ */
+static void export_employees ( const char *file_name, int format )
+{
+        int fd = strcmp(file_name, "-") == 0 ? STDOUT_FILENO
+                 : open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if ( fd == -1 ) {
+                fprintf(stderr, "Could not open export file, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        fflush(stdout);
+        if ( write_database_as(fd, format, 1) == -1 || (fd != STDOUT_FILENO && close(fd) == -1) ) {
+                fprintf(stderr, "Could not write export file, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+}
+
+/*****************************************************************************
+*                             snapshot functions                            *
+*                                                                           *
+* Parsing and checking a large text database on every start is slow, so    *
+* the program keeps a binary snapshot of it next to the file, named after   *
+* it with ".snap" on the end. A snapshot is a header, a table of fixed-size *
+* employee records already in name order, a table of job titles and a heap *
+* of '\0'-terminated strings that the tables refer to by offset. It is      *
+* mapped into memory at start-up and the employees' names point straight    *
+* into the mapping, so nothing is parsed or copied but the records          *
+* themselves. The header records the size and modification time of the     *
+* text file, and a snapshot that doesn't match them is ignored.             *
+*****************************************************************************/
+
+#define SNAPSHOT_MAGIC   "EMPSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_SUFFIX  ".snap"
+
+struct SnapshotHeader
+{
+        char magic[8];                   /* SNAPSHOT_MAGIC */
+        uint32_t version;                /* SNAPSHOT_VERSION */
+        uint32_t record_size;            /* sizeof(struct SnapshotRecord) */
+        uint64_t source_size;            /* size of the text file */
+        int64_t source_mtime;            /* its modification time in nanoseconds */
+        uint64_t num_employees;          /* number of records */
+        uint64_t num_jobs;               /* number of job titles */
+        uint64_t heap_size;              /* bytes in the string heap */
+};
+
+struct SnapshotRecord
+{
+        uint64_t name;                   /* offset of the name in the heap */
+        uint32_t job;                    /* index in the job title table */
+        uint16_t age;
+        char sex;
+        char unused;
+};
+
+static struct DatabaseFile snapshot = { NULL, 0, 0 }; /* mapped snapshot, if any */
+
+/* returns "file_name" with "suffix" added, which the caller frees */
+static char *suffixed_file_name ( const char *file_name, const char *suffix )
+{
+        char *name = malloc(strlen(file_name) + strlen(suffix) + 1);
+
+        if ( name == NULL ) {
+                fprintf(stderr, "Out of memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        strcpy(name, file_name);
+        strcat(name, suffix);
+        return name;
+}
+
+/* modification time of a file in nanoseconds */
+static int64_t file_mtime ( const struct stat *info )
+{
+        return (int64_t) info->st_mtim.tv_sec * 1000000000 + info->st_mtim.tv_nsec;
+}
+
+/* load_snapshot():
+ *
+ * Loads the database from the snapshot of "file_name", returning 0, or
+ * returns -1 without changing anything if there is no snapshot, it is out
+ * of date with the text file or it is not well formed.
+ */
+static int load_snapshot ( const char *file_name )
+{
+        const struct SnapshotHeader *header;
+        const struct SnapshotRecord *table;
+        const uint64_t *job_offsets;
+        const char *heap;
+        struct Employee **records;
+        unsigned int *jobs;
+        struct stat info;
+        char *name;
+        size_t i, n, left;
+        int result;
+
+        if ( stat(file_name, &info) == -1 || !S_ISREG(info.st_mode) )
+                return -1;
+        name = suffixed_file_name(file_name, SNAPSHOT_SUFFIX);
+        result = map_database_file(name, &snapshot);
+        free(name);
+        if ( result == -1 )
+                return -1;
+
+        /* check that the snapshot is current and that every offset in it
+           stays inside it; the sizes of the tables are taken off what is
+           left of the file in turn, so that no sum of them can wrap */
+        header = (const struct SnapshotHeader *) snapshot.data;
+        if ( !snapshot.mapped || snapshot.size < sizeof(struct SnapshotHeader)
+             || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+             || header->version != SNAPSHOT_VERSION
+             || header->record_size != sizeof(struct SnapshotRecord)
+             || header->source_size != (uint64_t) info.st_size
+             || header->source_mtime != file_mtime(&info) ) {
+                unmap_database_file(&snapshot);
+                return -1;
+        }
+        left = snapshot.size - sizeof(struct SnapshotHeader);
+        if ( header->num_employees > left / sizeof(struct SnapshotRecord) ) {
+                unmap_database_file(&snapshot);
+                return -1;
+        }
+        left -= header->num_employees * sizeof(struct SnapshotRecord);
+        if ( header->num_jobs > left / sizeof(uint64_t) ) {
+                unmap_database_file(&snapshot);
+                return -1;
+        }
+        left -= header->num_jobs * sizeof(uint64_t);
+        if ( header->heap_size != left || header->heap_size == 0 ) {
+                unmap_database_file(&snapshot);
+                return -1;
+        }
+        n = header->num_employees;
+        table = (const struct SnapshotRecord *) (header + 1);
+        job_offsets = (const uint64_t *) (table + n);
+        heap = (const char *) (job_offsets + header->num_jobs);
+        if ( heap[header->heap_size-1] != '\0' ) {
+                unmap_database_file(&snapshot);
+                return -1;
+        }
+        for ( i = 0; i < header->num_jobs; i++ )
+                if ( job_offsets[i] >= header->heap_size ) {
+                        unmap_database_file(&snapshot);
+                        return -1;
+                }
+        for ( i = 0; i < n; i++ )
+                if ( table[i].name >= header->heap_size || table[i].job >= header->num_jobs
+                     || table[i].age == 0 || table[i].age > MAX_AGE
+                     || (table[i].sex != 'F' && table[i].sex != 'M') ) {
+                        unmap_database_file(&snapshot);
+                        return -1;
+                }
+
+        /* the snapshot's job numbers become this run's job numbers */
+        records = malloc((n + 1) * sizeof(struct Employee *));
+        jobs = malloc((header->num_jobs + 1) * sizeof(unsigned int));
+        if ( records == NULL || jobs == NULL ) {
+                fprintf(stderr, "Out of memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        for ( i = 0; i < header->num_jobs; i++ )
+                jobs[i] = intern_job(heap + job_offsets[i], strlen(heap + job_offsets[i]));
+
+        for ( i = 0; i < n; i++ ) {
+                records[i] = alloc_employee();
+                records[i]->name = heap + table[i].name;
+                records[i]->job = jobs[table[i].job];
+                records[i]->age = table[i].age;
+                records[i]->sex = table[i].sex;
+                /* the table is in index order, so newest first */
+                records[i]->sequence = next_sequence + n - 1 - i;
+        }
+        next_sequence += n;
+
+        link_sorted_employees(records, n);
+        free(jobs);
+        free(records);
+        return 0;
+}
+
+/* save_snapshot():
+ *
+ * Writes a snapshot of the database for "file_name", to a temporary file
+ * that is then renamed over any old one. Failing to save is reported but
+ * is not an error, as the text file is still there.
+ */
+static void save_snapshot ( const char *file_name )
+{
+        struct SnapshotHeader header;
+        struct SnapshotRecord record;
+        struct Employee *cur;
+        struct Cursor at;
+        struct stat info;
+        char *name, *temp_name;
+        uint64_t offset;
+        unsigned int i;
+        FILE *output;
+        int ok;
+
+        if ( stat(file_name, &info) == -1 )
+                return;
+
+        name = suffixed_file_name(file_name, SNAPSHOT_SUFFIX);
+        temp_name = malloc(strlen(name) + 5);
+        if ( temp_name == NULL ) {
+                fprintf(stderr, "Out of memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        strcpy(temp_name, name);
+        strcat(temp_name, ".tmp");
+
+        output = fopen(temp_name, "wb");
+        if ( output == NULL ) {
+                fprintf(stderr, "Could not write snapshot %s\n", name);
+                free(temp_name);
+                free(name);
+                return;
+        }
+        setvbuf(output, NULL, _IOFBF, 1 << 20);
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        header.version = SNAPSHOT_VERSION;
+        header.record_size = sizeof(struct SnapshotRecord);
+        header.source_size = info.st_size;
+        header.source_mtime = file_mtime(&info);
+        header.num_employees = num_live_employees;
+        header.num_jobs = num_jobs;
+        header.heap_size = 0;
+        for ( backend->seek(&at, NULL); (cur = at.employee) != NULL; backend->advance(&at) )
+                header.heap_size += strlen(cur->name) + 1;
+        for ( i = 0; i < num_jobs; i++ )
+                header.heap_size += strlen(job_title(i)) + 1;
+        if ( header.heap_size == 0 )
+                header.heap_size = 1;    /* so the heap always ends in '\0' */
+        ok = fwrite(&header, sizeof(header), 1, output) == 1;
+
+        /* the records, in name order; names come first in the heap */
+        memset(&record, 0, sizeof(record));
+        offset = 0;
+        for ( backend->seek(&at, NULL); (cur = at.employee) != NULL; backend->advance(&at) ) {
+                record.name = offset;
+                record.job = cur->job;
+                record.age = cur->age;
+                record.sex = cur->sex;
+                ok = ok && fwrite(&record, sizeof(record), 1, output) == 1;
+                offset += strlen(cur->name) + 1;
+        }
+        for ( i = 0; i < num_jobs; i++ ) {
+                ok = ok && fwrite(&offset, sizeof(offset), 1, output) == 1;
+                offset += strlen(job_title(i)) + 1;
+        }
+
+        /* the string heap */
+        for ( backend->seek(&at, NULL); (cur = at.employee) != NULL; backend->advance(&at) )
+                ok = ok && fwrite(cur->name, strlen(cur->name) + 1, 1, output) == 1;
+        for ( i = 0; i < num_jobs; i++ )
+                ok = ok && fwrite(job_title(i), strlen(job_title(i)) + 1, 1, output) == 1;
+        if ( offset == 0 )
+                ok = ok && fputc('\0', output) != EOF;
+
+        if ( fclose(output) != 0 || !ok || rename(temp_name, name) == -1 ) {
+                fprintf(stderr, "Could not write snapshot %s\n", name);
+                remove(temp_name);
+        }
+        free(temp_name);
+        free(name);
+}
+
+/*****************************************************************************
+*                          operation log functions                          *
+*                                                                           *
+* Rewriting the database file for every change would cost O(n) each time,  *
+* so changes are appended to an operation log, "<file>.log", written in the *
+* batch file syntax: added employees as records and deleted ones as        *
+* records starting "Delete: ". Records are gathered in a buffer and only    *
+* forced to disk by log_commit(), once per menu choice or per batch, so a   *
+* batch of any size costs one fsync(). On start-up the log is replayed on   *
+* top of the database file or its snapshot.                                 *
+*                                                                           *
+* Once the log outgrows LOG_COMPACT_SIZE and half the database file it is   *
+* folded into the database file in the background: the log is renamed      *
+* "<file>.log.old" and a new one started, and a child process writes the    *
+* database as it stood to "<file>.tmp", renames that over the database     *
+* file and removes the old log. Each log starts with a "Base:" line giving *
+* the device and inode of the database file it applies to, the new log    *
+* naming "<file>.tmp", so that start-up can tell after a crash at any point *
+* which logs the database file already contains.                           *
+*****************************************************************************/
+
+#define LOG_SUFFIX       ".log"
+#define OLD_LOG_SUFFIX   ".log.old"
+#define NEW_LOG_SUFFIX   ".log.new"
+#define COMPACT_SUFFIX   ".tmp"
+#define LOG_COMPACT_SIZE (1 << 20)
+
+static struct OutputBuffer log_buffer = { .fd = -1 }; /* fd is -1 while there is no log */
+static char *database_name, *log_name, *old_log_name, *compact_name;
+static off_t log_size = 0;        /* bytes in the log at the last commit */
+static off_t database_size = 0;   /* bytes in the database file */
+static pid_t compaction_pid = 0;  /* child folding the old log in, if any */
+
+/* log_record():
+ *
+ * Adds an operation to the log, with "prefix" "Name: " for an addition or
+ * "Delete: " for a deletion. Nothing is on disk until log_commit().
+ */
+static void log_record ( const char *prefix, const char *name, size_t name_length,
+                         char sex, unsigned int age, const char *job, size_t job_length )
+{
+        if ( log_buffer.fd != -1 )
+                output_record(&log_buffer, prefix, name, name_length, sex, age, job, job_length);
+}
+
+static void log_employee ( const char *prefix, const struct Employee *employee )
+{
+        const char *job = job_title(employee->job);
+
+        log_record(prefix, employee->name, strlen(employee->name),
+                   employee->sex, employee->age, job, strlen(job));
+}
+
+/* makes renames and new files in the directory of "file_name" durable */
+static void sync_directory ( const char *file_name )
+{
+        const char *slash = strrchr(file_name, '/');
+        char *directory;
+        int fd;
+
+        if ( slash == NULL )
+                directory = suffixed_file_name(".", "");
+        else {
+                directory = suffixed_file_name(file_name, "");
+                directory[slash - file_name + 1] = '\0';
+        }
+        fd = open(directory, O_RDONLY);
+        if ( fd != -1 ) {
+                fsync(fd);
+                close(fd);
+        }
+        free(directory);
+}
+
+/* starts the log in "out" with a Base line naming the file "base" */
+static void log_header ( struct OutputBuffer *out, const struct stat *base )
+{
+        output_text(out, "Base: ", 6);
+        output_number(out, base->st_dev);
+        output_text(out, " ", 1);
+        output_number(out, base->st_ino);
+        output_text(out, "\n\n", 2);
+}
+
+/* whether the log "log" starts with a Base line naming the file "base" */
+static int log_applies_to ( const struct DatabaseFile *log, const struct stat *base )
+{
+        const char *pos = log->data;
+        struct FieldView field;
+        char text[64];
+        unsigned long dev, ino;
+
+        if ( scan_field(&pos, log->data + log->size, "Base: ", &field) == -1 )
+                return 0;
+        copy_field(text, &field, sizeof(text) - 1);
+        return sscanf(text, "%lu %lu", &dev, &ino) == 2
+               && dev == (unsigned long) base->st_dev && ino == (unsigned long) base->st_ino;
+}
+
+/* returns the start and sets "*end" to the end of the complete records in
+   "log", after its Base line; a crash can leave the last one cut short */
+static const char *log_records ( const struct DatabaseFile *log, const char **end )
+{
+        const char *start, *limit = log->data + log->size, *p;
+
+        if ( log->size == 0 ) {
+                *end = log->data;
+                return log->data;
+        }
+        /* skip the Base line and the blank line after it */
+        p = memchr(log->data, '\n', log->size);
+        start = p != NULL && p + 1 < limit && p[1] == '\n' ? p + 2 : limit;
+        /* the records end at the last blank line */
+        for ( p = limit; p - start >= 2 && !(p[-1] == '\n' && p[-2] == '\n'); p-- )
+                ;
+        *end = p - start >= 2 ? p : start;
+        return start;
+}
+
+/* replay_log():
+ *
+ * Applies the complete records of "log", the file "file_name", in order,
+ * exiting with an error message if one is not valid.
+ */
+static void replay_log ( const struct DatabaseFile *log, const char *file_name )
+{
+        struct BatchResult result = { 0, 0, 0 };
+        const char *pos, *end, *error;
+        int op_num = 1;
+
+        for ( pos = log_records(log, &end); pos != end; ) {
+                error = apply_records(&pos, end, 1, &op_num, &result);
+                if ( error != NULL ) {
+                        fprintf(stderr, "%s: ", file_name);
+                        fprintf(stderr, error, op_num);
+                        exit(EXIT_FAILURE);
+                }
+        }
+}
+
+/* fold_log():
+ *
+ * Writes the database to "fd", open on the compaction file, and puts it in
+ * place of the database file, which then holds everything in the old log.
+ * Returns -1 if that failed, or 0 on success. It runs in a child forked
+ * from what may be a threaded server, where a lock another thread held at
+ * the fork stays locked, so it starts no threads and takes no locks.
+ */
+static int fold_log ( int fd )
+{
+        if ( write_database_as(fd, FORMAT_TEXT, 0) == -1 || fsync(fd) == -1 ) {
+                close(fd);
+                return -1;
+        }
+        if ( close(fd) == -1 || rename(compact_name, database_name) == -1 )
+                return -1;
+        sync_directory(database_name);
+        unlink(old_log_name);
+        return 0;
+}
+
+/* collects the compaction child, waiting for it if "wait" is set */
+static void check_compaction ( int wait )
+{
+        struct stat info;
+        int status;
+
+        if ( compaction_pid == 0 || waitpid(compaction_pid, &status, wait ? 0 : WNOHANG) <= 0 )
+                return;
+        compaction_pid = 0;
+        if ( !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+                fprintf(stderr, "Could not fold the operation log into %s\n", database_name);
+        else if ( stat(database_name, &info) == 0 )
+                database_size = info.st_size;
+}
+
+/* start_compaction():
+ *
+ * Starts a new log and folds the old one into the database file on a child
+ * process, or on this one if there is no other.
+ */
+static void start_compaction(void)
+{
+        struct OutputBuffer *out = &log_buffer;
+        struct stat info;
+        int fd;
+        pid_t pid;
+
+        if ( compaction_pid != 0 || access(old_log_name, F_OK) == 0 )
+                return;
+        fd = open(compact_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if ( fd == -1 )
+                return;
+        if ( fstat(fd, &info) == -1 ) {
+                close(fd);
+                return;
+        }
+
+        /* the new log applies to the database file still to be written */
+        if ( rename(log_name, old_log_name) == -1 ) {
+                close(fd);
+                return;
+        }
+        close(out->fd);
+        out->fd = open(log_name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if ( out->fd == -1 ) {
+                fprintf(stderr, "Could not open the operation log %s\n", log_name);
+                close(fd);
+                return;
+        }
+        log_header(out, &info);
+        output_flush(out);
+        fsync(out->fd);
+        sync_directory(log_name);
+        log_size = 0;
+
+        pid = fork();
+        if ( pid == 0 )
+                _exit(fold_log(fd) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+        if ( pid == -1 ) {
+                if ( fold_log(fd) == -1 )
+                        fprintf(stderr, "Could not fold the operation log into %s\n", database_name);
+                else if ( stat(database_name, &info) == 0 )
+                        database_size = info.st_size;
+                return;
+        }
+        close(fd);
+        compaction_pid = pid;
+}
+
+/* log_commit():
+ *
+ * Writes out the operations added to the log since the last commit and
+ * waits for them to reach the disk, then folds the log into the database
+ * file if it has grown large enough.
+ */
+static void log_commit(void)
+{
+        struct stat info;
+
+        if ( log_buffer.fd == -1 )
+                return;
+        output_flush(&log_buffer);
+        if ( log_buffer.failed || fdatasync(log_buffer.fd) == -1 ) {
+                fprintf(stderr, "Could not write the operation log %s\n", log_name);
+                log_buffer.failed = 0;
+        }
+        if ( fstat(log_buffer.fd, &info) == 0 )
+                log_size = info.st_size;
+
+        check_compaction(0);
+        if ( log_size > LOG_COMPACT_SIZE && log_size > database_size / 2 )
+                start_compaction();
+}
+
+/* open_log():
+ *
+ * Replays the operation log of the database file "file_name", and of an
+ * unfinished compaction if there was one, then opens the log for the
+ * changes to come. After a crash the logs are first tidied into a single
+ * log that applies to the database file as it is.
+ */
+static void open_log ( const char *file_name )
+{
+        struct DatabaseFile log, old_log;
+        struct OutputBuffer *out = &log_buffer;
+        const char *start, *end;
+        char *new_log_name;
+        struct stat base;
+        int have_log, have_old, use_log, use_old, rewrite;
+
+        database_name = suffixed_file_name(file_name, "");
+        log_name = suffixed_file_name(file_name, LOG_SUFFIX);
+        old_log_name = suffixed_file_name(file_name, OLD_LOG_SUFFIX);
+        compact_name = suffixed_file_name(file_name, COMPACT_SUFFIX);
+        if ( stat(file_name, &base) == -1 )
+                return;
+        database_size = base.st_size;
+
+        /* the old log comes first if the database file doesn't contain it */
+        have_log = map_database_file(log_name, &log) == 0;
+        have_old = map_database_file(old_log_name, &old_log) == 0;
+        use_log = have_log && log_applies_to(&log, &base);
+        use_old = !use_log && have_old && log_applies_to(&old_log, &base);
+        if ( use_old )
+                use_log = have_log;
+        else if ( have_log && !use_log )
+                fprintf(stderr, "Ignoring %s, which is for another version of %s\n",
+                        log_name, file_name);
+        if ( use_old )
+                replay_log(&old_log, old_log_name);
+        if ( use_log )
+                replay_log(&log, log_name);
+
+        /* start a clean log unless the one there can simply be added to */
+        rewrite = !use_log || use_old;
+        if ( use_log ) {
+                log_records(&log, &end);
+                rewrite = rewrite || end != log.data + log.size;
+        }
+        if ( rewrite ) {
+                new_log_name = suffixed_file_name(file_name, NEW_LOG_SUFFIX);
+                out->fd = open(new_log_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if ( out->fd != -1 ) {
+                        log_header(out, &base);
+                        if ( use_old ) {
+                                start = log_records(&old_log, &end);
+                                output_text(out, start, end - start);
+                        }
+                        if ( use_log ) {
+                                start = log_records(&log, &end);
+                                output_text(out, start, end - start);
+                        }
+                        output_flush(out);
+                }
+                if ( out->fd == -1 || out->failed || fsync(out->fd) == -1
+                     || close(out->fd) == -1 || rename(new_log_name, log_name) == -1 ) {
+                        fprintf(stderr, "Could not write the operation log %s\n", log_name);
+                        exit(EXIT_FAILURE);
+                }
+                sync_directory(log_name);
+                free(new_log_name);
+        }
+        if ( have_old )   /* replayed, or already in the database file */
+                unlink(old_log_name);
+        if ( have_log )
+                unmap_database_file(&log);
+        if ( have_old )
+                unmap_database_file(&old_log);
+
+        out->fd = open(log_name, O_WRONLY | O_APPEND);
+        if ( out->fd == -1 ) {
+                fprintf(stderr, "Could not open the operation log %s\n", log_name);
+                return;
+        }
+        out->failed = 0;
+        out->used = 0;
+        log_commit();
+}
+
+/* close_log():
+ *
+ * Commits anything left in the log and waits for a compaction to finish.
+ */
+static void close_log(void)
+{
+        if ( log_buffer.fd == -1 )
+                return;
+        log_commit();
+        check_compaction(1);
+        close(log_buffer.fd);
+        log_buffer.fd = -1;
+        free(database_name);
+        free(log_name);
+        free(old_log_name);
+        free(compact_name);
+}
+
+/*****************************************************************************
+*                              server functions                             *
+*                                                                           *
+* With --serve <socket> the program answers clients on a local socket, a    *
+* thread each, in place of the menu. Lookups take no lock and never wait    *
+* for a change: the name order is published as an immutable version, a      *
+* list of blocks of employee pointers, and a change copies the block it     *
+* touches and the list of blocks into a new version, sharing the rest with  *
+* the old one. A reader notes the epoch it started in, and what a change    *
+* leaves behind (blocks, versions, job title lists and deleted employees)   *
+* is freed only once no reader that started before the change is left.      *
+* Changes are made one at a time, under a lock that readers never take,     *
+* through the storage backend, hash table, indexes and log as in the menu.  *
+*                                                                           *
+* Requests are lines in the form of a batch file, and answers come back in  *
+* the form of the database file:                                            *
+*                                                                           *
+*     Find: <name>            employees called <name>                       *
+*     From: <name>            employees with names from the one <name>      *
+*     To: <name>              up to the other, inclusive                    *
+*     Print                   every employee                                *
+*     Name: <name>            adds an employee, the Sex:, Age: and Job:     *
+*                             lines following                               *
+*     Delete: <name>          deletes an employee called <name>             *
+*     Quit                    ends the connection                           *
+*     Shutdown                stops the server                              *
+*                                                                           *
+* Lookups end with "Found: <count>"; other answers are a single line.       *
+* Blank lines are skipped, so a batch file can be sent as it is.            *
+*****************************************************************************/
+
+#define SERVED_BLOCK_SIZE  256   /* employees per block of a version */
+#define MAX_SERVER_CLIENTS 64
+
+struct ServedBlock
+{
+        unsigned int count;
+        struct Employee *employees[SERVED_BLOCK_SIZE];
+};
+
+/* the employees in name order as a reader sees them */
+struct ServedVersion
+{
+        size_t num_blocks;
+        const char **jobs;               /* job titles, indexed by job number */
+        struct ServedBlock *blocks[];
+};
+
+/* something a change left behind, freed once no reader can be using it */
+struct Retired
+{
+        struct Retired *next;
+        uint64_t epoch;                  /* first epoch that cannot see it */
+        void (*release) ( void *item );
+        void *item;
+};
+
+struct ServerClient
+{
+        _Atomic uint64_t epoch;          /* epoch of the lookup under way, 0 if none */
+        _Atomic int in_use;
+        int fd;
+        struct OutputBuffer *out;
+        struct OutputBuffer *staged;     /* part of a lookup's answer, in memory */
+};
+
+static struct ServedVersion *_Atomic served_version = NULL;
+static _Atomic uint64_t server_epoch = 1;
+static struct ServerClient server_clients[MAX_SERVER_CLIENTS];
+
+/* the rest belongs to whoever holds server_lock */
+static pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t server_idle = PTHREAD_COND_INITIALIZER;
+static int active_clients = 0;
+static struct Retired *retired = NULL;
+static const char **served_jobs = NULL;
+static unsigned int served_num_jobs = 0, served_max_jobs = 0;
+static int stop_pipe[2] = { -1, -1 };     /* written to to stop the server */
+
+static void *server_alloc ( size_t size )
+{
+        void *memory = malloc(size);
+
+        if ( memory == NULL ) {
+                fprintf(stderr, "Out of memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        return memory;
+}
+
+static struct ServedVersion *new_version ( size_t num_blocks )
+{
+        struct ServedVersion *version;
+
+        version = server_alloc(sizeof(struct ServedVersion) + num_blocks * sizeof(struct ServedBlock *));
+        version->num_blocks = num_blocks;
+        return version;
+}
+
+static void release_employee ( void *employee )
+{
+        free_employee(employee);
+}
+
+/* puts "item" aside to be released once the readers of epochs before
+   "epoch" have finished */
+static void server_retire ( void *item, void (*release) ( void *item ), uint64_t epoch )
+{
+        struct Retired *entry = server_alloc(sizeof(struct Retired));
+
+        entry->item = item;
+        entry->release = release;
+        entry->epoch = epoch;
+        entry->next = retired;
+        retired = entry;
+}
+
+/* releases whatever no reader can still be using */
+static void server_reclaim(void)
+{
+        struct Retired **link, *entry;
+        uint64_t oldest = UINT64_MAX, epoch;
+        int i;
+
+        for ( i = 0; i < MAX_SERVER_CLIENTS; i++ ) {
+                epoch = atomic_load(&server_clients[i].epoch);
+                if ( epoch != 0 && epoch < oldest )
+                        oldest = epoch;
+        }
+        for ( link = &retired; (entry = *link) != NULL; )
+                if ( entry->epoch <= oldest ) {
+                        *link = entry->next;
+                        entry->release(entry->item);
+                        free(entry);
+                } else
+                        link = &entry->next;
+}
+
+/* the served job titles, brought up to date with the job dictionary */
+static const char **served_job_titles(void)
+{
+        const char **jobs = served_jobs;
+
+        if ( num_jobs > served_max_jobs ) {
+                served_max_jobs = max_jobs;
+                jobs = server_alloc(served_max_jobs * sizeof(const char *));
+                if ( served_num_jobs > 0 )
+                        memcpy(jobs, served_jobs, served_num_jobs * sizeof(const char *));
+        }
+        /* slots past the old count are seen by no reader yet */
+        for ( ; served_num_jobs < num_jobs; served_num_jobs++ )
+                jobs[served_num_jobs] = job_title(served_num_jobs);
+        served_jobs = jobs;
+        return jobs;
+}
+
+/* served_publish():
+ *
+ * Makes "version" the one readers see, in place of the current one, which
+ * shares all but "n" of its blocks, those at "replaced". They, the old
+ * version and "gone", an employee deleted by the change if not NULL, are
+ * released once the readers that could see them have finished.
+ */
+static void served_publish ( struct ServedVersion *version, struct ServedBlock **replaced,
+                             size_t n, struct Employee *gone )
+{
+        struct ServedVersion *old = atomic_load(&served_version);
+        uint64_t epoch;
+        size_t i;
+
+        version->jobs = served_job_titles();
+        atomic_store(&served_version, version);
+        epoch = atomic_fetch_add(&server_epoch, 1) + 1;
+        for ( i = 0; i < n; i++ )
+                server_retire(replaced[i], free, epoch);
+        if ( gone != NULL )
+                server_retire(gone, release_employee, epoch);
+        if ( old->jobs != version->jobs )
+                server_retire(old->jobs, free, epoch);
+        server_retire(old, free, epoch);
+        server_reclaim();
+}
+
+/* the block of "version" that "employee" is in, or belongs in */
+static size_t served_block ( const struct ServedVersion *version, const struct Employee *employee )
+{
+        const struct ServedBlock *block;
+        size_t low = 0, high = version->num_blocks - 1, mid;
+
+        while ( low < high ) {
+                mid = low + (high - low) / 2;
+                block = version->blocks[mid];
+                if ( index_compare(block->employees[block->count - 1], employee) < 0 )
+                        low = mid + 1;
+                else
+                        high = mid;
+        }
+        return low;
+}
+
+/* the position of "employee" in "block", or where it would go */
+static unsigned int served_position ( const struct ServedBlock *block, const struct Employee *employee )
+{
+        unsigned int low = 0, high = block->count, mid;
+
+        while ( low < high ) {
+                mid = low + (high - low) / 2;
+                if ( index_compare(block->employees[mid], employee) < 0 )
+                        low = mid + 1;
+                else
+                        high = mid;
+        }
+        return low;
+}
+
+/* served_replace():
+ *
+ * Publishes a copy of the current version with its "n" blocks from
+ * "first" on replaced by the "m" blocks at "blocks".
+ */
+static void served_replace ( size_t first, size_t n, struct ServedBlock **blocks, size_t m,
+                             struct Employee *gone )
+{
+        struct ServedVersion *old = atomic_load(&served_version), *version;
+
+        version = new_version(old->num_blocks - n + m);
+        memcpy(version->blocks, old->blocks, first * sizeof(struct ServedBlock *));
+        memcpy(version->blocks + first, blocks, m * sizeof(struct ServedBlock *));
+        memcpy(version->blocks + first + m, old->blocks + first + n,
+               (old->num_blocks - first - n) * sizeof(struct ServedBlock *));
+        served_publish(version, old->blocks + first, n, gone);
+}
+
+/* publishes a version with "new" added, splitting its block if full */
+static void served_insert ( struct Employee *new )
+{
+        const struct ServedVersion *version = atomic_load(&served_version);
+        struct ServedBlock *old, *blocks[2];
+        struct Employee *employees[SERVED_BLOCK_SIZE + 1];
+        unsigned int i, n;
+        size_t b;
+
+        if ( version->num_blocks == 0 ) {
+                blocks[0] = server_alloc(sizeof(struct ServedBlock));
+                blocks[0]->count = 1;
+                blocks[0]->employees[0] = new;
+                served_replace(0, 0, blocks, 1, NULL);
+                return;
+        }
+        b = served_block(version, new);
+        old = version->blocks[b];
+        i = served_position(old, new);
+        memcpy(employees, old->employees, i * sizeof(struct Employee *));
+        employees[i] = new;
+        memcpy(employees + i + 1, old->employees + i, (old->count - i) * sizeof(struct Employee *));
+        n = old->count + 1;
+
+        if ( n <= SERVED_BLOCK_SIZE ) {
+                blocks[0] = server_alloc(sizeof(struct ServedBlock));
+                blocks[0]->count = n;
+                memcpy(blocks[0]->employees, employees, n * sizeof(struct Employee *));
+                served_replace(b, 1, blocks, 1, NULL);
+                return;
+        }
+        blocks[0] = server_alloc(sizeof(struct ServedBlock));
+        blocks[1] = server_alloc(sizeof(struct ServedBlock));
+        blocks[0]->count = n / 2;
+        blocks[1]->count = n - n / 2;
+        memcpy(blocks[0]->employees, employees, (n / 2) * sizeof(struct Employee *));
+        memcpy(blocks[1]->employees, employees + n / 2, (n - n / 2) * sizeof(struct Employee *));
+        served_replace(b, 1, blocks, 2, NULL);
+}
+
+/* publishes a version without "old", merging its block with a neighbour
+   once it is down to a quarter full, and retires "old" */
+static void served_erase ( struct Employee *old )
+{
+        const struct ServedVersion *version = atomic_load(&served_version);
+        const struct ServedBlock *block, *other;
+        struct ServedBlock *blocks[1];
+        size_t b, first, n = 1;
+        unsigned int i;
+
+        b = served_block(version, old);
+        block = version->blocks[b];
+        i = served_position(block, old);
+        if ( block->count == 1 ) {
+                served_replace(b, 1, blocks, 0, old);
+                return;
+        }
+
+        blocks[0] = server_alloc(sizeof(struct ServedBlock));
+        memcpy(blocks[0]->employees, block->employees, i * sizeof(struct Employee *));
+        memcpy(blocks[0]->employees + i, block->employees + i + 1,
+               (block->count - i - 1) * sizeof(struct Employee *));
+        blocks[0]->count = block->count - 1;
+        first = b;
+        if ( blocks[0]->count < SERVED_BLOCK_SIZE / 4 ) {
+                if ( b + 1 < version->num_blocks
+                     && (other = version->blocks[b + 1])->count + blocks[0]->count <= SERVED_BLOCK_SIZE / 2 ) {
+                        memcpy(blocks[0]->employees + blocks[0]->count, other->employees,
+                               other->count * sizeof(struct Employee *));
+                        blocks[0]->count += other->count;
+                        n = 2;
+                } else if ( b > 0
+                            && (other = version->blocks[b - 1])->count + blocks[0]->count <= SERVED_BLOCK_SIZE / 2 ) {
+                        memmove(blocks[0]->employees + other->count, blocks[0]->employees,
+                                blocks[0]->count * sizeof(struct Employee *));
+                        memcpy(blocks[0]->employees, other->employees, other->count * sizeof(struct Employee *));
+                        blocks[0]->count += other->count;
+                        first = b - 1;
+                        n = 2;
+                }
+        }
+        served_replace(first, n, blocks, 1, old);
+}
+
+/* publishes the first version, of every employee in the database */
+static void served_build(void)
+{
+        struct ServedVersion *version;
+        struct ServedBlock *block = NULL;
+        struct Cursor at;
+        size_t b = 0;
+
+        version = new_version((name_table_count + SERVED_BLOCK_SIZE - 1) / SERVED_BLOCK_SIZE);
+        for ( backend->seek(&at, NULL); at.employee != NULL; backend->advance(&at) ) {
+                if ( block == NULL || block->count == SERVED_BLOCK_SIZE ) {
+                        block = server_alloc(sizeof(struct ServedBlock));
+                        block->count = 0;
+                        version->blocks[b++] = block;
+                }
+                block->employees[block->count++] = at.employee;
+        }
+        version->jobs = served_job_titles();
+        atomic_store(&served_version, version);
+}
+
+/* frees the current version and everything retired, once no reader is left */
+static void served_release(void)
+{
+        struct ServedVersion *version = atomic_load(&served_version);
+        size_t b;
+
+        server_reclaim();
+        for ( b = 0; b < version->num_blocks; b++ )
+                free(version->blocks[b]);
+        free(version->jobs);
+        free(version);
+        atomic_store(&served_version, NULL);
+        served_jobs = NULL;
+        served_num_jobs = served_max_jobs = 0;
+}
+
+/* starts a lookup for "client", returning the version it is to read */
+static const struct ServedVersion *server_enter ( struct ServerClient *client )
+{
+        atomic_store(&client->epoch, atomic_load(&server_epoch));
+        return atomic_load(&served_version);
+}
+
+static void server_leave ( struct ServerClient *client )
+{
+        atomic_store(&client->epoch, 0);
+}
+
+/* served_seek():
+ *
+ * Sets "*b" and "*i" to the block and position in "version" of the first
+ * employee whose name is not before "name", or of the very first employee
+ * if "name" is NULL; "*b" is num_blocks if there is none.
+ */
+static void served_seek ( const struct ServedVersion *version, const char *name, size_t *b, unsigned int *i )
+{
+        const struct ServedBlock *block;
+        size_t low = 0, high = version->num_blocks, mid;
+        unsigned int first, last, middle;
+
+        while ( name != NULL && low < high ) {
+                mid = low + (high - low) / 2;
+                block = version->blocks[mid];
+                if ( strcmp(block->employees[block->count - 1]->name, name) < 0 )
+                        low = mid + 1;
+                else
+                        high = mid;
+        }
+        *b = low;
+        *i = 0;
+        if ( name == NULL || low == version->num_blocks )
+                return;
+        block = version->blocks[low];
+        for ( first = 0, last = block->count; first < last; ) {
+                middle = first + (last - first) / 2;
+                if ( strcmp(block->employees[middle]->name, name) < 0 )
+                        first = middle + 1;
+                else
+                        last = middle;
+        }
+        *i = first;
+}
+
+/* server_lookup():
+ *
+ * Sends "client" the employees from the first named "from" (or the very
+ * first if NULL) to the last named "to" (or the very last if NULL). Up to
+ * SERVED_BLOCK_SIZE employees at a time are formatted into memory inside
+ * an epoch, which is left before they are sent, so a client that is slow
+ * to read never holds up the freeing of what changes leave behind. Each
+ * part carries on after the last employee sent, in whichever version is
+ * current by then.
+ */
+static void server_lookup ( struct ServerClient *client, const char *from, const char *to )
+{
+        struct OutputBuffer *staged = client->staged;
+        const struct ServedVersion *version;
+        const struct ServedBlock *block;
+        const struct Employee *employee, *last;
+        const char *job;
+        char *resume = NULL;              /* name of the last employee sent */
+        size_t resume_size = 0, length, b, found = 0, n;
+        uint64_t resume_sequence = 0;
+        unsigned int i;
+
+        do {
+                version = server_enter(client);
+                served_seek(version, found == 0 ? from : resume, &b, &i);
+                last = NULL;
+                n = 0;
+                for ( ; b < version->num_blocks; b++, i = 0 )
+                        for ( block = version->blocks[b]; i < block->count; i++ ) {
+                                employee = block->employees[i];
+                                /* skip what was sent, or added before it since */
+                                if ( found > 0 && last == NULL && strcmp(employee->name, resume) == 0
+                                     && employee->sequence >= resume_sequence )
+                                        continue;
+                                if ( (to != NULL && strcmp(employee->name, to) > 0)
+                                     || n == SERVED_BLOCK_SIZE )
+                                        goto send;
+                                job = version->jobs[employee->job];
+                                output_record(staged, "Name: ", employee->name, strlen(employee->name),
+                                              employee->sex, employee->age, job, strlen(job));
+                                last = employee;
+                                n++;
+                        }
+send:
+                if ( n == SERVED_BLOCK_SIZE ) {
+                        length = strlen(last->name);
+                        if ( length >= resume_size ) {
+                                free(resume);
+                                resume_size = length + 1;
+                                resume = server_alloc(resume_size);
+                        }
+                        memcpy(resume, last->name, length + 1);
+                        resume_sequence = last->sequence;
+                }
+                server_leave(client);
+                found += n;
+                output_flush(staged);
+                output_text(client->out, staged->memory, staged->memory_used);
+                staged->memory_used = 0;
+        } while ( n == SERVED_BLOCK_SIZE );
+        free(resume);
+        output_text(client->out, "Found: ", 7);
+        output_number(client->out, found);
+        output_text(client->out, "\n", 1);
+}
+
+static void server_reply ( struct ServerClient *client, const char *text, const char *name )
+{
+        output_text(client->out, text, strlen(text));
+        output_text(client->out, name, strlen(name));
+        output_text(client->out, "\n", 1);
+}
+
+/* reads the next line of a request, which must start with "prefix", and
+   points "*value" at the rest of it */
+static int read_request_field ( FILE *fp, const char *prefix, char **line, size_t *line_size,
+                                char **value )
+{
+        size_t length = strlen(prefix);
+
+        if ( read_long_line(fp, line, line_size) == -1 || strncmp(*line, prefix, length) != 0 )
+                return -1;
+        *value = *line + length;
+        return 0;
+}
+
+/* server_add():
+ *
+ * Reads the Sex:, Age: and Job: lines of an employee called "name" from
+ * "fp" and adds the employee, checking the fields as the menu does.
+ */
+static void server_add ( struct ServerClient *client, FILE *fp, const char *name )
+{
+        static const char *fields[] = { "Sex: ", "Age: ", "Job: " };
+        char *values[3], *lines[3] = { NULL, NULL, NULL }, *end;
+        size_t sizes[3] = { 0, 0, 0 };
+        struct Employee *new;
+        uint64_t started;
+        long age = 0;
+        int i, valid = name[0] != '\0' && atoi(name) == 0;
+
+        for ( i = 0; i < 3; i++ )
+                if ( read_request_field(fp, fields[i], &lines[i], &sizes[i], &values[i]) == -1 )
+                        valid = 0;
+        if ( valid ) {
+                age = strtol(values[1], &end, 10);
+                valid = strlen(values[0]) == 1 && strchr("FfMm", values[0][0]) != NULL
+                        && end != values[1] && *end == '\0' && age > 0 && age <= MAX_AGE
+                        && values[2][0] != '\0' && atoi(values[2]) == 0;
+        }
+        if ( !valid ) {
+                server_reply(client, "Error: invalid employee ", name);
+                goto done;
+        }
+
+        pthread_mutex_lock(&server_lock);
+        started = STATS_START();
+        new = alloc_employee();
+        new->name = pool_string(name, strlen(name));
+        new->sex = toupper((unsigned char) values[0][0]);
+        new->age = age;
+        new->job = intern_job(values[2], strlen(values[2]));
+        new->sequence = next_sequence++;
+        backend->insert(new);
+        name_table_insert(new);
+        query_index_add(new);
+        database_modified = 1;
+        log_employee("Name: ", new);
+        log_commit();
+        served_insert(new);
+        STATS_STOP(STAT_ADD, started);
+        pthread_mutex_unlock(&server_lock);
+        server_reply(client, "Added: ", name);
+done:
+        for ( i = 0; i < 3; i++ )
+                free(lines[i]);
+}
+
+/* deletes an employee called "name", as the menu does, though the
+   employee is only freed once no reader can be looking at it */
+static void server_delete ( struct ServerClient *client, const char *name )
+{
+        struct Employee *cur;
+        uint64_t started;
+
+        pthread_mutex_lock(&server_lock);
+        started = STATS_START();
+        cur = name_table_find(name);
+        if ( cur != NULL ) {
+                backend->erase(cur);
+                name_table_remove(cur);
+                query_index_remove(cur);
+                database_modified = 1;
+                log_employee("Delete: ", cur);
+                log_commit();
+                served_erase(cur);
+        }
+        STATS_STOP(STAT_DELETE, started);
+        pthread_mutex_unlock(&server_lock);
+        if ( cur == NULL ) {
+                output_text(client->out, "Employee: ", 10);
+                output_text(client->out, name, strlen(name));
+                output_text(client->out, " not found\n", 11);
+        } else
+                server_reply(client, "Deleted: ", name);
+}
+
+/* stops the server from a signal handler or a client */
+static void server_stop(void)
+{
+        char byte = 0;
+
+        if ( write(stop_pipe[1], &byte, 1) == -1 )
+                return;
+}
+
+static void server_signal ( int signal_number )
+{
+        (void) signal_number;
+        server_stop();
+}
+
+/* server_client():
+ *
+ * The thread serving one client: answers its requests until it hangs up
+ * or quits, or the server stops.
+ */
+static void *server_client ( void *arg )
+{
+        struct ServerClient *client = arg;
+        char *line = NULL, *to_line = NULL, *to;
+        size_t line_size = 0, to_size = 0;
+        FILE *fp = fdopen(client->fd, "r");
+
+        client->out = server_alloc(sizeof(struct OutputBuffer));
+        client->out->fd = client->fd;
+        client->out->failed = 0;
+        client->out->used = 0;
+        client->staged = server_alloc(sizeof(struct OutputBuffer));
+        client->staged->fd = OUTPUT_MEMORY;
+        client->staged->failed = 0;
+        client->staged->used = 0;
+        client->staged->memory = NULL;
+        client->staged->memory_used = client->staged->memory_size = 0;
+        while ( fp != NULL && !client->out->failed && read_long_line(fp, &line, &line_size) == 0 ) {
+                if ( line[0] == '\0' )
+                        continue;
+                else if ( strncmp(line, "Find: ", 6) == 0 )
+                        server_lookup(client, line + 6, line + 6);
+                else if ( strncmp(line, "From: ", 6) == 0 ) {
+                        if ( read_request_field(fp, "To: ", &to_line, &to_size, &to) == 0 )
+                                server_lookup(client, line + 6, to);
+                        else
+                                server_reply(client, "Error: no To: after From: ", line + 6);
+                } else if ( strcmp(line, "Print") == 0 )
+                        server_lookup(client, NULL, NULL);
+                else if ( strncmp(line, "Name: ", 6) == 0 )
+                        server_add(client, fp, line + 6);
+                else if ( strncmp(line, "Delete: ", 8) == 0 )
+                        server_delete(client, line + 8);
+                else if ( strcmp(line, "Quit") == 0 )
+                        break;
+                else if ( strcmp(line, "Shutdown") == 0 ) {
+                        server_stop();
+                        break;
+                } else
+                        server_reply(client, "Error: unknown request ", line);
+                /* answer before waiting for the next request */
+                output_flush(client->out);
+        }
+        output_flush(client->out);
+        stats_fold();
+
+        pthread_mutex_lock(&server_lock);
+        if ( fp != NULL )
+                fclose(fp);
+        else
+                close(client->fd);
+        free(client->out);
+        free(client->staged->memory);
+        free(client->staged);
+        free(to_line);
+        free(line);
+        atomic_store(&client->in_use, 0);
+        if ( --active_clients == 0 )
+                pthread_cond_signal(&server_idle);
+        pthread_mutex_unlock(&server_lock);
+        return NULL;
+}
+
+/* serve():
+ *
+ * Answers clients on the local socket "path" until stopped by a client or
+ * by SIGINT or SIGTERM, then waits for the clients to finish.
+ */
+static void serve ( const char *path )
+{
+        struct sockaddr_un address;
+        struct sigaction action;
+        struct pollfd polls[2];
+        sigset_t blocked, old_mask;
+        pthread_t thread;
+        int listener, fd, i;
+
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if ( strlen(path) >= sizeof(address.sun_path) ) {
+                fprintf(stderr, "Socket path %s is too long\n", path);
+                exit(EXIT_FAILURE);
+        }
+        strcpy(address.sun_path, path);
+        unlink(path);
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if ( listener == -1 || bind(listener, (struct sockaddr *) &address, sizeof(address)) == -1
+             || listen(listener, 64) == -1 || pipe(stop_pipe) == -1 ) {
+                fprintf(stderr, "Could not listen on %s\n", path);
+                exit(EXIT_FAILURE);
+        }
+
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = server_signal;
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+        signal(SIGPIPE, SIG_IGN);        /* a client hanging up is a failed write */
+        /* the signals are left to this thread */
+        sigemptyset(&blocked);
+        sigaddset(&blocked, SIGINT);
+        sigaddset(&blocked, SIGTERM);
+
+        served_build();
+        fprintf(stderr, "Serving on %s\n", path);
+        polls[0].fd = listener;
+        polls[0].events = POLLIN;
+        polls[1].fd = stop_pipe[0];
+        polls[1].events = POLLIN;
+        for (;;) {
+                if ( poll(polls, 2, -1) == -1 )
+                        continue;
+                if ( polls[1].revents != 0 )
+                        break;
+                if ( (polls[0].revents & POLLIN) == 0 || (fd = accept(listener, NULL, NULL)) == -1 )
+                        continue;
+
+                for ( i = 0; i < MAX_SERVER_CLIENTS && atomic_load(&server_clients[i].in_use); i++ )
+                        ;
+                if ( i == MAX_SERVER_CLIENTS ) {
+                        send(fd, "Error: too many clients\n", 24, MSG_NOSIGNAL);
+                        close(fd);
+                        continue;
+                }
+                server_clients[i].fd = fd;
+                atomic_store(&server_clients[i].in_use, 1);
+                pthread_mutex_lock(&server_lock);
+                active_clients++;
+                pthread_mutex_unlock(&server_lock);
+                pthread_sigmask(SIG_BLOCK, &blocked, &old_mask);
+                if ( pthread_create(&thread, NULL, server_client, &server_clients[i]) == 0 )
+                        pthread_detach(thread);
+                else {
+                        close(fd);
+                        pthread_mutex_lock(&server_lock);
+                        active_clients--;
+                        atomic_store(&server_clients[i].in_use, 0);
+                        pthread_mutex_unlock(&server_lock);
+                }
+                pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+        }
+
+        /* hang up on the clients and wait for their threads to finish */
+        close(listener);
+        unlink(path);
+        pthread_mutex_lock(&server_lock);
+        for ( i = 0; i < MAX_SERVER_CLIENTS; i++ )
+                if ( atomic_load(&server_clients[i].in_use) )
+                        shutdown(server_clients[i].fd, SHUT_RDWR);
+        while ( active_clients > 0 )
+                pthread_cond_wait(&server_idle, &server_lock);
+        pthread_mutex_unlock(&server_lock);
+        close(stop_pipe[0]);
+        close(stop_pipe[1]);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        served_release();
+}
+
+/******************************************************************************************
+ *               read_employee_database ( char *file_name )                               *
+ * This function reads a specified employee database.                                     *
+ * It takes input from the specified command line file when argv is 1. If an up to date   *
+ * snapshot of the file exists it is loaded instead. Otherwise it maps the file into      *
+ * memory and hands it to load_text_database(), which checks it for valid data in chunks  *
+ * on several threads, sorts each chunk and merges them into the database in one pass.    *
+ ****************************************************************************************/
+static void read_employee_database ( char *file_name )
+{
+        struct DatabaseFile file;
+        if (load_snapshot(file_name) == 0) /*loads the prebuilt snapshot if it matches the file*/
+                return;
+        if (map_database_file(file_name, &file) == -1) { /*exits if file cannot be opened to prevent undefined behaviour*/
+                fprintf(stderr, "Could not open file, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+
+        load_text_database(file.data, file.size); /*exits with the first error in the file, if any*/
+
+        unmap_database_file(&file); /*releases the file*/
+}
+
+/* codes for menu */
+#define ADD_CODE    0
+#define DELETE_CODE 1
+#define PRINT_CODE  2
+#define EXIT_CODE   3
+#define MEMORY_CODE 4
+#define EXPORT_CODE 5
+#define AGES_CODE   6
+#define JOB_CODE    7
+#define PREFIX_CODE 8
+#define SEARCH_CODE 9
+#define REPORT_CODE 10
+#define STATS_CODE  11
+
+int main ( int argc, char *argv[] )
+{
+        char *database_file = NULL, *batch_file = NULL, *ages = NULL, *job = NULL;
+        char *serve_path = NULL, *import_file = NULL, *export_file = NULL;
+#ifndef NO_STATS
+        char *stats_file = NULL;
+#endif
+        int i, low = 1, high = MAX_AGE, format = -1;
+        uint64_t started;
+
+        stats_init();
+
+        /* check arguments */
+        for ( i = 1; i < argc; i++ )
+        {
+                if ( strcmp ( argv[i], "--batch" ) == 0 && i + 1 < argc
+                     && batch_file == NULL )
+                        batch_file = argv[++i];
+                else if ( strcmp ( argv[i], "--ages" ) == 0 && i + 1 < argc
+                          && ages == NULL )
+                        ages = argv[++i];
+                else if ( strcmp ( argv[i], "--job" ) == 0 && i + 1 < argc
+                          && job == NULL )
+                        job = argv[++i];
+                else if ( strcmp ( argv[i], "--serve" ) == 0 && i + 1 < argc
+                          && serve_path == NULL )
+                        serve_path = argv[++i];
+                else if ( strncmp ( argv[i], "--backend=", 10 ) == 0
+                          && choose_backend ( argv[i] + 10 ) == 0 )
+                        ;
+                else if ( strcmp ( argv[i], "--import" ) == 0 && i + 1 < argc
+                          && import_file == NULL )
+                        import_file = argv[++i];
+                else if ( strcmp ( argv[i], "--export" ) == 0 && i + 1 < argc
+                          && export_file == NULL )
+                        export_file = argv[++i];
+                else if ( strcmp ( argv[i], "--format=csv" ) == 0 )
+                        format = FORMAT_CSV;
+                else if ( strcmp ( argv[i], "--format=jsonl" ) == 0 )
+                        format = FORMAT_JSONL;
+#ifndef NO_STATS
+                else if ( strcmp ( argv[i], "--stats" ) == 0 && i + 1 < argc
+                          && stats_file == NULL )
+                        stats_file = argv[++i];
+#endif
+                else if ( database_file == NULL && argv[i][0] != '-' )
+                        database_file = argv[i];
+                else
+                        break;
+        }
+        if ( i < argc || (ages != NULL && parse_age_range ( ages, &low, &high ) == -1) )
+        {
+                fprintf ( stderr, "Usage: %s [<database-file>] [--batch <batch-file>]\n"
+                          "       [--ages <low>[-<high>]] [--job <job>] [--serve <socket>]\n"
+                          "       [--backend=list|array|columnar|btree|sharded]"
+                          STATS_USAGE "\n"
+                          "       [--import <file>] [--export <file>] [--format=csv|jsonl]\n",
+                          argv[0] );
+                exit(-1);
+        }
+
+        /* read database file if provided, or start with empty database */
+        if ( database_file != NULL )
+        {
+                started = STATS_START();
+                read_employee_database ( database_file );
+                STATS_STOP ( STAT_LOAD, started );
+                open_log ( database_file ); /* replays the changes since */
+        }
+
+        /* in batch mode, apply the batch and print the result, or just the
+           employees asked for by age and job */
+        if ( batch_file != NULL )
+                apply_batch ( batch_file );
+
+        /* add the employees in a CSV or JSON Lines file, then write the
+           database out, each in the format its file name says, or else the
+           one --format gives */
+        if ( import_file != NULL )
+                import_employees ( import_file, file_format ( import_file, format ) );
+        if ( export_file != NULL )
+                export_employees ( export_file, file_format ( export_file,
+                                   format != -1 ? format : FORMAT_TEXT ) );
+
+        /* in server mode, answer clients until stopped */
+        if ( serve_path != NULL )
+                serve ( serve_path );
+        if ( ages != NULL || job != NULL )
+        {
+                fflush ( stdout );
+                if ( query_employees ( low, high, job, STDOUT_FILENO ) == 0 )
+                        fprintf ( stderr, "No matching employees\n" );
+        }
+        else if ( batch_file != NULL && export_file == NULL )
+        {
+                fflush ( stdout );
+                if ( write_database ( STDOUT_FILENO ) == -1 )
+                        exit(EXIT_FAILURE);
+        }
+
+        /* otherwise offer the menu */
+        while ( batch_file == NULL && ages == NULL && job == NULL && serve_path == NULL
+                && import_file == NULL && export_file == NULL )
+        {
+                int choice, result;
+                char line[301];
+
+                /* print menu to standard error */
+                fprintf ( stderr, "\nOptions:\n" );
+                fprintf ( stderr, "%d: Add new employee to database\n", ADD_CODE );
+                fprintf ( stderr, "%d: Delete employee from database\n", DELETE_CODE );
+                fprintf ( stderr, "%d: Print database to screen\n", PRINT_CODE );
+#ifndef NO_STATS
+                fprintf ( stderr, "%d: Print operation statistics\n", STATS_CODE );
+#endif
+                fprintf ( stderr, "%d: Write database to file\n", EXPORT_CODE );
+                fprintf ( stderr, "%d: List employees in an age range\n", AGES_CODE );
+                fprintf ( stderr, "%d: List employees with a job\n", JOB_CODE );
+                fprintf ( stderr, "%d: Find names starting with\n", PREFIX_CODE );
+                fprintf ( stderr, "%d: Find names containing\n", SEARCH_CODE );
+                fprintf ( stderr, "%d: Print summary report\n", REPORT_CODE );
+                fprintf ( stderr, "%d: Print memory statistics\n", MEMORY_CODE );
+                fprintf ( stderr, "%d: Exit database program\n", EXIT_CODE );
+                fprintf ( stderr, "\nEnter option: " );
+
+                if ( read_line ( stdin, line, 300 ) != 0 ) continue;
+
+                result = sscanf ( line, "%d", &choice );
+                if ( result != 1 )
+                {
+                        fprintf ( stderr, "corrupted menu choice\n" );
+                        continue;
+                }
+
+                switch ( choice )
+                {
+                case ADD_CODE: /* add employee to database */
+                        menu_add_employee();
+                        break;
+
+                case DELETE_CODE: /* delete employee from database */
+                        menu_delete_employee();
+                        break;
+
+                case PRINT_CODE: /* print database contents to screen
+                                    (standard output) */
+                        menu_print_database();
+                        break;
+
+                case EXPORT_CODE: /* write database contents to a file */
+                        menu_export_database();
+                        break;
+
+                case AGES_CODE: /* print employees by age */
+                        menu_query_ages();
+                        break;
+
+                case JOB_CODE: /* print employees by job */
+                        menu_query_job();
+                        break;
+
+                case PREFIX_CODE: /* search names by their start */
+                        menu_search_names(0);
+                        break;
+
+                case SEARCH_CODE: /* search names for text */
+                        menu_search_names(1);
+                        break;
+
+                case REPORT_CODE: /* print headcounts and ages */
+                        print_report();
+                        break;
+
+                case MEMORY_CODE: /* print allocator statistics */
+                        menu_print_memory();
+                        break;
+
+#ifndef NO_STATS
+                case STATS_CODE: /* print operation counts and times */
+                        menu_print_stats();
+                        break;
+#endif
+
+                /* exit */
+                case EXIT_CODE:
+                        break;
+
+                default:
+                        fprintf ( stderr, "illegal choice %d\n", choice );
+                        break;
+                }
+
+                /* check for exit menu choice */
+                if ( choice == EXIT_CODE )
+                        break;
+        }
+
+        close_log();
+#ifndef NO_STATS
+        if ( stats_file != NULL )
+                stats_write_json ( stats_file );
+#endif
+
+        /* cache the file as a snapshot for next time, unless it was
+           loaded from one or has been changed since it was read */
+        if ( database_file != NULL && snapshot.data == NULL && !database_modified )
+                save_snapshot ( database_file );
 
+        /* release the whole database at once */
+        if ( snapshot.data != NULL )
+                unmap_database_file ( &snapshot );
+        release_query_index();
+        release_search_index();
+        release_report_columns();
+        backend->release();
+        release_employees();
+        release_strings();
+        release_name_table();
         return 0;
 }
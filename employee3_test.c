@@ -0,0 +1,973 @@
+/* employee3_test:
+ *
+ * Tests MUTUMBAJ-employee3.c, which it includes whole, with its main()
+ * renamed, so that its static functions can be called directly:
+ *
+ *   backends  random adds, deletes, bulk loads and bulk deletes through
+ *             each storage backend, after every one of which a walk and
+ *             a few seeks must agree with a sorted array, and the shape of
+ *             each B+-tree is checked, so that splits, merges and the
+ *             shrinking of a tree to nothing are all covered
+ *   log       a menu session's operation log, cut short at every byte, is
+ *             replayed at start-up, which must give the database as it
+ *             stood after the last whole record, as after a crash
+ *   import    CSV and JSON Lines lines, good and bad, are split into
+ *             fields, and tricky names survive a round trip through both
+ *   names     forty employees with the same name of 6000 characters, and
+ *             forty more whose names differ only after it, are loaded and
+ *             sorted
+ *   search    names from four letters are added to the name search index
+ *             and deleted at random, after which its sets must be in shape
+ *             and searches must agree with strstr()
+ *
+ * Each test runs in a child process of its own, since the program keeps
+ * its state in globals, and runs the program itself in further children.
+ * A check that fails is reported with its line number. The exit status is
+ * 1 if any test failed. "make check" builds and runs it; tests can also be
+ * picked by name on the command line.
+ */
+#define main employee3_main
+#include "MUTUMBAJ-employee3.c"
+#undef main
+
+#include <dirent.h>
+#include <limits.h>
+
+static int check_failures = 0;   /* in the current test */
+
+#define CHECK(condition) \
+        ((condition) ? (void) 0 : check_failed(__LINE__, #condition))
+
+static void check_failed ( int line, const char *condition )
+{
+        fprintf(stderr, "employee3_test.c:%d: check failed: %s\n", line, condition);
+        check_failures++;
+}
+
+/* test files:
+ *
+ * Each test that needs files keeps them in a directory of its own under
+ * /tmp, removed when it is done.
+ */
+
+static char test_directory[64];
+
+static void make_test_directory(void)
+{
+        strcpy(test_directory, "/tmp/employee3_test.XXXXXX");
+        if ( mkdtemp(test_directory) == NULL ) {
+                perror("mkdtemp");
+                exit(EXIT_FAILURE);
+        }
+}
+
+static void remove_test_directory(void)
+{
+        char path[PATH_MAX];
+        struct dirent *entry;
+        DIR *dir = opendir(test_directory);
+
+        while ( dir != NULL && (entry = readdir(dir)) != NULL )
+                if ( strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0 ) {
+                        snprintf(path, sizeof(path), "%s/%s", test_directory, entry->d_name);
+                        unlink(path);
+                }
+        if ( dir != NULL )
+                closedir(dir);
+        rmdir(test_directory);
+}
+
+/* the path of "name" in the test directory, in a buffer of its own */
+static char *test_path ( const char *name )
+{
+        char *path = malloc(strlen(test_directory) + strlen(name) + 2);
+
+        sprintf(path, "%s/%s", test_directory, name);
+        return path;
+}
+
+/* replaces the contents of "path" with "length" bytes of "text", keeping
+   the file, and so its inode, if it is there */
+static void write_test_file ( const char *path, const char *text, size_t length )
+{
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if ( fd == -1 || write(fd, text, length) != (ssize_t) length || close(fd) == -1 ) {
+                perror(path);
+                exit(EXIT_FAILURE);
+        }
+}
+
+/* the contents of "path" as a string, or NULL if it cannot be read */
+static char *read_test_file ( const char *path, size_t *length )
+{
+        struct stat st;
+        char *text;
+        int fd = open(path, O_RDONLY);
+
+        if ( fd == -1 )
+                return NULL;
+        if ( fstat(fd, &st) == -1 || (text = malloc(st.st_size + 1)) == NULL
+             || read(fd, text, st.st_size) != st.st_size ) {
+                perror(path);
+                exit(EXIT_FAILURE);
+        }
+        close(fd);
+        text[st.st_size] = '\0';
+        if ( length != NULL )
+                *length = st.st_size;
+        return text;
+}
+
+/* run_program():
+ *
+ * Runs the program's main() with "argv" in a child process, with standard
+ * input from "input", or /dev/null if it is NULL, and its output thrown
+ * away. Returns its exit status, or -1 if it did not exit.
+ */
+static int run_program ( char **argv, const char *input )
+{
+        int argc, status, fd;
+        pid_t pid;
+
+        for ( argc = 0; argv[argc] != NULL; argc++ )
+                ;
+        fflush(stdout);
+        fflush(stderr);
+        pid = fork();
+        if ( pid == 0 ) {
+                fd = open(input != NULL ? input : "/dev/null", O_RDONLY);
+                dup2(fd, STDIN_FILENO);
+                fd = open("/dev/null", O_WRONLY);
+                dup2(fd, STDOUT_FILENO);
+                dup2(fd, STDERR_FILENO);
+                exit(employee3_main(argc, argv));
+        }
+        if ( pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) )
+                return -1;
+        return WEXITSTATUS(status);
+}
+
+/*****************************************************************************
+*                              storage backends                             *
+*                                                                           *
+* The employees that should be in the backend are kept in "expected", in    *
+* index order. Their names are drawn from a few hundred, so that many share *
+* a name and a run of one name spans several B+-tree leaves, and the slots  *
+* of deleted employees are reused, as in the program, so that a stale       *
+* separator key in the tree names an employee that has since become someone *
+* else.                                                                     *
+*****************************************************************************/
+
+#define TEST_NAMES 300
+
+static struct Employee **expected;
+static size_t num_expected = 0, expected_size = 0;
+
+static struct Employee *new_test_employee(void)
+{
+        struct Employee *employee = alloc_employee();
+        char name[32];
+        int length = snprintf(name, sizeof(name), "Name%03d, A", rand() % TEST_NAMES);
+
+        memset(employee, 0, sizeof(*employee));
+        employee->name = pool_string(name, length);
+        employee->sex = rand() % 2 ? 'F' : 'M';
+        employee->age = 18 + rand() % 50;
+        employee->sequence = next_sequence++;
+        return employee;
+}
+
+/* the position of "employee" in "expected", or where it would go */
+static size_t expected_position ( const struct Employee *employee )
+{
+        size_t low = 0, high = num_expected, mid;
+
+        while ( low < high ) {
+                mid = low + (high - low) / 2;
+                if ( index_compare(expected[mid], employee) < 0 )
+                        low = mid + 1;
+                else
+                        high = mid;
+        }
+        return low;
+}
+
+static void expect_insert ( struct Employee *employee )
+{
+        size_t i = expected_position(employee);
+
+        if ( num_expected == expected_size ) {
+                expected_size = expected_size == 0 ? 1024 : 2 * expected_size;
+                expected = realloc(expected, expected_size * sizeof(struct Employee *));
+        }
+        memmove(&expected[i + 1], &expected[i], (num_expected - i) * sizeof(struct Employee *));
+        expected[i] = employee;
+        num_expected++;
+}
+
+static void expect_erase ( struct Employee *employee )
+{
+        size_t i = expected_position(employee);
+
+        CHECK(i < num_expected && expected[i] == employee);
+        memmove(&expected[i], &expected[i + 1], (num_expected - i - 1) * sizeof(struct Employee *));
+        num_expected--;
+}
+
+/* check_btree_node():
+ *
+ * Checks the subtree "height" levels tall at "subtree" of "tree": that
+ * every node but the root is at least half full, that every employee is
+ * in order and from "low" up to but not including "high", either of which
+ * may be NULL, and that the leaves are chained in order, "*leaf" being the
+ * one before. Returns the number of employees in the subtree.
+ */
+static size_t check_btree_node ( const struct BTree *tree, void *subtree, int height,
+                                 const struct BTreeKey *low, const struct BTreeKey *high,
+                                 struct BTreeLeaf **leaf )
+{
+        struct BTreeNode *node = subtree;
+        struct BTreeLeaf *this_leaf = subtree;
+        size_t count = 0;
+        unsigned int i;
+
+        if ( height == 1 ) {
+                CHECK(this_leaf->count > 0 && this_leaf->count <= BTREE_LEAF_SIZE);
+                CHECK(subtree == tree->root || this_leaf->count >= BTREE_LEAF_MIN);
+                CHECK(*leaf == NULL ? this_leaf == btree_first_leaf(tree) : (*leaf)->next == this_leaf);
+                for ( i = 0; i < this_leaf->count; i++ ) {
+                        CHECK(i == 0 || index_compare(this_leaf->employees[i - 1], this_leaf->employees[i]) < 0);
+                        CHECK(low == NULL || btree_compare(this_leaf->employees[i], low) >= 0);
+                        CHECK(high == NULL || btree_compare(this_leaf->employees[i], high) < 0);
+                }
+                *leaf = this_leaf;
+                return this_leaf->count;
+        }
+        CHECK(node->count >= 2 && node->count <= BTREE_FANOUT);
+        CHECK(subtree == tree->root || node->count >= BTREE_FANOUT_MIN);
+        for ( i = 0; i < node->count; i++ )
+                count += check_btree_node(tree, node->children[i], height - 1,
+                                          i == 0 ? low : &node->keys[i - 1],
+                                          i == node->count - 1 ? high : &node->keys[i], leaf);
+        return count;
+}
+
+static size_t check_btree ( const struct BTree *tree )
+{
+        struct BTreeLeaf *leaf = NULL;
+        size_t count = 0;
+
+        CHECK((tree->root == NULL) == (tree->height == 0));
+        if ( tree->root != NULL ) {
+                count = check_btree_node(tree, tree->root, tree->height, NULL, NULL, &leaf);
+                CHECK(leaf->next == NULL);
+        }
+        CHECK(count == tree->count);
+        return count;
+}
+
+/* checks that the array backend's keys, tombstones included, are in
+   order and that tombstones never fill more than half of it */
+static void check_array(void)
+{
+        const struct ArraySlot *slot;
+        size_t i, deleted = 0;
+        int result;
+
+        for ( i = 0; i < array_count; i++ ) {
+                slot = &employee_array[i];
+                if ( slot->employee == NULL )
+                        deleted++;
+                else
+                        CHECK(slot->name == slot->employee->name && slot->sequence == slot->employee->sequence);
+                if ( i > 0 ) {
+                        result = strcmp(slot[-1].name, slot->name);
+                        CHECK(result < 0 || (result == 0 && slot[-1].sequence > slot->sequence));
+                }
+        }
+        CHECK(deleted == array_deleted && 2 * deleted <= array_count);
+}
+
+/* checks the columnar backend's keys as check_array() does, and that each
+   row's other columns are its employee's, or 0 for a tombstone */
+static void check_columnar(void)
+{
+        const struct Employee *employee;
+        size_t i, deleted = 0;
+        int result;
+
+        for ( i = 0; i < columnar_count; i++ ) {
+                employee = column_employee[i];
+                if ( employee == NULL ) {
+                        CHECK(column_sex[i] == 0 && column_age[i] == 0);
+                        deleted++;
+                } else {
+                        CHECK(column_name[i] == employee->name && column_sequence[i] == employee->sequence);
+                        CHECK(column_sex[i] == employee->sex && column_age[i] == employee->age
+                              && column_job[i] == employee->job);
+                }
+                if ( i > 0 ) {
+                        result = strcmp(column_name[i - 1], column_name[i]);
+                        CHECK(result < 0 || (result == 0 && column_sequence[i - 1] > column_sequence[i]));
+                }
+        }
+        CHECK(deleted == columnar_deleted && 2 * deleted <= columnar_count);
+}
+
+/* check_backend():
+ *
+ * Checks that a walk of the backend gives "expected", that seeks to a few
+ * names land on the first employee not before them, and that the backend's
+ * array, columns or trees, if it has any, are in shape.
+ */
+static void check_backend(void)
+{
+        static const char *const suffixes[] = { "", ", A", ", B" };
+        struct Cursor at;
+        size_t i, count = 0;
+        unsigned int s, k;
+        char name[32];
+
+        backend->seek(&at, NULL);
+        for ( i = 0; i < num_expected && at.employee == expected[i]; i++ )
+                backend->advance(&at);
+        CHECK(i == num_expected && at.employee == NULL);
+
+        for ( k = 0; k < 4; k++ ) {
+                snprintf(name, sizeof(name), "Name%03d%s", rand() % (TEST_NAMES + 1), suffixes[rand() % 3]);
+                for ( i = 0; i < num_expected && strcmp(expected[i]->name, name) < 0; i++ )
+                        ;
+                backend->seek(&at, name);
+                for ( s = 0; s < 3 && i < num_expected && at.employee == expected[i]; s++, i++ )
+                        backend->advance(&at);
+                CHECK(s == 3 || (i == num_expected && at.employee == NULL));
+        }
+
+        if ( backend == &array_backend )
+                check_array();
+        if ( backend == &columnar_backend )
+                check_columnar();
+        if ( backend == &btree_backend )
+                CHECK(check_btree(&btree_tree) == num_expected);
+        if ( backend == &sharded_backend ) {
+                for ( s = 0; s < MAX_SHARDS; s++ )
+                        count += check_btree(&shards[s].tree);
+                CHECK(count == num_expected);
+        }
+}
+
+/* change_backend():
+ *
+ * Makes "steps" random changes to the backend, mostly adds for the first
+ * half and mostly deletes for the second, checking it after each. Bulk
+ * changes are of one to a thousand employees, so that the B+-tree makes
+ * some of them one at a time and rebuilds itself for others.
+ */
+static void change_backend ( unsigned int steps )
+{
+        struct Employee **batch = malloc(1000 * sizeof(struct Employee *));
+        size_t n, i, j;
+        struct Employee *employee;
+        unsigned int step;
+        int r;
+
+        for ( step = 0; step < steps && check_failures == 0; step++ ) {
+                r = rand() % 100;
+                n = 1 + rand() % (rand() % 8 == 0 ? 1000 : 20);
+                if ( num_expected == 0 || r < (step < steps / 2 ? 60 : 35) ) {
+                        if ( r % 4 != 0 ) {
+                                employee = new_test_employee();
+                                backend->insert(employee);
+                                name_table_count++;
+                                expect_insert(employee);
+                        } else {
+                                for ( i = 0; i < n; i++ )
+                                        batch[i] = new_test_employee();
+                                qsort(batch, n, sizeof(struct Employee *), compare_indexed);
+                                backend->load(batch, n);
+                                name_table_count += n;
+                                for ( i = 0; i < n; i++ )
+                                        expect_insert(batch[i]);
+                        }
+                } else if ( r % 4 != 0 ) {
+                        employee = expected[rand() % num_expected];
+                        backend->erase(employee);
+                        name_table_count--;
+                        expect_erase(employee);
+                        free_employee(employee);
+                } else {
+                        /* n different employees, by a partial shuffle */
+                        n = n < num_expected ? n : num_expected;
+                        for ( i = 0; i < n; i++ ) {
+                                j = i + rand() % (num_expected - i);
+                                employee = expected[j];
+                                expected[j] = expected[i];
+                                expected[i] = batch[i] = employee;
+                        }
+                        qsort(expected, num_expected, sizeof(struct Employee *), compare_indexed);
+                        name_table_count -= n;
+                        backend->erase_many(batch, n);
+                        for ( i = 0; i < n; i++ ) {
+                                expect_erase(batch[i]);
+                                free_employee(batch[i]);
+                        }
+                }
+                check_backend();
+        }
+        free(batch);
+}
+
+/* empties the backend, one employee at a time unless "bulk" */
+static void empty_backend ( int bulk )
+{
+        struct Employee *employee;
+        size_t i;
+
+        if ( bulk ) {
+                name_table_count = 0;
+                backend->erase_many(expected, num_expected);
+                for ( i = 0; i < num_expected; i++ )
+                        free_employee(expected[i]);
+                num_expected = 0;
+        }
+        while ( num_expected > 0 ) {
+                employee = expected[rand() % num_expected];
+                backend->erase(employee);
+                name_table_count--;
+                expect_erase(employee);
+                free_employee(employee);
+                if ( num_expected % 64 == 0 )
+                        check_backend();
+        }
+        check_backend();
+}
+
+static void test_backends(void)
+{
+        static const char *const names[] = { "list", "array", "columnar", "btree", "sharded" };
+        unsigned int i;
+
+        /* the sharded backend splits the hash table for good, so it goes last */
+        for ( i = 0; i < 5 && check_failures == 0; i++ ) {
+                srand(i + 1);
+                CHECK(choose_backend(names[i]) == 0);
+                change_backend(3000);
+                empty_backend(0);
+                change_backend(500);
+                empty_backend(1);
+                backend->release();
+                if ( check_failures != 0 )
+                        fprintf(stderr, "in the %s backend\n", names[i]);
+        }
+        free(expected);
+}
+
+/*****************************************************************************
+*                               operation log                               *
+*                                                                           *
+* A menu session of adds and deletes is run on a small database, and what   *
+* the database should hold after each change is noted. Then the log is cut  *
+* to each length from nothing to all of it in turn, as a crash could leave  *
+* it, and the database is exported: it must hold the changes of every       *
+* record that is complete, up to its blank line, and no more. The database  *
+* file itself is never replaced, so that the log still applies to it.       *
+*****************************************************************************/
+
+#define LOG_TEST_NAMES    6
+#define LOG_TEST_RECORDS  12
+#define LOG_TEST_CHANGES  40
+
+struct LogTestEmployee
+{
+        char name[32];
+        char sex;
+        int age;
+        const char *job;
+        int sequence;        /* higher for newer employees */
+};
+
+static struct LogTestEmployee log_employees[LOG_TEST_RECORDS + LOG_TEST_CHANGES];
+static size_t num_log_employees = 0;
+
+static int compare_log_employees ( const void *p, const void *q )
+{
+        const struct LogTestEmployee *a = p, *b = q;
+        int result = strcmp(a->name, b->name);
+
+        return result != 0 ? result : b->sequence - a->sequence;
+}
+
+/* appends the database as a file of it would be, newest first for a name */
+static void format_log_employees ( char *text )
+{
+        struct LogTestEmployee sorted[LOG_TEST_RECORDS + LOG_TEST_CHANGES];
+        size_t i;
+
+        memcpy(sorted, log_employees, num_log_employees * sizeof(sorted[0]));
+        qsort(sorted, num_log_employees, sizeof(sorted[0]), compare_log_employees);
+        for ( i = 0; i < num_log_employees; i++ )
+                text += sprintf(text, "Name: %s\nSex: %c\nAge: %d\nJob: %s\n\n",
+                                sorted[i].name, sorted[i].sex, sorted[i].age, sorted[i].job);
+}
+
+static void new_log_employee ( int sequence )
+{
+        static const char *const jobs[] = { "Clerk", "Engineer", "Ops" };
+        struct LogTestEmployee *employee = &log_employees[num_log_employees++];
+
+        snprintf(employee->name, sizeof(employee->name), "Name%d, B", rand() % LOG_TEST_NAMES);
+        employee->sex = rand() % 2 ? 'M' : 'F';
+        employee->age = 18 + rand() % 50;
+        employee->job = jobs[rand() % 3];
+        employee->sequence = sequence;
+}
+
+static void test_log(void)
+{
+        static char states[LOG_TEST_CHANGES + 1][(LOG_TEST_RECORDS + LOG_TEST_CHANGES) * 64];
+        size_t record_ends[LOG_TEST_CHANGES + 1], num_records = 0, log_length, k, i, newest;
+        char input[LOG_TEST_CHANGES * 64], *in = input, *log, *exported, *end;
+        char *database, *log_name, *snapshot_name, *input_name, *export_name;
+        char *argv[5];
+        int change;
+
+        srand(1);
+        make_test_directory();
+        database = test_path("db.txt");
+        log_name = test_path("db.txt.log");
+        snapshot_name = test_path("db.txt.snap");
+        input_name = test_path("input.txt");
+        export_name = test_path("export.txt");
+
+        /* the database file, and the adds and deletes to make to it */
+        for ( i = 0; i < LOG_TEST_RECORDS; i++ )
+                new_log_employee(LOG_TEST_RECORDS - i);
+        format_log_employees(states[0]);
+        write_test_file(database, states[0], strlen(states[0]));
+        for ( change = 1; change <= LOG_TEST_CHANGES; change++ ) {
+                if ( num_log_employees == 0 || rand() % 5 < 3 ) {
+                        new_log_employee(1000 + change);
+                        in += sprintf(in, "%d\n%s\n%c\n%d\n%s\n", ADD_CODE,
+                                      log_employees[num_log_employees - 1].name,
+                                      log_employees[num_log_employees - 1].sex,
+                                      log_employees[num_log_employees - 1].age,
+                                      log_employees[num_log_employees - 1].job);
+                } else {
+                        /* deleting by name takes the newest of that name */
+                        k = rand() % num_log_employees;
+                        for ( i = 0, newest = k; i < num_log_employees; i++ )
+                                if ( strcmp(log_employees[i].name, log_employees[k].name) == 0
+                                     && log_employees[i].sequence > log_employees[newest].sequence )
+                                        newest = i;
+                        in += sprintf(in, "%d\n%s\n", DELETE_CODE, log_employees[newest].name);
+                        log_employees[newest] = log_employees[--num_log_employees];
+                }
+                format_log_employees(states[change]);
+        }
+        sprintf(in, "%d\n", EXIT_CODE);
+        write_test_file(input_name, input, strlen(input));
+
+        argv[0] = "employee3";
+        argv[1] = database;
+        argv[2] = NULL;
+        CHECK(run_program(argv, input_name) == 0);
+        log = read_test_file(log_name, &log_length);
+        CHECK(log != NULL);
+        if ( log == NULL ) {
+                remove_test_directory();
+                return;
+        }
+
+        /* where each record ends, after the Base: line */
+        for ( end = strstr(log, "\n\n"); end != NULL; end = strstr(end, "\n\n") ) {
+                end += 2;
+                record_ends[num_records++] = end - log;
+                if ( num_records == LOG_TEST_CHANGES + 1 )
+                        break;
+        }
+        CHECK(num_records == LOG_TEST_CHANGES + 1 && record_ends[num_records - 1] == log_length);
+
+        argv[2] = "--export";
+        argv[3] = export_name;
+        argv[4] = NULL;
+        for ( k = 0; k <= log_length && check_failures == 0; k++ ) {
+                write_test_file(log_name, log, k);
+                unlink(snapshot_name);
+                unlink(export_name);
+                for ( change = 0; change + 1 < (int) num_records && record_ends[change + 1] <= k; change++ )
+                        ;
+                CHECK(run_program(argv, NULL) == 0);
+                exported = read_test_file(export_name, NULL);
+                CHECK(exported != NULL && strcmp(exported, states[change]) == 0);
+                if ( check_failures != 0 )
+                        fprintf(stderr, "with the log cut to %zu bytes of %zu\n", k, log_length);
+                free(exported);
+        }
+
+        free(log);
+        free(database);
+        free(log_name);
+        free(snapshot_name);
+        free(input_name);
+        free(export_name);
+        remove_test_directory();
+}
+
+/*****************************************************************************
+*                                   import                                  *
+*****************************************************************************/
+
+struct ImportCase
+{
+        int format;
+        const char *line;
+        int bad;                         /* the first bad field, 4 if none */
+        const char *fields[4];           /* those before it */
+};
+
+static const struct ImportCase import_cases[] = {
+        { FORMAT_CSV, "Smith,F,34,Engineer", 4, { "Smith", "F", "34", "Engineer" } },
+        { FORMAT_CSV, "\"Smith, Ann\",F,34,Engineer", 4, { "Smith, Ann", "F", "34", "Engineer" } },
+        { FORMAT_CSV, "\"Say \"\"hi\"\"\",M,40,\"Clerk, night\"", 4,
+          { "Say \"hi\"", "M", "40", "Clerk, night" } },
+        { FORMAT_CSV, "\"Smith \"\"Jr\"\" Johnathan Q\",M,30,\"Chief \"\"Data\"\" Officer\"", 4,
+          { "Smith \"Jr\" Johnathan Q", "M", "30", "Chief \"Data\" Officer" } },
+        { FORMAT_CSV, ",F,34,\"\"", 4, { "", "F", "34", "" } },
+        { FORMAT_CSV, "Bo", 1, { "Bo" } },
+        { FORMAT_CSV, "Bo,F,30", 3, { "Bo", "F", "30" } },
+        { FORMAT_CSV, "Bo,F,30,Clerk,extra", 3, { "Bo", "F", "30" } },
+        { FORMAT_CSV, "\"Bo,F,30,Clerk", 0, { NULL } },
+        { FORMAT_CSV, "\"Bo\"x,F,30,Clerk", 0, { NULL } },
+        { FORMAT_CSV, "Bo,F,\"30", 2, { "Bo", "F" } },
+
+        { FORMAT_JSONL, "{\"name\": \"Smith, Ann\", \"sex\": \"F\", \"age\": 34, \"job\": \"Engineer\"}", 4,
+          { "Smith, Ann", "F", "34", "Engineer" } },
+        { FORMAT_JSONL, " {\"job\":\"Clerk\",\"age\":\"40\",\"sex\":\"M\",\"name\":\"Say \\\"hi\\\"\"} ", 4,
+          { "Say \"hi\"", "M", "40", "Clerk" } },
+        { FORMAT_JSONL, "{\"name\":\"Caf\\u00e9 \\ud83d\\ude00\",\"sex\":\"F\",\"age\":1,\"job\":\"a\\\\b\\/c\\t\"}", 4,
+          { "Caf\xc3\xa9 \xf0\x9f\x98\x80", "F", "1", "a\\b/c\t" } },
+        { FORMAT_JSONL, "{\"name\":\"Bo\",\"sex\":\"F\",\"age\":30,\"job\":\"Clerk\",\"id\":7,\"ok\":true,\"x\":null,\"note\":\"hi\"}", 4,
+          { "Bo", "F", "30", "Clerk" } },
+        { FORMAT_JSONL, "{\"name\":\"Bo\",\"sex\":\"F\",\"age\":30}", 3, { "Bo", "F", "30" } },
+        { FORMAT_JSONL, "{\"name\":\"Bo\",\"sex\":\"F\",\"age\":true,\"job\":\"Clerk\"}", 2, { "Bo", "F" } },
+        { FORMAT_JSONL, "{\"name\":1,\"sex\":\"F\",\"age\":1,\"job\":\"x\"}", 0, { NULL } },
+        { FORMAT_JSONL, "{\"name\":\"Bo\",\"sex\":\"F\",\"age\":30,\"job\":\"Clerk\",\"tags\":[]}", 3,
+          { "Bo", "F", "30" } },
+        { FORMAT_JSONL, "{\"name\":\"Bo\\nX\",\"sex\":\"F\",\"age\":30,\"job\":\"Clerk\"}", 0, { NULL } },
+        { FORMAT_JSONL, "{\"name\":\"\\udc00\",\"sex\":\"F\",\"age\":1,\"job\":\"x\"}", 0, { NULL } },
+        { FORMAT_JSONL, "{\"name\":\"Bo\",\"sex\":\"F\"", 2, { "Bo", "F" } },
+        { FORMAT_JSONL, "{\"name\":\"Bo\",\"sex\":\"F\",\"age\":1,\"job\":\"x\"} x", 3, { "Bo", "F", "1" } },
+        { FORMAT_JSONL, "[]", 0, { NULL } },
+};
+
+/* a database whose names and jobs need quoting or escaping in one format
+   or the other, in order */
+static const char round_trip_database[] =
+        "Name: Back\\slash, B\nSex: M\nAge: 41\nJob: a/b\\c\n\n"
+        "Name: M\xc3\xbcller, J\xc3\xbcrgen\nSex: M\nAge: 52\nJob: Caf\xc3\xa9 owner\n\n"
+        "Name: O'Brien, Pat\nSex: F\nAge: 33\nJob: \"Lead\", ops\n\n"
+        "Name: Smith, Ann \"Jo\"\nSex: F\nAge: 29\nJob: Engineer, \"senior\"\n\n"
+        "Name: Tab\there, T\nSex: F\nAge: 64\nJob: {json}\n\n";
+
+static void test_import(void)
+{
+        const struct ImportCase *c;
+        struct ImportReader reader;
+        struct FieldView fields[4];
+        char *database, *csv, *jsonl, *text, *result, *input;
+        char *argv[6];
+        size_t i, length;
+        int bad, f;
+
+        memset(&reader, 0, sizeof(reader));
+        for ( i = 0; i < sizeof(import_cases) / sizeof(import_cases[0]); i++ ) {
+                c = &import_cases[i];
+                length = strlen(c->line);
+                input = malloc(length + 1);
+                memcpy(input, c->line, length + 1);
+                reader.scratch = malloc(length + 1);
+                reader.scratch_size = length;
+                reader.scratch_used = 0;
+                if ( c->format == FORMAT_CSV )
+                        bad = parse_csv_line(input, length, fields, &reader);
+                else
+                        bad = parse_json_line(input, length, fields, &reader);
+                CHECK(bad == c->bad);
+                for ( f = 0; f < bad && f < c->bad; f++ )
+                        CHECK(fields[f].length == strlen(c->fields[f])
+                              && memcmp(fields[f].start, c->fields[f], fields[f].length) == 0);
+                if ( check_failures != 0 ) {
+                        fprintf(stderr, "with the line %s\n", c->line);
+                        return;
+                }
+                free(reader.scratch);
+                free(input);
+        }
+
+        /* the text format through CSV and JSON Lines and back */
+        make_test_directory();
+        database = test_path("db.txt");
+        csv = test_path("db.csv");
+        jsonl = test_path("db.jsonl");
+        text = test_path("result.txt");
+        write_test_file(database, round_trip_database, strlen(round_trip_database));
+        argv[0] = "employee3";
+        argv[1] = database;
+        argv[2] = "--export";
+        argv[3] = csv;
+        argv[4] = NULL;
+        CHECK(run_program(argv, NULL) == 0);
+        argv[1] = "--import";
+        argv[2] = csv;
+        argv[3] = "--export";
+        argv[4] = jsonl;
+        argv[5] = NULL;
+        CHECK(run_program(argv, NULL) == 0);
+        argv[2] = jsonl;
+        argv[4] = text;
+        CHECK(run_program(argv, NULL) == 0);
+        result = read_test_file(text, NULL);
+        CHECK(result != NULL && strcmp(result, round_trip_database) == 0);
+        free(result);
+        free(database);
+        free(csv);
+        free(jsonl);
+        free(text);
+        remove_test_directory();
+}
+
+/*****************************************************************************
+*                                 long names                                *
+*                                                                           *
+* The name sort at start-up and for a batch file goes a character at a      *
+* time, and once took one level of recursion, with a frame of counts, for   *
+* each character that names share. Forty employees with the same name of    *
+* 6000 characters then overflowed the stack. They must load in the order of *
+* the file, and a batch of names that differ only after those characters    *
+* must sort after them.                                                     *
+*****************************************************************************/
+
+#define LONG_NAME_LENGTH 6000
+#define LONG_NAMES       40
+
+static void test_long_names(void)
+{
+        size_t size = LONG_NAMES * (LONG_NAME_LENGTH + 64);
+        char *name = malloc(LONG_NAME_LENGTH + 1), *text = malloc(2 * size), *added = malloc(size);
+        char *database, *batch, *export_name, *result, *t;
+        char *argv[7];
+        int i;
+
+        memset(name, 'A', LONG_NAME_LENGTH);
+        name[LONG_NAME_LENGTH] = '\0';
+        make_test_directory();
+        database = test_path("db.txt");
+        batch = test_path("batch.txt");
+        export_name = test_path("export.txt");
+
+        /* one name throughout, the newest first as a database file lists them */
+        for ( i = 0, t = text; i < LONG_NAMES; i++ )
+                t += sprintf(t, "Name: %s\nSex: F\nAge: %d\nJob: Clerk\n\n", name, i + 1);
+        write_test_file(database, text, t - text);
+        argv[0] = "employee3";
+        argv[1] = database;
+        argv[2] = "--export";
+        argv[3] = export_name;
+        argv[4] = NULL;
+        CHECK(run_program(argv, NULL) == 0);
+        result = read_test_file(export_name, NULL);
+        CHECK(result != NULL && strcmp(result, text) == 0);
+        free(result);
+
+        /* names that differ only after all those characters, added out of order */
+        for ( i = LONG_NAMES, t = added; i-- > 0; )
+                t += sprintf(t, "Name: %s, %02d\nSex: M\nAge: %d\nJob: Clerk\n\n", name, i, i + 1);
+        write_test_file(batch, added, t - added);
+        for ( i = 0, t = text + strlen(text); i < LONG_NAMES; i++ )
+                t += sprintf(t, "Name: %s, %02d\nSex: M\nAge: %d\nJob: Clerk\n\n", name, i, i + 1);
+        argv[2] = "--batch";
+        argv[3] = batch;
+        argv[4] = "--export";
+        argv[5] = export_name;
+        argv[6] = NULL;
+        CHECK(run_program(argv, NULL) == 0);
+        result = read_test_file(export_name, NULL);
+        CHECK(result != NULL && strcmp(result, text) == 0);
+        free(result);
+
+        free(name);
+        free(text);
+        free(added);
+        free(database);
+        free(batch);
+        free(export_name);
+        remove_test_directory();
+}
+
+/*****************************************************************************
+*                                name search                                *
+*                                                                           *
+* Employees whose names are drawn from four letters, so that each trigram   *
+* is in many names, are added to the database and the name search index    *
+* and deleted at random, so that sets grow and shrink and deletes move      *
+* employees back along their runs. After every few changes each set must    *
+* hold as many employees as its count says, be no more than three quarters  *
+* and, once it has grown, no less than an eighth full, and every employee   *
+* must be found from its home slot in the set of each of its trigrams. A    *
+* search for a trigram must find the names that strstr() does.             *
+*****************************************************************************/
+
+#define SEARCH_TEST_EMPLOYEES 2000
+
+static struct Employee *new_search_employee(void)
+{
+        struct Employee *employee = alloc_employee();
+        char name[16];
+        int length = 3 + rand() % 10, i;
+
+        for ( i = 0; i < length; i++ )
+                name[i] = "abcd"[rand() % 4];
+        memset(employee, 0, sizeof(*employee));
+        employee->name = pool_string(name, length);
+        employee->sex = 'M';
+        employee->age = 40;
+        employee->job = intern_job("Clerk", 5);
+        employee->sequence = next_sequence++;
+        backend->insert(employee);
+        name_table_count++;
+        return employee;
+}
+
+/* checks the trigram sets against the "n" employees of "live" */
+static void check_trigram_sets ( struct Employee **live, size_t n )
+{
+        const struct TrigramSet *set;
+        unsigned int bucket, i, count;
+        size_t entries = 0, k;
+        const char *p;
+
+        for ( bucket = 0; bucket < TRIGRAM_BUCKETS; bucket++ ) {
+                set = &trigram_sets[bucket];
+                for ( i = count = 0; i < set->capacity; i++ )
+                        count += set->employees[i] != NULL;
+                CHECK(count == set->count);
+                CHECK((set->capacity & (set->capacity - 1)) == 0 && 4 * count <= 3 * set->capacity);
+                CHECK(set->capacity <= 8 || 8 * count >= set->capacity);
+                entries += count;
+        }
+        for ( k = 0; k < n; k++ ) {
+                trigram_next_name();
+                for ( p = live[k]->name; p[0] != '\0' && p[1] != '\0' && p[2] != '\0'; p++ ) {
+                        bucket = trigram_bucket(p);
+                        if ( trigram_seen[bucket] == trigram_stamp )
+                                continue;
+                        trigram_seen[bucket] = trigram_stamp;
+                        set = &trigram_sets[bucket];
+                        for ( i = trigram_home(live[k], set->capacity);
+                              set->employees[i] != NULL && set->employees[i] != live[k];
+                              i = (i + 1) & (set->capacity - 1) )
+                                ;
+                        CHECK(set->employees[i] == live[k]);
+                        entries--;
+                }
+        }
+        CHECK(entries == 0);
+}
+
+static void test_search(void)
+{
+        struct Employee **live = malloc(SEARCH_TEST_EMPLOYEES * sizeof(struct Employee *));
+        size_t n = 0, found, k;
+        unsigned int step;
+        char text[4];
+        int fd = open("/dev/null", O_WRONLY);
+
+        srand(1);
+        CHECK(choose_backend("list") == 0);
+        while ( n < SEARCH_TEST_EMPLOYEES / 2 )
+                live[n++] = new_search_employee();
+        search_names_containing("abc", fd);
+        check_trigram_sets(live, n);
+
+        for ( step = 0; step < 20000 && check_failures == 0; step++ ) {
+                /* adds win for the first and last quarters, deletes between */
+                if ( n == 0 || (n < SEARCH_TEST_EMPLOYEES && rand() % 100 < (step / 5000 % 3 == 0 ? 70 : 30)) ) {
+                        live[n] = new_search_employee();
+                        search_index_add(live[n++]);
+                } else {
+                        k = rand() % n;
+                        search_index_remove(live[k]);
+                        backend->erase(live[k]);
+                        name_table_count--;
+                        free_employee(live[k]);
+                        live[k] = live[--n];
+                }
+                if ( step % 100 != 0 )
+                        continue;
+                check_trigram_sets(live, n);
+                text[0] = "abcd"[rand() % 4];
+                text[1] = "abcd"[rand() % 4];
+                text[2] = "abcd"[rand() % 4];
+                text[3] = '\0';
+                for ( k = found = 0; k < n; k++ )
+                        found += strstr(live[k]->name, text) != NULL;
+                CHECK(search_names_containing(text, fd) == found);
+        }
+
+        close(fd);
+        release_search_index();
+        backend->release();
+        free(live);
+}
+
+/*****************************************************************************
+*                                 test driver                               *
+*****************************************************************************/
+
+struct Test
+{
+        const char *name;
+        void (*run)(void);
+};
+
+static const struct Test tests[] = {
+        { "backends", test_backends },
+        { "log", test_log },
+        { "import", test_import },
+        { "names", test_long_names },
+        { "search", test_search },
+};
+
+/* runs "test" in a child process, returning 1 if it failed */
+static int run_test ( const struct Test *test )
+{
+        int status, failed;
+        pid_t pid;
+
+        fflush(stdout);
+        fflush(stderr);
+        pid = fork();
+        if ( pid == 0 ) {
+                test->run();
+                exit(check_failures != 0);
+        }
+        failed = pid == -1 || waitpid(pid, &status, 0) == -1
+                 || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+        printf("%-10s %s\n", test->name, failed ? "FAILED" : "ok");
+        return failed;
+}
+
+int main ( int argc, char *argv[] )
+{
+        size_t i;
+        int j, failed = 0, chosen;
+
+        for ( i = 0; i < sizeof(tests) / sizeof(tests[0]); i++ ) {
+                for ( j = 1, chosen = argc == 1; j < argc; j++ )
+                        chosen = chosen || strcmp(argv[j], tests[i].name) == 0;
+                if ( chosen )
+                        failed |= run_test(&tests[i]);
+        }
+        return failed;
+}
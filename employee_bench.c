@@ -0,0 +1,535 @@
+/* employee_bench:
+ *
+ * Times the employee database programs on generated data. Each program is
+ * run on a copy of a database of the given size and driven through its
+ * menu, exactly as a user would, with its output sent to /dev/null:
+ *
+ *   load    start-up until the first menu prompt
+ *   lookup  "Find names starting with" an existing employee's full name
+ *   print   "Print database to screen"
+ *   export  "Write database to file", streaming it to a file on disk
+ *   add     "Add new employee" with a new name
+ *   delete  "Delete employee" with an existing name
+ *
+ * The option numbers are read from the menu itself, so any of the programs
+ * can be timed with the same harness. A program given with arguments, such
+ * as "./employee3 --backend=array", is run with them before the database
+ * file. Every operation ends when the program prompts for the next option.
+ * The results are printed as one JSON object per program, size and
+ * operation, giving the total time, the throughput (records per second for
+ * load, print and export, operations per second otherwise) and the 50th
+ * and 99th percentile latencies.
+ *
+ * The database files are generated deterministically and kept in the
+ * working directory as bench-<records>.txt, so later runs reuse them; a
+ * file can also be generated by itself with --generate.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define DEFAULT_SIZES      "1000,100000,10000000"
+#define DEFAULT_OPERATIONS 1000
+#define DEFAULT_RUNS       3
+#define MAX_SIZES          16
+
+#define PROMPT "Enter option: "
+
+static const char *surnames[16] = {
+        "Smith", "Jones", "Brown", "Taylor", "Wilson", "Davies", "Evans", "Thomas",
+        "Johnson", "Roberts", "Walker", "Wright", "Robinson", "Thompson", "White", "Hughes"
+};
+static const char *first_names[16] = {
+        "Ann", "Ben", "Cara", "Dan", "Eve", "Finn", "Gina", "Hugo",
+        "Ivy", "Jack", "Kate", "Liam", "Mia", "Noah", "Olive", "Paul"
+};
+static const char *jobs[12] = {
+        "Analyst", "Engineer", "Manager", "Driver", "Clerk", "Nurse",
+        "Teacher", "Designer", "Chef", "Accountant", "Technician", "Director"
+};
+
+struct Program
+{
+        const char *path;
+        pid_t pid;
+        int input;                /* pipe to its standard input */
+        int prompts;              /* pipe from its standard error */
+        char tail[sizeof(PROMPT)]; /* last bytes read, to find a split prompt */
+        size_t tail_length;
+        char *menu;               /* everything before the first prompt */
+        size_t menu_length;
+        int add_code, delete_code, print_code, export_code, prefix_code, exit_code;
+};
+
+struct Timings
+{
+        const char *operation;
+        double *samples;          /* seconds */
+        size_t count, max;
+        double records;           /* records handled by load, print and export */
+};
+
+static void *bench_alloc ( void *old, size_t size )
+{
+        void *block = realloc(old, size);
+
+        if ( block == NULL ) {
+                fprintf(stderr, "Out of memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        return block;
+}
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* mixes an employee number into well spread bits (splitmix64) */
+static uint64_t employee_hash ( uint64_t i )
+{
+        uint64_t z = i + 0x9e3779b97f4a7c15ULL;
+
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+}
+
+/* employee_name():
+ *
+ * Writes the name of employee number "i" into "name". The number is part
+ * of the surname, so every name is distinct, while the rest comes from the
+ * hash so that the file is not already in name order.
+ */
+static void employee_name ( uint64_t i, char *name, size_t size )
+{
+        uint64_t h = employee_hash(i);
+
+        snprintf(name, size, "%s%llu, %s", surnames[h & 15], (unsigned long long) i,
+                 first_names[(h >> 4) & 15]);
+}
+
+static char employee_sex ( uint64_t i )
+{
+        return (employee_hash(i) >> 8) & 1 ? 'F' : 'M';
+}
+
+static int employee_age ( uint64_t i )
+{
+        return 18 + (employee_hash(i) >> 9) % 53;
+}
+
+static const char *employee_job ( uint64_t i )
+{
+        return jobs[(employee_hash(i) >> 16) % 12];
+}
+
+/* writes a database of employees 0 to records - 1 to "file_name" */
+static void generate_database ( const char *file_name, uint64_t records )
+{
+        FILE *fp = fopen(file_name, "w");
+        char name[64];
+        uint64_t i;
+
+        if ( fp == NULL ) {
+                fprintf(stderr, "Could not create %s, exiting\n", file_name);
+                exit(EXIT_FAILURE);
+        }
+        setvbuf(fp, NULL, _IOFBF, 1 << 20);
+        for ( i = 0; i < records; i++ ) {
+                employee_name(i, name, sizeof(name));
+                fprintf(fp, "Name: %s\nSex: %c\nAge: %d\nJob: %s\n\n", name,
+                        employee_sex(i), employee_age(i), employee_job(i));
+        }
+        if ( fclose(fp) != 0 ) {
+                fprintf(stderr, "Could not write %s, exiting\n", file_name);
+                exit(EXIT_FAILURE);
+        }
+}
+
+static void copy_file ( const char *from, const char *to )
+{
+        static char buffer[1 << 20];
+        int in = open(from, O_RDONLY), out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ssize_t n;
+
+        if ( in == -1 || out == -1 ) {
+                fprintf(stderr, "Could not copy %s to %s, exiting\n", from, to);
+                exit(EXIT_FAILURE);
+        }
+        while ( (n = read(in, buffer, sizeof(buffer))) > 0 )
+                if ( write(out, buffer, n) != n ) {
+                        fprintf(stderr, "Could not copy %s to %s, exiting\n", from, to);
+                        exit(EXIT_FAILURE);
+                }
+        close(in);
+        close(out);
+}
+
+/* removes "directory" and the files in it, which the programs may add to */
+static void remove_directory ( const char *directory )
+{
+        DIR *dir = opendir(directory);
+        struct dirent *entry;
+        char path[4096];
+
+        if ( dir == NULL )
+                return;
+        while ( (entry = readdir(dir)) != NULL ) {
+                if ( strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 )
+                        continue;
+                snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+                unlink(path);
+        }
+        closedir(dir);
+        rmdir(directory);
+}
+
+/* wait_for_prompt():
+ *
+ * Reads the program's prompts until the next "Enter option: ", keeping
+ * what comes before the first one in program->menu. Exits if the program
+ * stops first.
+ */
+static void wait_for_prompt ( struct Program *program )
+{
+        char buffer[65536];
+        size_t prompt_length = strlen(PROMPT), i;
+        ssize_t n;
+
+        for (;;) {
+                n = read(program->prompts, buffer, sizeof(buffer));
+                if ( n == -1 && errno == EINTR )
+                        continue;
+                if ( n <= 0 ) {
+                        fprintf(stderr, "%s exited unexpectedly, exiting\n", program->path);
+                        exit(EXIT_FAILURE);
+                }
+                if ( program->add_code == -1 ) {
+                        program->menu = bench_alloc(program->menu, program->menu_length + n + 1);
+                        memcpy(program->menu + program->menu_length, buffer, n);
+                        program->menu_length += n;
+                        program->menu[program->menu_length] = '\0';
+                }
+                /* look for the prompt, which may straddle the last read */
+                for ( i = 0; i < (size_t) n; i++ ) {
+                        if ( program->tail_length == prompt_length ) {
+                                memmove(program->tail, program->tail + 1, prompt_length - 1);
+                                program->tail_length--;
+                        }
+                        program->tail[program->tail_length++] = buffer[i];
+                        if ( program->tail_length == prompt_length
+                             && memcmp(program->tail, PROMPT, prompt_length) == 0 ) {
+                                program->tail_length = 0;
+                                if ( i + 1 < (size_t) n ) {
+                                        fprintf(stderr, "%s: unexpected output after the prompt, exiting\n",
+                                                program->path);
+                                        exit(EXIT_FAILURE);
+                                }
+                                return;
+                        }
+                }
+        }
+}
+
+/* finds the number of the menu option described by "text", or exits */
+static int menu_code ( const struct Program *program, const char *text )
+{
+        const char *line = program->menu, *found;
+        int code;
+
+        while ( (found = strstr(line, text)) != NULL ) {
+                line = found;
+                while ( line > program->menu && line[-1] != '\n' )
+                        line--;
+                if ( sscanf(line, "%d: ", &code) == 1 )
+                        return code;
+                line = found + 1;
+        }
+        fprintf(stderr, "%s has no \"%s\" option, exiting\n", program->path, text);
+        exit(EXIT_FAILURE);
+}
+
+static void start_program ( struct Program *program, const char *database_file )
+{
+        char *words = strdup(program->path), *argv[64];
+        int input[2], prompts[2], null_fd, argc = 0;
+
+        if ( words == NULL ) {
+                fprintf(stderr, "Out of memory, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        if ( pipe(input) == -1 || pipe(prompts) == -1 ) {
+                fprintf(stderr, "Could not create pipes, exiting\n");
+                exit(EXIT_FAILURE);
+        }
+        program->pid = fork();
+        if ( program->pid == -1 ) {
+                fprintf(stderr, "Could not start %s, exiting\n", program->path);
+                exit(EXIT_FAILURE);
+        }
+        if ( program->pid == 0 ) {
+                null_fd = open("/dev/null", O_WRONLY);
+                dup2(input[0], STDIN_FILENO);
+                dup2(null_fd, STDOUT_FILENO);
+                dup2(prompts[1], STDERR_FILENO);
+                close(input[0]); close(input[1]);
+                close(prompts[0]); close(prompts[1]);
+                close(null_fd);
+                for ( argv[argc] = strtok(words, " "); argv[argc] != NULL && argc < 62; )
+                        argv[++argc] = strtok(NULL, " ");
+                argv[argc++] = (char *) database_file;
+                argv[argc] = NULL;
+                execv(argv[0], argv);
+                _exit(127);
+        }
+        free(words);
+        close(input[0]);
+        close(prompts[1]);
+        program->input = input[1];
+        program->prompts = prompts[0];
+        program->tail_length = 0;
+}
+
+/* sends one menu choice and its answers, and returns how long it took */
+static double run_operation ( struct Program *program, const char *commands )
+{
+        size_t length = strlen(commands);
+        double start = now();
+
+        if ( write(program->input, commands, length) != (ssize_t) length ) {
+                fprintf(stderr, "%s stopped reading, exiting\n", program->path);
+                exit(EXIT_FAILURE);
+        }
+        wait_for_prompt(program);
+        return now() - start;
+}
+
+static void add_sample ( struct Timings *timings, double seconds )
+{
+        if ( timings->count == timings->max ) {
+                timings->max = timings->max == 0 ? 1024 : timings->max * 2;
+                timings->samples = bench_alloc(timings->samples, timings->max * sizeof(double));
+        }
+        timings->samples[timings->count++] = seconds;
+}
+
+static int compare_doubles ( const void *p, const void *q )
+{
+        double a = *(const double *) p, b = *(const double *) q;
+
+        return (a > b) - (a < b);
+}
+
+/* nearest-rank percentile of the sorted samples, in microseconds */
+static double percentile ( const struct Timings *timings, double fraction )
+{
+        size_t rank = (size_t) ceil(fraction * timings->count);
+
+        return timings->samples[rank > 0 ? rank - 1 : 0] * 1e6;
+}
+
+static void print_json_string ( const char *text )
+{
+        putchar('"');
+        for ( ; *text != '\0'; text++ ) {
+                if ( *text == '"' || *text == '\\' )
+                        putchar('\\');
+                putchar(*text);
+        }
+        putchar('"');
+}
+
+static void report_timings ( const char *path, uint64_t records, struct Timings *timings )
+{
+        double total = 0;
+        size_t i;
+
+        if ( timings->count == 0 )
+                return;
+        for ( i = 0; i < timings->count; i++ )
+                total += timings->samples[i];
+        qsort(timings->samples, timings->count, sizeof(double), compare_doubles);
+
+        printf("{\"program\": ");
+        print_json_string(path);
+        printf(", \"records\": %llu, \"operation\": \"%s\", \"samples\": %zu, "
+               "\"seconds\": %.6f, \"throughput\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f}\n",
+               (unsigned long long) records, timings->operation, timings->count, total,
+               (timings->records > 0 ? timings->records : timings->count) / total,
+               percentile(timings, 0.5), percentile(timings, 0.99));
+        fflush(stdout);
+        timings->count = 0;
+        timings->records = 0;
+}
+
+/* bench_program():
+ *
+ * Runs "path" "runs" times on a copy of "database_file", which holds
+ * "records" employees, timing the load, then "operations" lookups, a print,
+ * an export, "operations" adds and "operations" deletes, and reports the results.
+ * Each run looks up, adds and deletes different employees.
+ */
+static void bench_program ( const char *path, const char *database_file, uint64_t records,
+                            uint64_t operations, int runs, const char *directory )
+{
+        struct Timings load = { "load", NULL, 0, 0, 0 }, lookup = { "lookup", NULL, 0, 0, 0 },
+                       print = { "print", NULL, 0, 0, 0 }, export = { "export", NULL, 0, 0, 0 },
+                       add = { "add", NULL, 0, 0, 0 }, delete = { "delete", NULL, 0, 0, 0 };
+        struct Program program;
+        char run_directory[4096], run_file[4096 + 16], name[64], commands[4096 + 64];
+        uint64_t k, i;
+        double start;
+        int run, status;
+
+        snprintf(run_directory, sizeof(run_directory), "%s/bench-run.%ld", directory, (long) getpid());
+        snprintf(run_file, sizeof(run_file), "%s/employees.txt", run_directory);
+        for ( run = 0; run < runs; run++ ) {
+                remove_directory(run_directory);
+                if ( mkdir(run_directory, 0755) == -1 ) {
+                        fprintf(stderr, "Could not create %s, exiting\n", run_directory);
+                        exit(EXIT_FAILURE);
+                }
+                copy_file(database_file, run_file);
+
+                memset(&program, 0, sizeof(program));
+                program.path = path;
+                program.add_code = -1;
+                start = now();
+                start_program(&program, run_file);
+                wait_for_prompt(&program);
+                add_sample(&load, now() - start);
+                load.records += records;
+                program.add_code = menu_code(&program, "Add new employee");
+                program.delete_code = menu_code(&program, "Delete employee");
+                program.print_code = menu_code(&program, "Print database to screen");
+                program.export_code = menu_code(&program, "Write database to file");
+                program.prefix_code = menu_code(&program, "Find names starting with");
+                program.exit_code = menu_code(&program, "Exit database program");
+
+                for ( k = 0; k < operations; k++ ) {
+                        i = ((run * operations + k) * 2654435761ULL) % records;
+                        employee_name(i, name, sizeof(name));
+                        snprintf(commands, sizeof(commands), "%d\n%s\n", program.prefix_code, name);
+                        add_sample(&lookup, run_operation(&program, commands));
+                }
+
+                snprintf(commands, sizeof(commands), "%d\n", program.print_code);
+                add_sample(&print, run_operation(&program, commands));
+                print.records += records;
+
+                snprintf(commands, sizeof(commands), "%d\n%s/export.txt\n", program.export_code,
+                         run_directory);
+                add_sample(&export, run_operation(&program, commands));
+                export.records += records;
+
+                for ( k = 0; k < operations; k++ ) {
+                        i = records + run * operations + k;
+                        employee_name(i, name, sizeof(name));
+                        snprintf(commands, sizeof(commands), "%d\n%s\n%c\n%d\n%s\n", program.add_code,
+                                 name, employee_sex(i), employee_age(i), employee_job(i));
+                        add_sample(&add, run_operation(&program, commands));
+                }
+
+                /* 2654435761 is prime, so these are all different employees */
+                for ( k = 0; k < operations && k < records; k++ ) {
+                        i = (k * 2654435761ULL + run * 7919ULL) % records;
+                        employee_name(i, name, sizeof(name));
+                        snprintf(commands, sizeof(commands), "%d\n%s\n", program.delete_code, name);
+                        add_sample(&delete, run_operation(&program, commands));
+                }
+
+                snprintf(commands, sizeof(commands), "%d\n", program.exit_code);
+                if ( write(program.input, commands, strlen(commands)) < 0 )
+                        fprintf(stderr, "%s stopped reading\n", path);
+                close(program.input);
+                close(program.prompts);
+                waitpid(program.pid, &status, 0);
+                free(program.menu);
+        }
+        remove_directory(run_directory);
+
+        report_timings(path, records, &load);
+        report_timings(path, records, &lookup);
+        report_timings(path, records, &print);
+        report_timings(path, records, &export);
+        report_timings(path, records, &add);
+        report_timings(path, records, &delete);
+        free(load.samples); free(lookup.samples); free(print.samples);
+        free(export.samples); free(add.samples); free(delete.samples);
+}
+
+static void usage ( const char *name )
+{
+        fprintf(stderr, "Usage: %s [--sizes <records>[,<records>...]] [--operations <n>]\n"
+                "       [--runs <n>] [--dir <directory>] <program>...\n"
+                "       %s --generate <records> <database-file>\n", name, name);
+        exit(-1);
+}
+
+int main ( int argc, char *argv[] )
+{
+        const char *sizes = DEFAULT_SIZES, *directory = ".";
+        uint64_t size_list[MAX_SIZES], operations = DEFAULT_OPERATIONS;
+        int num_sizes = 0, runs = DEFAULT_RUNS, i, p, s;
+        char database_file[4096], *end;
+        struct stat info;
+
+        if ( argc == 4 && strcmp(argv[1], "--generate") == 0 ) {
+                generate_database(argv[3], strtoull(argv[2], NULL, 10));
+                return 0;
+        }
+
+        for ( i = 1; i < argc && argv[i][0] == '-'; i += 2 ) {
+                if ( i + 1 >= argc )
+                        usage(argv[0]);
+                if ( strcmp(argv[i], "--sizes") == 0 )
+                        sizes = argv[i + 1];
+                else if ( strcmp(argv[i], "--operations") == 0 )
+                        operations = strtoull(argv[i + 1], NULL, 10);
+                else if ( strcmp(argv[i], "--runs") == 0 )
+                        runs = atoi(argv[i + 1]);
+                else if ( strcmp(argv[i], "--dir") == 0 )
+                        directory = argv[i + 1];
+                else
+                        usage(argv[0]);
+        }
+        if ( i == argc || runs <= 0 )
+                usage(argv[0]);
+
+        for ( end = (char *) sizes; *end != '\0' && num_sizes < MAX_SIZES; ) {
+                size_list[num_sizes] = strtoull(end, &end, 10);
+                if ( size_list[num_sizes] == 0 || (*end != ',' && *end != '\0') )
+                        usage(argv[0]);
+                num_sizes++;
+                if ( *end == ',' )
+                        end++;
+        }
+
+        signal(SIGPIPE, SIG_IGN);
+        for ( s = 0; s < num_sizes; s++ ) {
+                snprintf(database_file, sizeof(database_file), "%s/bench-%llu.txt",
+                         directory, (unsigned long long) size_list[s]);
+                if ( stat(database_file, &info) == -1 ) {
+                        fprintf(stderr, "Generating %s\n", database_file);
+                        generate_database(database_file, size_list[s]);
+                }
+                for ( p = i; p < argc; p++ )
+                        bench_program(argv[p], database_file, size_list[s], operations, runs, directory);
+        }
+        return 0;
+}